@@ -1,8 +1,20 @@
 class FileManager {
 
     #view;
+    #list;                      // the element holding the visible items
     #info;
     #trash;
+    #items = [];                // the items in the current directory, in order
+    #paths = new Map();         // the items by path
+    #rendered = new Map();      // the elements of the visible items by path
+    #rowHeight = 0;
+    #frame = 0;
+    #refreshing = new Set();    // paths waiting to be refreshed
+    #refreshTimer = 0;
+    #chdirs = 0;
+    #listed = null;             // the directory the items are from
+    #source = null;             // the EventSource watching it
+    #nowatch = false;           // the server can't watch, so don't ask again
 
     constructor(elt, cgi, config) {
         const self = this;
@@ -12,12 +24,16 @@ class FileManager {
         this.elt = elt;
         this.cgi = cgi;
         this.elt.classList.add("filemanager");
-        this.chdir("/");
         this.config = config || {};
 
         const view = document.createElement("div");
         view.classList.add("filemanager-view");
         this.elt.appendChild(view);
+        const list = document.createElement("div");
+        list.classList.add("filemanager-items");
+        view.appendChild(list);
+        view.addEventListener("scroll", () => self.#schedule());
+        new ResizeObserver(() => self.#schedule()).observe(view);
 
         const info = document.createElement("div");
         info.classList.add("filemanager-status");
@@ -63,7 +79,7 @@ class FileManager {
                         }
                     }
                 });
-                self.#loader(files, 0, null, 0);
+                self.#loader(files);
              }
          });
          trash.addEventListener("dragover", (e) => {
@@ -73,15 +89,18 @@ class FileManager {
          trash.addEventListener("drop", (e) => {
              e.preventDefault();
              trash.classList.add("hidden");
+             // The path is taken from the id, as the item's element may have left the DOM while it was dragged
              const id = e.dataTransfer.getData("text/plain");
-             if (id.startsWith(self.elt.id + "-path-")) {
-                 const node = document.getElementById(id);
-                 self.deleteItem(node.getAttribute("data-path"));
+             const prefix = self.elt.id + "-path-";
+             if (id.startsWith(prefix) && self.#paths.has(id.substring(prefix.length))) {
+                 self.deleteItem(id.substring(prefix.length));
              }
          });
         this.#view = view;
+        this.#list = list;
         this.#info = info;
         this.#trash = trash;
+        this.chdir("/");
     }
 
     /**
@@ -112,93 +131,605 @@ class FileManager {
     }
 
     /**
+     * Upload a list of files and directories, recursing into directories.
+     * Runs of small files are sent in batches with "bulk"; other files are
+     * streamed from disk with File.slice() and sent in chunks with "put",
+     * several files at once and, as an upload session, several chunks of a
+     * file at once. The chunk size follows the measured throughput so each
+     * chunk takes about a second. Files the server already has are skipped.
+     * If chunks of a session fail, the ranges the server is missing are sent
+     * again, and if that fails too the session is cancelled
      * @param files a list of FileSystemEntry objects
-     * @param fileIndex the item from files to process
-     * @param content the content of the current file (or null initially)
-     * @param chunkIndex which chunk is being uploaded (0 initially)
      * @callback when everything is processed, an optional function to callback
      */
-    #loader(files, fileIndex, content, chunkIndex, callback) {
-        try {
-            const self = this;
-            const viewpath = self.#view.getAttribute("data-path");
-            //console.log("#loader: " + fileIndex+"/"+content+"/"+chunkIndex);
-            const chunkSize = 32768;
-            if (!content) {
-                if (fileIndex < files.length) {
-                    const file = files[fileIndex];
-                    if (file.isFile) {
-                        file.file((f) => {
-                            f.arrayBuffer().then((e) => {
-                                self.#loader(files, fileIndex, e, 0, callback);
-                            }).catch((e) => {
-                                self.log("Load failed with " + e.message, "error");
-                                self.#loader(files, ++fileIndex, null, 0, callback);
-                            });
-                        });
-                    } else if (file.isDirectory) {
-                        let target = file.target + file.name + "/";
-                        file.createReader().readEntries((list) => {
-                            list.forEach((subfile) => {
-                                subfile.target = target;
-                            });
-                            self.#loader(list, 0, null, 0, () => {
-                                self.refresh([file.target + file.name]);
-                                self.#loader(files, ++fileIndex, null, 0, callback);
-                            });
-                        });
+    #loader(files, callback) {
+        const self = this;
+        const maxFiles = 4, maxRequests = 4;                    // files, and chunk requests, in progress at once
+        const minChunk = 256 << 10, maxChunk = 16 << 20, chunkTime = 1000;
+        const maxRetries = 2;                                   // times the missing parts of a file are sent again
+        const t = {
+            start: performance.now(),
+            total: 0,           // bytes to send, growing as files are found
+            sent: 0,
+            files: 0,           // files still to send
+            errors: 0,
+            chunk: minChunk,
+            requests: 0,
+            waiting: [],        // chunks waiting for a request slot
+            jobs: new Set(),
+            shown: 0
+        };
+        const status = () => {
+            const now = performance.now();
+            if (now - t.shown < 250) {
+                return;
+            }
+            t.shown = now;
+            const seconds = (now - t.start) / 1000;
+            const rate = t.sent / seconds;
+            let msg = "Uploading " + t.files + " file" + (t.files == 1 ? "" : "s") + ": " + FileManager.#size(t.sent) + " of " + FileManager.#size(t.total);
+            if (seconds > 1 && rate > 0) {
+                const eta = Math.ceil((t.total - t.sent) / rate);
+                msg += " at " + FileManager.#size(rate) + "/s, " + (eta >= 60 ? Math.floor(eta / 60) + "m" + String(eta % 60).padStart(2, "0") + "s" : eta + "s") + " left";
+            }
+            self.log(msg, null, t.total ? t.sent / t.total : 0);
+        };
+        const acquire = () => {
+            if (t.requests < maxRequests) {
+                t.requests++;
+                return Promise.resolve();
+            }
+            return new Promise((resolve) => t.waiting.push(resolve));
+        };
+        const release = () => {
+            const next = t.waiting.shift();
+            if (next) {
+                next();
+            } else {
+                t.requests--;
+            }
+        };
+        // Send one chunk of f, as part of a session of length "len" if given, resolving to the reply or null
+        const put = (name, f, off, size, len) => {
+            let uri = self.cgi + "/put?path=" + encodeURIComponent(name) + "&off=" + off + (len === undefined ? "" : "&len=" + len);
+            const start = performance.now();
+            console.log("Tx " + uri);
+            return fetch(uri, {
+                "method": "POST",
+                "headers": {
+                    "content-type": "application/octet-stream"
+                },
+                "body": f.slice(off, off + size)
+            }).then((r) => r.json()).then((r) => {
+                console.log("Rx " + uri);
+                if (!r.ok) {
+                    throw new Error(r.msg);
+                }
+                t.sent += size;
+                if (size >= t.chunk) {
+                    // Aim for chunkTime per chunk at this rate, growing by no more than double each time
+                    const target = size / Math.max(1, performance.now() - start) * chunkTime;
+                    let chunk = minChunk;
+                    while (chunk < maxChunk && chunk * 2 <= target) {
+                        chunk *= 2;
                     }
+                    t.chunk = Math.min(chunk, t.chunk * 2);
+                }
+                status();
+                return r;
+            }).catch((e) => {
+                self.log("Upload of \"" + name + "\" failed: " + e.message, "error");
+                return null;
+            });
+        };
+        // The [offset, length] of each range an upload session is still missing, or null if there's no session
+        const remaining = (name) => {
+            const uri = self.cgi + "/upload?path=" + encodeURIComponent(name);
+            console.log("Tx " + uri);
+            return fetch(uri).then((r) => r.json()).then((r) => r.ok ? r.missing : null).catch(() => null);
+        };
+        // Send a file, unless the server has it
+        const send = async (name, f) => {
+            t.total += f.size;
+            t.files++;
+            status();
+            const missing = await new Promise((resolve) => self.#have([{ path: name, file: f }], resolve));
+            let ok = true;
+            if (missing.has(name)) {
+                if (f.size <= t.chunk) {
+                    await acquire();
+                    ok = await put(name, f, 0, f.size).finally(release) != null;
                 } else {
-                    self.log(viewpath, "breadcrumb");
-                    if (callback) {
-                        callback();
+                    // If a chunk fails, ask the server what's missing and send that, up to maxRetries times
+                    let todo = [[0, f.size]];
+                    for (let retry = 0; todo && retry <= maxRetries; retry++) {
+                        const chunks = [];
+                        ok = true;
+                        for (const [start, length] of todo) {
+                            for (let off = start; off < start + length && ok; ) {
+                                await acquire();
+                                const size = Math.min(t.chunk, start + length - off);
+                                chunks.push(put(name, f, off, size, f.size).finally(release).then((r) => ok = ok && r != null));
+                                off += size;
+                            }
+                        }
+                        await Promise.all(chunks);
+                        todo = ok || retry == maxRetries ? null : await remaining(name);
+                    }
+                    if (!ok) {
+                        // Don't leave the server holding the space for it
+                        const uri = self.cgi + "/upload?path=" + encodeURIComponent(name) + "&cancel=1";
+                        console.log("Tx " + uri);
+                        fetch(uri, { "method": "POST" }).catch(() => null);
                     }
                 }
             } else {
-                const file = files[fileIndex];
-                const target = file.target;
-                const name = target + file.name;
-                const chunk = content.slice(chunkIndex * chunkSize, Math.min(content.byteLength, (chunkIndex + 1) * chunkSize));
-                let uri = self.cgi + "/put?path=" + encodeURIComponent(name) + "&off=" + (chunkSize * chunkIndex);
-                console.log("Tx " + uri);
-                fetch(uri, {
-                    "method": "POST",
-                    "headers": {
-                        "content-type": "application/octet-stream",
-                        "content-length": chunk.length
-                    },
-                    "body": chunk
-                }).then((r) => r.json().then((r) => {
-                    console.log("Rx " + uri);
-                    if (r.ok) {
-                        chunkIndex++;
-                        let progress = chunkIndex * chunkSize / content.byteLength;
-                        self.log("Uploading \"" + name + "\"", null, progress);
-                        if (progress >= 1) {
-                            self.refresh([name]);
-                            self.#loader(files, ++fileIndex, null, 0, callback);
-                        } else {
-                            self.#loader(files, fileIndex, content, chunkIndex, callback);
+                t.total -= f.size;
+            }
+            if (!ok) {
+                t.errors++;
+            }
+            t.files--;
+            self.refresh([name]);
+        };
+        const walk = async (files) => {
+            for (let i = 0; i < files.length; ) {
+                const file = files[i];
+                if (file.isFile) {
+                    const next = await new Promise((resolve) => self.#bulk(t, files, i, resolve));
+                    if (next > i) {
+                        i = next;
+                        status();
+                        continue;
+                    }
+                    i++;
+                    try {
+                        const f = await new Promise((resolve, reject) => file.file(resolve, reject));
+                        while (t.jobs.size >= maxFiles) {
+                            await Promise.race(t.jobs);
                         }
-                    } else {
-                        self.log("Upload failed with " + r.status, "error");
-                        self.#loader(files, ++fileIndex, null, 0, callback);
+                        const job = send(file.target + file.name, f).finally(() => t.jobs.delete(job));
+                        t.jobs.add(job);
+                    } catch (e) {
+                        self.log("Load failed with " + e.message, "error");
+                        t.errors++;
                     }
-                }));
+                } else if (file.isDirectory) {
+                    i++;
+                    const target = file.target + file.name + "/";
+                    const reader = file.createReader();
+                    let list = [], more;
+                    // readEntries returns the entries a batch at a time
+                    while ((more = await new Promise((resolve, reject) => reader.readEntries(resolve, reject))).length) {
+                        list.push(...more);
+                    }
+                    list.forEach((subfile) => {
+                        subfile.target = target;
+                    });
+                    await walk(list);
+                    self.refresh([file.target + file.name]);
+                } else {
+                    i++;
+                }
             }
-        } catch (e) {
+        };
+        walk(files).catch((e) => {
             console.log(e);
+            t.errors++;
+        }).then(() => Promise.all(t.jobs)).then(() => {
+            if (t.errors) {
+                self.log(t.errors + " upload" + (t.errors == 1 ? "" : "s") + " failed", "error");
+            } else {
+                self.log(self.#view.getAttribute("data-path"), "breadcrumb");
+            }
+            if (callback) {
+                callback();
+            }
+        });
+    }
+
+    /**
+     * Upload the small files from files[fileIndex] on in one "bulk" request,
+     * packed into a tar archive, stopping at the first directory or large
+     * file. Calls next with the index of the first file not uploaded, which
+     * is fileIndex if there weren't enough small files to be worth it. Files
+     * the server says it already has aren't sent
+     * @param t the state of the upload from #loader, for its progress
+     * @param files a list of FileSystemEntry objects
+     * @param fileIndex the first item from files to process
+     * @param next the function to call when done
+     */
+    #bulk(t, files, fileIndex, next) {
+        const self = this;
+        const maxFile = 65536, maxCount = 1000, maxSize = 4 << 20;
+        const batch = [];
+        let size = 0;
+        const send = (end) => {
+            if (batch.length < 2) {
+                next(fileIndex);
+                return;
+            }
+            self.#have(batch, (missing) => upload(end, batch.filter((b) => missing.has(b.path))));
+        };
+        const upload = (end, todo) => {
+            if (todo.length == 0) {
+                self.refresh(batch.map((b) => b.path));
+                next(end);
+                return;
+            }
+            const parts = [];
+            let length = 0;
+            for (const b of todo) {
+                length += b.file.size;
+                parts.push(...self.#tarheader(b.path.substring(1), b.file.size, b.file.lastModified));
+                parts.push(b.file);
+                parts.push(new Uint8Array((512 - b.file.size % 512) % 512));
+            }
+            parts.push(new Uint8Array(1024));   // end of archive
+            const uri = self.cgi + "/bulk";
+            console.log("Tx " + uri + " with " + todo.length + " files");
+            t.total += length;
+            fetch(uri, {
+                "method": "POST",
+                "headers": {
+                    "content-type": "application/x-tar"
+                },
+                "body": new Blob(parts)
+            }).then((r) => r.json()).then((r) => {
+                console.log("Rx " + uri);
+                for (const p of r.paths || []) {
+                    if (!p.ok) {
+                        self.log("Upload of \"" + p.path + "\" failed: " + p.msg, "error");
+                        t.errors++;
+                    }
+                }
+                if (!r.ok) {
+                    self.log("Upload failed: " + r.msg, "error");
+                    t.errors++;
+                }
+                t.sent += length;
+                self.refresh(batch.map((b) => b.path));
+                next(end);
+            }).catch((e) => {
+                self.log("Upload failed with " + e.message, "error");
+                t.errors++;
+                t.sent += length;
+                next(end);
+            });
+        };
+        const add = (i) => {
+            const file = files[i];
+            if (i < files.length && file.isFile && batch.length < maxCount && size < maxSize) {
+                file.file((f) => {
+                    if (f.size <= maxFile) {
+                        batch.push({ path: file.target + file.name, file: f });
+                        size += f.size;
+                        add(i + 1);
+                    } else {
+                        send(i);
+                    }
+                }, () => send(i));
+            } else {
+                send(i);
+            }
+        };
+        add(fileIndex);
+    }
+
+    /**
+     * Ask the server which of a list of files it doesn't already have, by
+     * their length and hash, and call next with a Set of their paths. If
+     * the server can't say, all are taken to be missing
+     * @param items a list of objects with "path" and "file", a Blob
+     * @param next the function to call when done
+     */
+    #have(items, next) {
+        const self = this;
+        const uri = self.cgi + "/have";
+        Promise.all(items.map((b) => FileManager.#xxh64(b.file))).then((hashes) => {
+            const body = items.map((b, i) => "path=" + encodeURIComponent(b.path) + "&length=" + b.file.size + "&hash=" + hashes[i]).join("&");
+            console.log("Tx " + uri + " with " + items.length + " files");
+            return fetch(uri, {
+                "method": "POST",
+                "headers": {
+                    "content-type": "application/x-www-form-urlencoded"
+                },
+                "body": body
+            });
+        }).then((r) => r.json()).then((r) => {
+            console.log("Rx " + uri);
+            if (!r.ok) {
+                throw new Error(r.msg);
+            }
+            const missing = new Set(items.map((b) => b.path));
+            for (const p of r.paths) {
+                if (p.have != "missing") {
+                    missing.delete("/" + p.path);   // the server's paths have no leading "/"
+                }
+            }
+            next(missing);
+        }).catch(() => {
+            next(new Set(items.map((b) => b.path)));
+        });
+    }
+
+    /**
+     * Resolve to the XXH64 hash of a Blob as 16 hex digits, as the server
+     * computes it, reading it a slice at a time rather than all at once.
+     * 64-bit values are held as [high, low] 32-bit halves
+     */
+    static async #xxh64(blob) {
+        const slice = 4 << 20;      // a multiple of the 32 byte stripe, so only the last slice has a tail
+        const add = (a, b) => {
+            const lo = a[1] + b[1];
+            return [(a[0] + b[0] + (lo > 0xffffffff ? 1 : 0)) >>> 0, lo >>> 0];
+        };
+        const mulhi = (x, y) => {
+            // The high half of the product of 32-bit x and y, in 16-bit pieces to stay exact
+            const x0 = x & 0xffff, x1 = x >>> 16, y0 = y & 0xffff, y1 = y >>> 16;
+            const p01 = x0 * y1, p10 = x1 * y0;
+            const mid = ((x0 * y0) >>> 16) + (p01 & 0xffff) + (p10 & 0xffff);
+            return x1 * y1 + (p01 >>> 16) + (p10 >>> 16) + (mid >>> 16);
+        };
+        const mul = (a, b) => [(mulhi(a[1], b[1]) + Math.imul(a[0], b[1]) + Math.imul(a[1], b[0])) >>> 0, Math.imul(a[1], b[1]) >>> 0];
+        const rotl = (a, r) => [((a[0] << r) | (a[1] >>> (32 - r))) >>> 0, ((a[1] << r) | (a[0] >>> (32 - r))) >>> 0];
+        const shr = (a, r) => r >= 32 ? [0, a[0] >>> (r - 32)] : [a[0] >>> r, ((a[1] >>> r) | (a[0] << (32 - r))) >>> 0];
+        const xor = (a, b) => [(a[0] ^ b[0]) >>> 0, (a[1] ^ b[1]) >>> 0];
+        const P1 = [0x9E3779B1, 0x85EBCA87], P2 = [0xC2B2AE3D, 0x27D4EB4F], P3 = [0x165667B1, 0x9E3779F9], P4 = [0x85EBCA77, 0xC2B2AE63], P5 = [0x27D4EB2F, 0x165667C5];
+        const round = (acc, input) => mul(rotl(add(acc, mul(input, P2)), 31), P1);
+        // The stripes are most of the work, so they're hashed in place rather than with the helpers' arrays
+        const state = new Uint32Array([...add(P1, P2), P2[0], P2[1], 0, 0, 0x61C8864E, 0x7A143579]);   // P1+P2, P2, 0, -P1
+        const stripes = (view, end) => {
+            const p1h = P1[0], p1l = P1[1], p2h = P2[0], p2l = P2[1];
+            for (let p = 0; p < end; p += 32) {
+                for (let i = 0; i < 8; i += 2) {
+                    // acc = rotl(acc + input * P2, 31) * P1
+                    const il = view.getUint32(p + i * 4, true), ih = view.getUint32(p + i * 4 + 4, true);
+                    const al = state[i + 1];
+                    const lo = (al + Math.imul(il, p2l)) >>> 0;
+                    const hi = (state[i] + mulhi(il, p2l) + Math.imul(ih, p2l) + Math.imul(il, p2h) + (lo < al ? 1 : 0)) >>> 0;
+                    const rl = (lo << 31 | hi >>> 1) >>> 0, rh = (hi << 31 | lo >>> 1) >>> 0;
+                    state[i] = mulhi(rl, p1l) + Math.imul(rh, p1l) + Math.imul(rl, p1h);
+                    state[i + 1] = Math.imul(rl, p1l);
+                }
+            }
+        };
+        const len = blob.size;
+        let data = new Uint8Array(0), view = new DataView(data.buffer), p = 0, h;
+        for (let off = 0; off < len; off += slice) {
+            data = new Uint8Array(await blob.slice(off, off + slice).arrayBuffer());
+            view = new DataView(data.buffer);
+            p = data.length & ~31;
+            stripes(view, p);
+        }
+        const read64 = (p) => [view.getUint32(p + 4, true), view.getUint32(p, true)];
+        const v = [0, 2, 4, 6].map((i) => [state[i], state[i + 1]]);
+        if (len >= 32) {
+            h = add(add(rotl(v[0], 1), rotl(v[1], 7)), add(rotl(v[2], 12), rotl(v[3], 18)));
+            for (const x of v) {
+                h = add(mul(xor(h, round([0, 0], x)), P1), P4);
+            }
+        } else {
+            h = P5;
+        }
+        h = add(h, [Math.floor(len / 0x100000000), len >>> 0]);
+        for (; p + 8 <= data.length; p += 8) {
+            h = add(mul(rotl(xor(h, round([0, 0], read64(p))), 27), P1), P4);
         }
+        if (p + 4 <= data.length) {
+            h = add(mul(rotl(xor(h, mul([0, view.getUint32(p, true)], P1)), 23), P2), P3);
+            p += 4;
+        }
+        for (; p < data.length; p++) {
+            h = mul(rotl(xor(h, mul([0, data[p]], P5)), 11), P1);
+        }
+        h = mul(xor(h, shr(h, 33)), P2);
+        h = mul(xor(h, shr(h, 29)), P3);
+        h = xor(h, shr(h, 32));
+        return h[0].toString(16).padStart(8, "0") + h[1].toString(16).padStart(8, "0");
     }
 
+    /**
+     * Return a number of bytes as text, such as "1.5 MB"
+     */
+    static #size(n) {
+        const units = ["bytes", "KB", "MB", "GB", "TB"];
+        let i = 0;
+        for (; n >= 1024 && i + 1 < units.length; i++) {
+            n /= 1024;
+        }
+        return (i == 0 ? Math.round(n) : n.toFixed(n < 10 ? 1 : 0)) + " " + units[i];
+    }
+
+    /**
+     * Return the tar headers for a file, as a list of Uint8Arrays: a pax
+     * header first if the name is too long for a ustar header
+     */
+    #tarheader(name, size, mtime) {
+        const enc = new TextEncoder();
+        const header = (name, size, type) => {
+            const h = new Uint8Array(512);
+            const field = (s, off, len) => h.set(enc.encode(s).subarray(0, len), off);
+            const octal = (v, off, len) => field(Math.floor(v).toString(8).padStart(len - 1, "0"), off, len - 1);
+            field(name, 0, 100);
+            octal(0o644, 100, 8);
+            octal(0, 108, 8);
+            octal(0, 116, 8);
+            octal(size, 124, 12);
+            octal(mtime / 1000, 136, 12);
+            field("        ", 148, 8);
+            field(type, 156, 1);
+            field("ustar\u000000", 257, 8);
+            octal(h.reduce((a, b) => a + b, 0), 148, 7);
+            return h;
+        };
+        if (enc.encode(name).length <= 100) {
+            return [header(name, size, "0")];
+        }
+        // A pax record is "<length> path=<name>\n", the length including itself
+        const record = " path=" + name + "\n";
+        let len = enc.encode(record).length;
+        len += String(len + String(len).length).length;
+        const data = enc.encode(len + record);
+        return [header("PaxHeader", data.length, "x"), data, new Uint8Array((512 - data.length % 512) % 512), header(name, size, "0")];
+    }
+
+    /**
+     * Add or update an item in the listing. Items are kept in an array in
+     * order, found by binary search with config.comparator if there is one
+     * (otherwise new items go at the end), and only those that are visible
+     * have an element
+     * @param props the item's details from "info", with its full "path"
+     */
     #newitem(props) {
+        const old = this.#paths.get(props.path);
+        if (old) {
+            this.#items.splice(this.#indexof(old), 1);     // and put back, as what it's sorted by may have changed
+        }
+        this.#paths.set(props.path, props);
+        this.#items.splice(this.#insertion(props), 0, props);
+        this.#schedule();
+    }
+
+    #removeitem(path) {
+        const props = this.#paths.get(path);
+        if (props) {
+            this.#items.splice(this.#indexof(props), 1);
+            this.#paths.delete(path);
+            this.#schedule();
+        }
+    }
+
+    #compare(a, b) {
+        if (a.name == ".." || b.name == "..") {
+            return a.name == ".." ? b.name == ".." ? 0 : -1 : 1;
+        }
+        return this.config.comparator ? this.config.comparator(a, b) : 0;
+    }
+
+    /**
+     * Return where props would go in the items, after any it compares equal to
+     */
+    #insertion(props) {
+        const items = this.#items;
+        let lo = 0, hi = items.length;
+        if (!this.config.comparator && props.name != "..") {
+            return hi;
+        }
+        while (lo < hi) {
+            const mid = (lo + hi) >>> 1;
+            if (this.#compare(items[mid], props) <= 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    #indexof(props) {
+        const items = this.#items;
+        if (!this.config.comparator) {
+            return items.indexOf(props);
+        }
+        // The first that doesn't compare before it, then along any that compare equal
+        let lo = 0, hi = items.length;
+        while (lo < hi) {
+            const mid = (lo + hi) >>> 1;
+            if (this.#compare(items[mid], props) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        while (lo < items.length && items[lo] !== props) {
+            lo++;
+        }
+        return lo;
+    }
+
+    /**
+     * Render the visible items at the next animation frame
+     */
+    #schedule() {
+        if (!this.#frame) {
+            this.#frame = requestAnimationFrame(() => {
+                this.#frame = 0;
+                this.#render();
+            });
+        }
+    }
+
+    /**
+     * Give elements to the rows of items that are visible, and a few either
+     * side, and pad the list for the rows above and below so it scrolls as
+     * if every item were there. Items are in a grid of equal sized cells
+     */
+    #render() {
+        const view = this.#view, list = this.#list, items = this.#items;
+        const overscan = 2;     // rows rendered beyond those visible
+        const style = getComputedStyle(list);
+        const columns = Math.max(1, style.gridTemplateColumns.split(" ").length);
+        const rowHeight = (this.#rowHeight || parseFloat(getComputedStyle(view).getPropertyValue("--grid-size")) || 200) + (parseFloat(style.rowGap) || 0);
+        const rows = Math.ceil(items.length / columns);
+        const top = view.scrollTop - list.offsetTop;
+        const first = Math.min(rows, Math.max(0, Math.floor(top / rowHeight) - overscan));
+        const last = Math.min(rows, Math.ceil((top + view.clientHeight) / rowHeight) + overscan);
+        list.style.paddingTop = (first * rowHeight) + "px";
+        list.style.paddingBottom = ((rows - last) * rowHeight) + "px";
+
+        const rendered = new Map();
+        const children = [];
+        for (let i = first * columns; i < Math.min(items.length, last * columns); i++) {
+            const props = items[i];
+            const e = this.#element(props, this.#rendered.get(props.path));
+            rendered.set(props.path, e);
+            children.push(e);
+        }
+        this.#rendered = rendered;
+        if (children.length != list.children.length || children.some((e, i) => list.children[i] !== e)) {
+            list.replaceChildren(...children);
+        }
+        if (children.length && children[0].offsetHeight && children[0].offsetHeight != this.#rowHeight) {
+            this.#rowHeight = children[0].offsetHeight;
+            this.#schedule();
+        }
+    }
+
+    /**
+     * Return the element for an item, updating e if it's given
+     */
+    #element(props, e) {
         const self = this;
-        const view = this.#view;
         const id = this.elt.id + "-path-" + props.path;
-        let e = document.getElementById(id);
         if (!e) {
             e = document.createElement("div");
             e.id = id;
+            e.addEventListener("click", () => {
+                const path = e.getAttribute("data-path");
+                if (e.getAttribute("data-type") == "dir") {
+                    self.chdir(path);
+                } else {
+                    let a = document.createElement("a");
+                    a.href = self.cgi + "/get?path=" + encodeURIComponent(path);
+                    a.download = path.replace(/.*\//, "");
+                    a.style.display = "none";
+                    document.body.appendChild(a);
+                    setTimeout(() => {
+                        a.click();
+                        setTimeout(() => {
+                            a.remove();
+                        }, 0);
+                    }, 0);
+                }
+            });
+            if (props.name != "..") {
+                e.setAttribute("draggable", "true");
+                e.addEventListener("dragstart", (evt) => {
+                    self.#trash.classList.remove("hidden");
+                    evt.dataTransfer.setData("text/plain", id);
+                });
+            }
         }
         let dp = {};
         for (const [key, value] of Object.entries(props)) {
@@ -228,51 +759,12 @@ class FileManager {
             e.appendChild(e2);
             e2 = document.createElement("div");
             e2.classList.add("name");
-            let name = props.name;
-            if (!name) {
-                name = props.path.replace(/.*\//, "");
-            }
-            e2.innerHTML = name;
+            const name = props.name || props.path.replace(/.*\//, "");
+            e2.textContent = name;
+            e.title = name;
             e.appendChild(e2);
-            e.addEventListener("click", () => {
-               if (props.type == "dir") {
-                   self.chdir(props.path);
-               } else {
-                   let a = document.createElement("a");
-                   a.href = this.cgi + "/get?path=" + props.path;
-                   a.download = name;
-                   a.style.display = "none";
-                   document.body.appendChild(a);
-                   setTimeout(() => {
-                       a.click();
-                       setTimeout(() => {
-                           a.remove();
-                       }, 0);
-                   }, 0);
-               }
-            });
-            if (props.name != "..") {
-                e.setAttribute("draggable", "true");
-                e.addEventListener("dragstart", (evt) => {
-                    self.#trash.classList.remove("hidden");
-                    evt.dataTransfer.setData("text/plain", id);
-                });
-            }
-        }
-        if (!e.parentNode) {
-            if (this.config.comparator) {
-                for (let n=view.firstChild;n;n=n.nextSibling) {
-                    let x = this.config.comparator(e, n);
-                    if (x < 0) {
-                        view.insertBefore(e, n);
-                        break;
-                    }
-                }
-            }
-            if (!e.parentNode) {
-                view.appendChild(e);
-            }
         }
+        return e;
     }
 
     deleteItem(path) {
@@ -285,87 +777,187 @@ class FileManager {
         });
     }
 
+    /**
+     * Update the listing for some paths in the current directory, which
+     * may have been added, changed or removed. Calls made together are
+     * sent as one "info" request, with the paths in its body
+     * @param names a path or list of them, absolute or relative to the current directory
+     */
     refresh(names) {
         const self = this;
-        const view = self.#view;
+        const path = self.#view.getAttribute("data-path");
         if (!Array.isArray(names)) {
             names = [names];
         }
-        const path = view.getAttribute("data-path");
-        let uri = null;
-        let sent = [];
-        for (let i=0;i<names.length;i++) {
-            let name = names[i];
+        for (let name of names) {
             if (typeof name == "string") {
                 if (name[0] != '/') {
                     name = path + name;
                 }
                 if (name.startsWith(path) && name.substring(path.length).indexOf("/") < 0) {
-                    sent.push(name);
-                    uri = (uri ? uri + "&" : self.cgi + "/info?") + "path="+encodeURIComponent(name);
-                    if (uri.length > 500 || i + 1 == names.length) {
-                        console.log("Tx " + uri);
-                        fetch(uri, {}).then((res) => res.json()).then((r) => {
-                            console.log("Rx " + JSON.stringify(r));
-                            if (r.ok) {
-                                for (let props of r.paths) {
-                                    self.#newitem(props);
-                                    sent = sent.filter(item => item !== props.path)
-                                }
-                                for (let name of sent) {
-                                    const id = self.elt.id + "-path-" + name;
-                                    let e = document.getElementById(id);
-                                    if (e) {
-                                        e.remove();
-                                    }
-                                }
-                            }
-                        });
-                    }
+                    self.#refreshing.add(name);
                 }
             }
         }
+        if (self.#refreshing.size && !self.#refreshTimer) {
+            self.#refreshTimer = setTimeout(() => {
+                self.#refreshTimer = 0;
+                const sent = Array.from(self.#refreshing);
+                const uri = self.cgi + "/info";
+                self.#refreshing.clear();
+                console.log("Tx " + uri + " with " + sent.length + " paths");
+                fetch(uri, {
+                    "method": "POST",
+                    "headers": {
+                        "content-type": "application/json"
+                    },
+                    "body": JSON.stringify(sent)
+                }).then((res) => res.json()).then((r) => {
+                    console.log("Rx " + uri);
+                    if (r.ok && self.#view.getAttribute("data-path") == path) {
+                        const missing = new Set(sent);
+                        for (let props of r.paths) {
+                            self.#newitem(props);
+                            missing.delete(props.path);
+                        }
+                        for (let name of missing) {
+                            self.#removeitem(name);
+                        }
+                    }
+                });
+            }, 0);
+        }
     }
 
+    /**
+     * Follow the changes to the directory at dir with the server's "watch"
+     * stream, applying each as it comes. A changed path is looked up with
+     * refresh(); a removed one just goes. If the stream resets or reconnects
+     * some changes may have been missed, so the directory is listed again
+     */
+    #watch(dir) {
+        const self = this;
+        const old = self.#source;
+        if (self.#nowatch || typeof EventSource == "undefined" || (old && old.dir == dir && old.readyState != EventSource.CLOSED)) {
+            return;
+        } else if (old) {
+            old.close();
+        }
+        const source = new EventSource(self.cgi + "/watch?path=" + encodeURIComponent(dir));
+        source.dir = dir;
+        let opened = false;
+        source.addEventListener("ready", () => {
+            if (opened && self.#listed == dir) {
+                self.chdir(dir);
+            }
+            opened = true;
+        });
+        source.addEventListener("change", (e) => {
+            self.refresh(JSON.parse(e.data).path);
+        });
+        source.addEventListener("delete", (e) => {
+            self.#removeitem(JSON.parse(e.data).path);
+        });
+        source.addEventListener("reset", () => {
+            source.close();
+            if (self.#listed == dir) {
+                self.chdir(dir);
+            }
+        });
+        source.addEventListener("error", () => {
+            if (!opened && source.readyState == EventSource.CLOSED) {
+                self.#nowatch = true;       // refused, most likely as we're a CGI
+            }
+        });
+        self.#source = source;
+    }
+
+    /**
+     * Show the directory at path. The listing is fetched with details a
+     * page at a time, and shown as each page arrives
+     */
     chdir(path) {
         const self = this;
-        fetch(self.cgi + "/info?path=" + encodeURIComponent(path), {}).then((res) => res.json()).then((r) => {
-            console.log("Rx " + JSON.stringify(r));
-            const view = self.#view;
-            if (r.ok && r.paths[0].type == "dir") {
-                r = r.paths[0];
-                let oldpath = view.getAttribute("data-path");
-                for (let name of view.getAttributeNames()) {
-                    if (name.startsWith("data-")) {
-                        view.removeAttribute(name);
+        const view = self.#view;
+        const page = 5000;      // kids in each "info" request
+        const token = ++self.#chdirs;
+        const seen = new Set();
+        const next = (cursor) => {
+            fetch(self.cgi + "/info?detail=1&limit=" + page + "&path=" + encodeURIComponent(path) + (cursor ? "&cursor=" + encodeURIComponent(cursor) : ""), {}).then((res) => res.json()).then((r) => {
+                console.log("Rx info \"" + path + "\"" + (cursor ? " from \"" + cursor + "\"" : ""));
+                if (token != self.#chdirs) {
+                    return;     // we've moved on
+                } else if (!r.ok || r.paths[0].type != "dir") {
+                    if (cursor) {
+                        next(null);     // the directory changed under the cursor, so start again
                     }
+                    return;
                 }
-                for (let [key, value] of Object.entries(r)) {
-                    if (key == "path" && !value.endsWith("/")) {
-                        value += "/";
+                r = r.paths[0];
+                const dir = r.path.endsWith("/") ? r.path : r.path + "/";    // Always ends with slash
+                if (!cursor) {
+                    for (let name of view.getAttributeNames()) {
+                        if (name.startsWith("data-")) {
+                            view.removeAttribute(name);
+                        }
                     }
-                    if (key != "kids") {
-                        view.setAttribute("data-" + key, value);
+                    for (let [key, value] of Object.entries(r)) {
+                        if (key == "path") {
+                            value = dir;
+                        }
+                        if (key != "kids" && key != "cursor") {
+                            view.setAttribute("data-" + key, value);
+                        }
                     }
-                }
-                const path = view.getAttribute("data-path");    // Always ends with slash
-                self.log(path, "breadcrumb");
-                if (path != oldpath) {
-                    while (view.firstChild) {
-                        view.firstChild.remove();
+                    self.log(dir, "breadcrumb");
+                    self.#watch(dir);
+                    if (dir != self.#listed) {
+                        self.#listed = dir;
+                        self.#items = [];
+                        self.#paths.clear();
+                        view.scrollTop = 0;
+                    }
+                    if (dir != "/") {
+                        self.#newitem({
+                            type: "dir",
+                            path: dir.substring(0, dir.lastIndexOf("/", dir.length - 2) + 1),
+                            name: ".."
+                        });
+                        seen.add(self.#items[0].path);
                     }
                 }
-                if (path != "/") {
-                    self.#newitem({
-                      type: "dir",
-                      path: path.substring(0, path.lastIndexOf("/", path.length - 2) + 1),
-                      name: ".."
-                    });
+                // With detail=1 each kid has its details, so no need for a further "info"
+                for (const kid of r.kids) {
+                    const props = Object.assign({}, kid, { path: dir + kid.name });
+                    delete props.name;
+                    seen.add(props.path);
+                    const old = self.#paths.get(props.path);
+                    if (old) {
+                        // Updated in place, as finding it would be a search; resorted below
+                        for (const key of Object.keys(old)) {
+                            delete old[key];
+                        }
+                        Object.assign(old, props);
+                    } else {
+                        self.#items.push(props);
+                        self.#paths.set(props.path, props);
+                    }
                 }
-                if (r.kids.length) {
-                    self.refresh(r.kids);
+                if (r.cursor) {
+                    next(r.cursor);
+                } else {
+                    self.#items = self.#items.filter((props) => seen.has(props.path));
+                    for (const name of Array.from(self.#paths.keys())) {
+                        if (!seen.has(name)) {
+                            self.#paths.delete(name);
+                        }
+                    }
                 }
-            }
-        });
+                // A page is sorted in one go rather than inserted item by item
+                self.#items.sort((a, b) => self.#compare(a, b));
+                self.#schedule();
+            });
+        };
+        next(null);
     }
 }
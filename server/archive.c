@@ -0,0 +1,642 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <zlib.h>
+
+#define ARCHIVEBUF 65536        // bytes of archive collected before they're sent, and of a file read at a time for zip
+#define ZIPLEVEL 6              // deflate level for zip entries
+#define ZIP32MAX 0xFFFFFFFFULL  // larger sizes and offsets need zip64 records
+#define ZIP64FILE 0xF0000000ULL // files this big get zip64 sizes, leaving room for deflate to grow them
+
+/*
+ * Get on a directory sends it as an archive, made as the tree is walked, so
+ * nothing is stored and the memory used doesn't depend on the size of the
+ * tree. What's included is what info lists: names beginning with "." are
+ * skipped, as are symlinks to directories; symlinks to files are followed.
+ *
+ * A tar archive is uncompressed, so its length can be worked out first from
+ * a walk that only stats, and sent as the Content-Length. Each file is
+ * then sent with copyout(), without passing through userspace where the
+ * response allows. Nothing more than that length is ever sent: an entry
+ * that's appeared or grown so it no longer fits is left out, and one that's
+ * gone leaves zeros at the end, which readers see as the end of the
+ * archive. A file that's shrunk is padded with zeros to the length in its
+ * header, so it's extracted with zeros in place of what it lost.
+ *
+ * A zip archive's files are read to find their CRC, so they can be
+ * deflated too. Each entry's sizes and CRC follow its data in a data
+ * descriptor, so it's sent as it's made, with a length only at the end:
+ * chunked, or ended by closing the connection. The central directory at the
+ * end repeats every entry, so that's the one part kept in memory, about 50
+ * bytes and the name for each. Zip64 records are used where sizes, offsets
+ * or the number of entries need them.
+ */
+
+typedef struct archive archive_t;
+
+/**
+ * Called for each entry of the walk: "name" in the open directory dfd, at
+ * "path" in the archive (ending in "/" for a directory) with the stat sb.
+ * Return non-zero to stop the walk
+ */
+typedef int (*visit_t)(archive_t *ar, int dfd, const char *name, const char *path, const struct stat *sb);
+
+struct archive {
+    context_t *ctx;
+    int zip;
+    int deflate;            // deflate zip entries that look compressible
+    int chunked;            // send each buffer as a chunk
+    unsigned char *buf;     // output not yet sent
+    size_t len;
+    uint64_t offset;        // bytes of the archive so far
+    uint64_t limit;         // tar: the length of the whole archive
+    unsigned char *central; // zip: the central directory
+    size_t centrallen, centralsize;
+    uint64_t entries;
+    z_stream z;
+    int zinit;
+    size_t files, dirs, skipped;
+    const char *how;        // how the last file was sent
+};
+
+/**
+ * Send what's collected in the buffer
+ */
+static void ar_flush(archive_t *ar) {
+    context_t *ctx = ar->ctx;
+    if (ar->len == 0) {
+        return;
+    } else if (ar->chunked) {
+        fprintf(ctx->out, "%zx\r\n", ar->len);
+        fwrite(ar->buf, 1, ar->len, ctx->out);
+        fputs("\r\n", ctx->out);
+    } else {
+        fwrite(ar->buf, 1, ar->len, ctx->out);
+    }
+    ctx->sent += ar->len;
+    ar->len = 0;
+}
+
+static void ar_write(archive_t *ar, const void *data, size_t len) {
+    ar->offset += len;
+    while (len) {
+        size_t n = ARCHIVEBUF - ar->len;
+        if (n == 0) {
+            ar_flush(ar);
+            n = ARCHIVEBUF;
+        }
+        if (n > len) {
+            n = len;
+        }
+        memcpy(ar->buf + ar->len, data, n);
+        ar->len += n;
+        data = (const char *)data + n;
+        len -= n;
+    }
+}
+
+static void ar_zeros(archive_t *ar, uint64_t len) {
+    static const char zeros[512];
+    while (len) {
+        size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+        ar_write(ar, zeros, n);
+        len -= n;
+    }
+}
+
+/**
+ * Walk the tree under the directory "path", which is "top" in the archive,
+ * calling visit for it and for each entry under it. The walk is iterative,
+ * with one open directory for each level, like delete's check. Return
+ * non-zero if visit stopped it or "path" can't be read
+ */
+static int ar_walk(archive_t *ar, const char *path, const char *top, visit_t visit) {
+    struct stat sb, lsb;
+    char name[PATH_MAX + 1];
+    DIR **stack;
+    size_t *lens, depth = 1, size = 16;
+    int ret = 0;
+
+    int fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir || fstat(fd, &sb)) {
+        logmsg(ar->ctx, "get opendir \"%s\": %s", path, strerror(errno));
+        if (dir) {
+            closedir(dir);
+        } else if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    size_t len = snprintf(name, sizeof(name), "%s/", top);
+    if (len >= sizeof(name) || visit(ar, AT_FDCWD, path, name, &sb)) {
+        closedir(dir);
+        return -1;
+    }
+    stack = malloc(size * sizeof(DIR *));
+    lens = malloc(size * sizeof(size_t));
+    stack[0] = dir;
+    lens[0] = len;
+    while (depth > 0 && !ret) {
+        DIR *d = stack[depth - 1];
+        struct dirent *dp = readdir(d);
+        if (!dp) {
+            closedir(d);
+            depth--;
+            continue;
+        } else if (dp->d_name[0] == '.' || !kidstat(dirfd(d), dp, &sb)) {
+            continue;       // not listed, so not sent
+        }
+        int isdir = S_ISDIR(sb.st_mode);
+        len = lens[depth - 1] + snprintf(name + lens[depth - 1], sizeof(name) - lens[depth - 1], "%s%s", dp->d_name, isdir ? "/" : "");
+        if (len >= sizeof(name)) {
+            ar->skipped++;
+            continue;
+        } else if (!isdir) {
+            ret = visit(ar, dirfd(d), dp->d_name, name, &sb);
+        } else if (dp->d_type == DT_LNK || (dp->d_type == DT_UNKNOWN && (fstatat(dirfd(d), dp->d_name, &lsb, AT_SYMLINK_NOFOLLOW) || S_ISLNK(lsb.st_mode)))) {
+            continue;
+        } else if ((fd = openat(dirfd(d), dp->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) < 0 || !(dir = fdopendir(fd))) {
+            logmsg(ar->ctx, "get opendir \"%s\": %s", name, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            ar->skipped++;
+        } else if ((ret = visit(ar, dirfd(d), dp->d_name, name, &sb))) {
+            closedir(dir);
+        } else {
+            if (depth == size) {
+                size *= 2;
+                stack = realloc(stack, size * sizeof(DIR *));
+                lens = realloc(lens, size * sizeof(size_t));
+            }
+            stack[depth] = dir;
+            lens[depth++] = len;
+        }
+    }
+    while (depth > 0) {
+        closedir(stack[--depth]);
+    }
+    free(stack);
+    free(lens);
+    return ret;
+}
+
+/**
+ * Return the bytes the tar header for "path" takes, with a GNU long name
+ * entry before it if it doesn't fit the ustar name and prefix fields. Set
+ * *split to where it's divided between them, or 0 if it isn't
+ */
+static size_t tar_header_size(const char *path, size_t *split) {
+    size_t len = strlen(path);
+    *split = 0;
+    if (len <= 100) {
+        return 512;
+    }
+    for (const char *c=path+len-1;c>path;c--) {
+        if (*c == '/' && c < path + len - 1 && c - path <= 155 && path + len - c - 1 <= 100) {
+            *split = c - path;
+            return 512;
+        }
+    }
+    return 512 + 512 + ((len + 1 + 511) & ~(size_t)511);
+}
+
+/**
+ * Set the number field p of a tar header to v: octal, or base-256 if it's
+ * too big
+ */
+static void tar_set_number(char *p, size_t len, uint64_t v) {
+    if (v < 1ULL << (3 * (len - 1))) {
+        snprintf(p, len, "%0*llo", (int)len - 1, (unsigned long long)v);
+    } else {
+        p[0] = (char)0x80;
+        for (size_t i=len-1;i>0;i--) {
+            p[i] = v & 0xFF;
+            v >>= 8;
+        }
+    }
+}
+
+static void tar_header(archive_t *ar, const char *name, size_t split, int type, const struct stat *sb, uint64_t size) {
+    char h[512];
+    memset(h, 0, sizeof(h));
+    if (split) {
+        memcpy(h + 345, name, split);
+        name += split + 1;
+    }
+    memcpy(h, name, strnlen(name, 100));
+    tar_set_number(h + 100, 8, sb ? sb->st_mode & 0777 : 0644);
+    tar_set_number(h + 108, 8, 0);
+    tar_set_number(h + 116, 8, 0);
+    tar_set_number(h + 124, 12, size);
+    tar_set_number(h + 136, 12, sb && sb->st_mtime > 0 ? sb->st_mtime : 0);
+    h[156] = type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    unsigned long sum = 0;
+    memset(h + 148, ' ', 8);
+    for (int i=0;i<512;i++) {
+        sum += (unsigned char)h[i];
+    }
+    snprintf(h + 148, 8, "%06lo", sum);
+    ar_write(ar, h, sizeof(h));
+}
+
+/**
+ * The bytes an entry takes in a tar archive
+ */
+static uint64_t tar_entry_size(const char *path, const struct stat *sb) {
+    size_t split;
+    uint64_t size = tar_header_size(path, &split);
+    if (S_ISREG(sb->st_mode)) {
+        size += ((uint64_t)sb->st_size + 511) & ~(uint64_t)511;
+    }
+    return size;
+}
+
+static int tar_measure(archive_t *ar, int dfd, const char *name, const char *path, const struct stat *sb) {
+    ar->limit += tar_entry_size(path, sb);
+    return 0;
+}
+
+static int tar_visit(archive_t *ar, int dfd, const char *name, const char *path, const struct stat *sb) {
+    context_t *ctx = ar->ctx;
+    size_t split;
+    int fd = -1;
+    if (ferror(ctx->out)) {
+        return -1;      // the client has gone
+    } else if (ar->offset + tar_entry_size(path, sb) + 1024 > ar->limit) {
+        logmsg(ctx, "get \"%s\": changed since the archive was measured, left out", path);
+        ar->skipped++;
+        return 0;
+    } else if (S_ISREG(sb->st_mode) && (fd = openat(dfd, name, O_RDONLY|O_CLOEXEC)) < 0) {
+        logmsg(ctx, "get open \"%s\": %s", path, strerror(errno));
+        ar->skipped++;
+        return 0;
+    }
+    uint64_t size = S_ISREG(sb->st_mode) ? sb->st_size : 0;
+    if (tar_header_size(path, &split) > 512) {
+        size_t len = strlen(path) + 1;
+        tar_header(ar, "././@LongLink", 0, 'L', NULL, len);
+        ar_write(ar, path, len);
+        ar_zeros(ar, (512 - len % 512) % 512);
+    }
+    tar_header(ar, path, split, S_ISDIR(sb->st_mode) ? '5' : '0', sb, size);
+    if (fd >= 0) {
+        ar_flush(ar);
+        size_t sent = copyout(ctx, fd, 0, size, &ar->how);
+        ar->offset += sent;
+        ar_zeros(ar, size - sent + (512 - size % 512) % 512);     // if it's shrunk, still as long as its header says
+        close(fd);
+        ar->files++;
+    } else {
+        ar->dirs++;
+    }
+    return 0;
+}
+
+static void zip16(unsigned char *p, unsigned v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void zip32(unsigned char *p, uint32_t v) {
+    zip16(p, v & 0xFFFF);
+    zip16(p + 2, v >> 16);
+}
+
+static void zip64(unsigned char *p, uint64_t v) {
+    zip32(p, v & 0xFFFFFFFF);
+    zip32(p + 4, v >> 32);
+}
+
+/**
+ * Set time and date to the MS-DOS form of t, in local time as zip expects
+ */
+static void zip_time(time_t t, unsigned *time, unsigned *date) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    if (tm.tm_year < 80) {
+        *time = 0;
+        *date = (1 << 5) | 1;   // 1980-01-01, the earliest there is
+    } else {
+        *time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+        *date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+    }
+}
+
+/**
+ * Add the central directory record for an entry
+ */
+static void zip_central(archive_t *ar, const char *path, unsigned flags, unsigned method, unsigned time, unsigned date, uint32_t crc, uint64_t csize, uint64_t usize, uint64_t offset, uint32_t attr) {
+    size_t namelen = strlen(path);
+    unsigned char extra[28];
+    size_t extralen = 0;
+    // Each value too big for its field is FFFFFFFF there and in the zip64 extra field, in this order
+    if (usize >= ZIP32MAX) {
+        zip64(extra + 4 + extralen, usize);
+        extralen += 8;
+    }
+    if (csize >= ZIP32MAX) {
+        zip64(extra + 4 + extralen, csize);
+        extralen += 8;
+    }
+    if (offset >= ZIP32MAX) {
+        zip64(extra + 4 + extralen, offset);
+        extralen += 8;
+    }
+    if (extralen) {
+        zip16(extra, 1);
+        zip16(extra + 2, extralen);
+        extralen += 4;
+    }
+    size_t need = ar->centrallen + 46 + namelen + extralen;
+    if (need > ar->centralsize) {
+        ar->centralsize = need * 2;
+        ar->central = realloc(ar->central, ar->centralsize);
+    }
+    unsigned char *c = ar->central + ar->centrallen;
+    zip32(c, 0x02014b50);
+    zip16(c + 4, (3 << 8) | 45);            // made on unix, zip64 spec
+    zip16(c + 6, extralen ? 45 : 20);
+    zip16(c + 8, flags);
+    zip16(c + 10, method);
+    zip16(c + 12, time);
+    zip16(c + 14, date);
+    zip32(c + 16, crc);
+    zip32(c + 20, csize >= ZIP32MAX ? ZIP32MAX : csize);
+    zip32(c + 24, usize >= ZIP32MAX ? ZIP32MAX : usize);
+    zip16(c + 28, namelen);
+    zip16(c + 30, extralen);
+    memset(c + 32, 0, 10);                  // comment length, disk, internal attributes
+    zip32(c + 38, attr);
+    zip32(c + 42, offset >= ZIP32MAX ? ZIP32MAX : offset);
+    memcpy(c + 46, path, namelen);
+    memcpy(c + 46 + namelen, extra, extralen);
+    ar->centrallen = need;
+    ar->entries++;
+}
+
+/**
+ * Add the file fd to the archive, deflated if we're deflating and it looks
+ * worth it. Return 0, or -1 if it can't be read, which leaves the archive
+ * broken
+ */
+static int zip_file(archive_t *ar, int fd, const char *path, const struct stat *sb) {
+    unsigned char h[30 + 20], *data = malloc(ARCHIVEBUF), *out = NULL;
+    unsigned time, date;
+    uint64_t offset = ar->offset, usize = 0, csize = 0;
+    uint32_t crc = crc32(0, NULL, 0);
+    // Sniffed whatever the size: get's limit is for the compressed copies it keeps
+    int packed = ar->deflate && compressible(fd, sb->st_size < COMPRESSMIN ? sb->st_size : COMPRESSMIN);
+    int large = (uint64_t)sb->st_size >= ZIP64FILE;
+    int ret = 0;
+
+    if (packed && !ar->zinit) {
+        // Raw deflate, without a zlib header, as zip expects
+        ar->zinit = deflateInit2(&ar->z, ZIPLEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        packed = ar->zinit;
+    } else if (packed) {
+        deflateReset(&ar->z);
+    }
+    if (packed) {
+        out = malloc(ARCHIVEBUF);
+    }
+    zip_time(sb->st_mtime, &time, &date);
+    size_t namelen = strlen(path);
+    zip32(h, 0x04034b50);
+    zip16(h + 4, large ? 45 : 20);
+    zip16(h + 6, 0x0808);                   // sizes in a data descriptor, UTF-8 name
+    zip16(h + 8, packed ? 8 : 0);
+    zip16(h + 10, time);
+    zip16(h + 12, date);
+    memset(h + 14, 0, 12);                  // CRC and sizes follow the data
+    zip16(h + 26, namelen);
+    zip16(h + 28, large ? 20 : 0);
+    ar_write(ar, h, 30);
+    ar_write(ar, path, namelen);
+    if (large) {
+        // A zip64 extra field with zero sizes says the data descriptor's sizes are 64 bits
+        zip16(h, 1);
+        zip16(h + 2, 16);
+        memset(h + 4, 0, 16);
+        ar_write(ar, h, 20);
+    }
+
+    posix_fadvise(fd, 0, sb->st_size, POSIX_FADV_SEQUENTIAL);
+    for (int end=0;!end;) {
+        ssize_t l = 0;
+        if (usize < (uint64_t)sb->st_size) {
+            size_t n = sb->st_size - usize < ARCHIVEBUF ? sb->st_size - usize : ARCHIVEBUF;
+            if ((l = pread(fd, data, n, usize)) < 0 && errno == EINTR) {
+                continue;
+            } else if (l < 0) {
+                logmsg(ar->ctx, "get read \"%s\": %s", path, strerror(errno));
+                ret = -1;
+                l = 0;
+            }
+        }
+        end = l == 0;       // at the size it had when listed, or it's shrunk
+        crc = crc32(crc, data, l);
+        usize += l;
+        if (!packed) {
+            ar_write(ar, data, l);
+            csize += l;
+            continue;
+        }
+        ar->z.next_in = data;
+        ar->z.avail_in = l;
+        int zret;
+        do {
+            ar->z.next_out = out;
+            ar->z.avail_out = ARCHIVEBUF;
+            zret = deflate(&ar->z, end ? Z_FINISH : Z_NO_FLUSH);
+            ar_write(ar, out, ARCHIVEBUF - ar->z.avail_out);
+            csize += ARCHIVEBUF - ar->z.avail_out;
+        } while (ar->z.avail_out == 0 || (end && zret == Z_OK));
+    }
+    zip32(h, 0x08074b50);
+    zip32(h + 4, crc);
+    if (large) {
+        zip64(h + 8, csize);
+        zip64(h + 16, usize);
+        ar_write(ar, h, 24);
+    } else {
+        zip32(h + 8, csize);
+        zip32(h + 12, usize);
+        ar_write(ar, h, 16);
+    }
+    zip_central(ar, path, 0x0808, packed ? 8 : 0, time, date, crc, csize, usize, offset, (uint32_t)(S_IFREG | (sb->st_mode & 0777)) << 16);
+    free(data);
+    free(out);
+    return ret;
+}
+
+static int zip_visit(archive_t *ar, int dfd, const char *name, const char *path, const struct stat *sb) {
+    context_t *ctx = ar->ctx;
+    if (ferror(ctx->out)) {
+        return -1;      // the client has gone
+    } else if (S_ISREG(sb->st_mode)) {
+        int fd = openat(dfd, name, O_RDONLY|O_CLOEXEC);
+        if (fd < 0) {
+            logmsg(ctx, "get open \"%s\": %s", path, strerror(errno));
+            ar->skipped++;
+            return 0;
+        }
+        int ret = zip_file(ar, fd, path, sb);
+        close(fd);
+        ar->files++;
+        return ret;
+    }
+    // A directory has no data, so its sizes and CRC are known and go in its header
+    unsigned char h[30];
+    unsigned time, date;
+    size_t namelen = strlen(path);
+    uint64_t offset = ar->offset;
+    zip_time(sb->st_mtime, &time, &date);
+    zip32(h, 0x04034b50);
+    zip16(h + 4, 20);
+    zip16(h + 6, 0x0800);
+    zip16(h + 8, 0);
+    zip16(h + 10, time);
+    zip16(h + 12, date);
+    memset(h + 14, 0, 12);
+    zip16(h + 26, namelen);
+    zip16(h + 28, 0);
+    ar_write(ar, h, sizeof(h));
+    ar_write(ar, path, namelen);
+    zip_central(ar, path, 0x0800, 0, time, date, 0, 0, 0, offset, ((uint32_t)(S_IFDIR | (sb->st_mode & 0777)) << 16) | 0x10);
+    ar->dirs++;
+    return 0;
+}
+
+/**
+ * Write the central directory and the records that end the archive
+ */
+static void zip_end(archive_t *ar) {
+    unsigned char e[56 + 20 + 22];
+    uint64_t start = ar->offset, size = ar->centrallen;
+    ar_write(ar, ar->central, ar->centrallen);
+    size_t len = 0;
+    if (ar->entries >= 0xFFFF || start >= ZIP32MAX || size >= ZIP32MAX) {
+        // The zip64 end of central directory record, and its locator
+        uint64_t end = ar->offset;
+        zip32(e, 0x06064b50);
+        zip64(e + 4, 44);
+        zip16(e + 12, (3 << 8) | 45);
+        zip16(e + 14, 45);
+        memset(e + 16, 0, 8);               // disk numbers
+        zip64(e + 24, ar->entries);
+        zip64(e + 32, ar->entries);
+        zip64(e + 40, size);
+        zip64(e + 48, start);
+        zip32(e + 56, 0x07064b50);
+        zip32(e + 60, 0);
+        zip64(e + 64, end);
+        zip32(e + 72, 1);
+        len = 76;
+    }
+    zip32(e + len, 0x06054b50);
+    memset(e + len + 4, 0, 4);
+    zip16(e + len + 8, ar->entries >= 0xFFFF ? 0xFFFF : ar->entries);
+    zip16(e + len + 10, ar->entries >= 0xFFFF ? 0xFFFF : ar->entries);
+    zip32(e + len + 12, size >= ZIP32MAX ? ZIP32MAX : size);
+    zip32(e + len + 16, start >= ZIP32MAX ? ZIP32MAX : start);
+    zip16(e + len + 20, 0);
+    ar_write(ar, e, len + 22);
+}
+
+/**
+ * Send the directory "path", which is "name" relative to the root, as an
+ * archive: "format=tar" (the default) or "format=zip", with "deflate=1" to
+ * compress the zip's entries
+ */
+void get_archive(context_t *ctx, const char *path, const char *name) {
+    archive_t ar;
+    const char *format = "tar";
+    memset(&ar, 0, sizeof(ar));
+    ar.ctx = ctx;
+    for (char **q=ctx->query;*q;) {
+        char *qkey = *q++;
+        char *qval = *q++;
+        if (!strcmp(qkey, "format")) {
+            format = qval;
+        } else if (!strcmp(qkey, "deflate")) {
+            ar.deflate = !strcmp(qval, "1") || !strcmp(qval, "true");
+        }
+    }
+    if (!strcmp(format, "zip")) {
+        ar.zip = 1;
+    } else if (strcmp(format, "tar")) {
+        send_msg(ctx, 400, "invalid format \"%s\"", format);
+        return;
+    }
+
+    // The archive is named for the directory, and so is the directory it holds
+    size_t namelen = strlen(name);
+    while (namelen > 0 && name[namelen - 1] == '/') {
+        namelen--;
+    }
+    name = arena_strndup(ctx, name, namelen);
+    const char *top = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+    if (!*top) {
+        send_msg(ctx, 400, "invalid path \"%s\"", name);
+        return;
+    }
+    char *filename = arena_printf(ctx, "%s.%s", top, format);
+    for (char *c=filename;*c;c++) {
+        if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20) {
+            *c = '_';
+        }
+    }
+    if (!ar.zip && ar_walk(&ar, path, top, tar_measure)) {
+        send_msg(ctx, 403, "get: can't read \"%s\"", name);
+        return;
+    } else if (ar.zip && access(path, R_OK|X_OK)) {
+        send_msg(ctx, 403, "get: can't read \"%s\"", name);
+        return;
+    }
+    ar.limit += 1024;   // two zero blocks end a tar archive
+    ar.skipped = 0;
+    ar.buf = arena_alloc(ctx, ARCHIVEBUF);
+    if (ar.zip && ctx->http && !ctx->chunked) {
+        ctx->keepalive = 0;     // the end of the response is the end of the connection
+    }
+    send_status(ctx, 200);
+    fprintf(ctx->out, "Content-Type: %s\r\n", ar.zip ? "application/zip" : "application/x-tar");
+    fprintf(ctx->out, "Content-Disposition: attachment; filename=\"%s\"\r\n", filename);
+    fputs("Cache-Control: no-store\r\n", ctx->out);
+    if (!ar.zip) {
+        fprintf(ctx->out, "Content-Length: %llu\r\n", (unsigned long long)ar.limit);
+    } else if (ctx->http && ctx->chunked) {
+        fputs("Transfer-Encoding: chunked\r\n", ctx->out);
+        ar.chunked = 1;
+    }
+    fputs("\r\n", ctx->out);
+
+    if (!ar.zip) {
+        ar_walk(&ar, path, top, tar_visit);
+        ar_zeros(&ar, ar.limit - ar.offset);
+    } else {
+        ar_walk(&ar, path, top, zip_visit);
+        zip_end(&ar);
+    }
+    ar_flush(&ar);
+    if (ar.chunked) {
+        fputs("0\r\n\r\n", ctx->out);
+    }
+    if (ar.zinit) {
+        deflateEnd(&ar.z);
+    }
+    free(ar.central);
+    logmsg(ctx, "get \"%s\": sent %llu bytes as %s%s with %lu files and %lu directories, %lu left out%s%s", path, (unsigned long long)ar.offset, format, ar.zip && ar.deflate ? " (deflate)" : "", (unsigned long)ar.files, (unsigned long)ar.dirs, (unsigned long)ar.skipped, ar.how ? ", files with " : "", ar.how ? ar.how : "");
+}
@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ARENABLOCK 16384        // bytes in each block of an arena
+#define ARENABIG (ARENABLOCK / 4)   // allocations larger than this get a block of their own
+#define ARENAALIGN 16
+
+/*
+ * The memory for a request - its query, headers, paths and messages - is
+ * taken from an arena, which hands out space from a block by moving a
+ * pointer along and frees it all at once when the request is done, rather
+ * than each piece being malloc'd and freed. The HTTP server keeps an arena
+ * for each worker thread and resets it after each request, keeping its
+ * first block, so a typical request allocates nothing. An arena belongs to
+ * the thread that's handling the request: threads a command starts to help
+ * it must use malloc.
+ */
+
+typedef struct arenablock {
+    struct arenablock *next;
+    size_t size, used;
+    char data[] __attribute__((aligned(ARENAALIGN)));
+} arenablock_t;
+
+struct arena {
+    arenablock_t *blocks;       // the block being allocated from first, then older ones
+    arenablock_t *big;          // allocations too big for a block
+};
+
+static arenablock_t *block_new(size_t size, arenablock_t *next) {
+    arenablock_t *b = malloc(sizeof(arenablock_t) + size);
+    if (!b) {
+        abort();
+    }
+    b->next = next;
+    b->size = size;
+    b->used = 0;
+    return b;
+}
+
+arena_t *arena_new(void) {
+    arena_t *a = calloc(1, sizeof(arena_t));
+    a->blocks = block_new(ARENABLOCK, NULL);
+    return a;
+}
+
+/**
+ * Free everything allocated from the arena, keeping its oldest block
+ */
+void arena_reset(arena_t *a) {
+    while (a->blocks->next) {
+        arenablock_t *b = a->blocks;
+        a->blocks = b->next;
+        free(b);
+    }
+    while (a->big) {
+        arenablock_t *b = a->big;
+        a->big = b->next;
+        free(b);
+    }
+    a->blocks->used = 0;
+}
+
+void arena_free(arena_t *a) {
+    if (a) {
+        arena_reset(a);
+        free(a->blocks);
+        free(a);
+    }
+}
+
+/**
+ * Return len bytes from the request's arena, which are freed when the
+ * request is done
+ */
+void *arena_alloc(context_t *ctx, size_t len) {
+    arena_t *a = ctx->arena;
+    len = (len + ARENAALIGN - 1) & ~(size_t)(ARENAALIGN - 1);
+    if (len > ARENABIG) {
+        a->big = block_new(len, a->big);
+        return a->big->data;
+    } else if (a->blocks->used + len > a->blocks->size) {
+        a->blocks = block_new(ARENABLOCK, a->blocks);
+    }
+    void *p = a->blocks->data + a->blocks->used;
+    a->blocks->used += len;
+    return p;
+}
+
+char *arena_strdup(context_t *ctx, const char *s) {
+    size_t len = strlen(s) + 1;
+    return memcpy(arena_alloc(ctx, len), s, len);
+}
+
+char *arena_strndup(context_t *ctx, const char *s, size_t len) {
+    len = strnlen(s, len);
+    char *d = arena_alloc(ctx, len + 1);
+    memcpy(d, s, len);
+    d[len] = 0;
+    return d;
+}
+
+char *arena_vprintf(context_t *ctx, const char *fmt, va_list va) {
+    arena_t *a = ctx->arena;
+    va_list va2;
+    va_copy(va2, va);
+    // Format into what's left of the current block, and only if it doesn't fit allocate the space and format it again
+    size_t avail = a->blocks->size - a->blocks->used;
+    char *s = a->blocks->data + a->blocks->used;
+    int len = vsnprintf(s, avail, fmt, va);
+    if (len < 0) {
+        s = NULL;
+    } else if (len < avail) {
+        // Reserve it where it is: arena_alloc() would put a long one in a big block of its own
+        a->blocks->used += (len + 1 + ARENAALIGN - 1) & ~(size_t)(ARENAALIGN - 1);
+    } else {
+        s = arena_alloc(ctx, len + 1);
+        vsnprintf(s, len + 1, fmt, va2);
+    }
+    va_end(va2);
+    return s;
+}
+
+/**
+ * Return a string formatted as sprintf() would in the request's arena
+ */
+char *arena_printf(context_t *ctx, const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    char *s = arena_vprintf(ctx, fmt, va);
+    va_end(va);
+    return s;
+}
@@ -0,0 +1,620 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAXARGS 32              // most arguments passed to the binary
+#define CONNECTWAIT 5000        // ms to wait for the server to start listening
+#define RXBUF 65536             // response bytes read at a time
+
+/*
+ * Benchmark for the filemanager binary - run by "make bench". Each scenario
+ * is run against the binary as a CGI, started for every request with the
+ * "--method", "--path" and "--query" debug flags and the request body on
+ * stdin, and as an HTTP server over one keep-alive connection, started
+ * afresh for each scenario so its peak RSS is its own:
+ *
+ *   list     "info" on directories of 1k, 100k and 1M empty files
+ *   put      a file uploaded with "put" in 64KB, 1MB and 16MB chunks
+ *   get      "get" of a large file, which is in the page cache
+ *   delete   "delete" of a deep tree and of a wide one
+ *
+ * Requests are made one at a time, so latency is the time for the binary to
+ * answer rather than to queue. Each scenario prints one line of JSON with
+ * the ops/sec, MB/s, p50/p99 latency in ms, the time taken by the first
+ * (untimed) request where there's a warm-up, and the peak RSS in KB - the
+ * largest of any CGI process, or the server's. Progress goes to stderr.
+ * Everything is done in a temporary directory which is removed afterwards.
+ */
+
+typedef struct runner {
+    const char *mode;           // "cgi" or "http"
+    pid_t pid;                  // the server
+    int port;
+    int sock;                   // connection to the server, or -1
+    long rss;                   // peak RSS of a CGI process in KB
+    char rx[RXBUF];             // response bytes read but not yet parsed
+    size_t rxlen, rxpos;
+} runner_t;
+
+typedef struct result {
+    double *lat;                // ms for each op
+    int ops, errors;
+    double bytes;               // moved by the timed ops
+    double first;               // ms for the warm-up request, or -1
+} result_t;
+
+static const char *binary = "./filemanager";
+static char *root;
+static const char *extra[MAXARGS];
+static int nextra;
+static int threads = 0;
+static int quick = 0;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void fail(const char *what) {
+    fprintf(stderr, "bench: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static int rmfile(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+    return remove(path) && errno != ENOENT ? -1 : 0;
+}
+
+static void rmtree(const char *path) {
+    nftw(path, rmfile, 64, FTW_DEPTH|FTW_PHYS);
+}
+
+/**
+ * Create a file of "len" bytes that won't compress
+ */
+static void mkdata(const char *path, size_t len) {
+    int fd = open(path, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+    uint64_t x = 0x9E3779B97F4A7C15ULL, buf[8192];
+    if (fd < 0) {
+        fail(path);
+    }
+    for (size_t off=0;off<len;) {
+        for (int i=0;i<sizeof(buf)/sizeof(buf[0]);i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            buf[i] = x;
+        }
+        size_t n = len - off < sizeof(buf) ? len - off : sizeof(buf);
+        if (write(fd, buf, n) != n) {
+            fail(path);
+        }
+        off += n;
+    }
+    close(fd);
+}
+
+static void mkfile(const char *path) {
+    int fd = open(path, O_CREAT|O_WRONLY, 0644);
+    if (fd < 0) {
+        fail(path);
+    }
+    close(fd);
+}
+
+//-------------------------------------------------------------------------
+// Running the binary
+
+static void exec_binary(const char **args) {
+    const char *argv[MAXARGS * 2 + 16];
+    int n = 0;
+    argv[n++] = binary;
+    argv[n++] = "--root";
+    argv[n++] = root;
+    for (int i=0;args[i];i++) {
+        argv[n++] = args[i];
+    }
+    for (int i=0;i<nextra;i++) {
+        argv[n++] = extra[i];
+    }
+    argv[n] = NULL;
+    execv(binary, (char **)argv);
+    fprintf(stderr, "bench: exec \"%s\": %s\n", binary, strerror(errno));
+    _exit(127);
+}
+
+static void server_start(runner_t *r) {
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t salen = sizeof(sa);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&sa, salen) || getsockname(fd, (struct sockaddr *)&sa, &salen)) {
+        fail("socket");
+    }
+    r->port = ntohs(sa.sin_port);      // a free port
+    close(fd);
+
+    char listen[32], nthreads[16];
+    snprintf(listen, sizeof(listen), "127.0.0.1:%d", r->port);
+    snprintf(nthreads, sizeof(nthreads), "%d", threads);
+    const char *args[] = { "--listen", listen, threads ? "--threads" : NULL, nthreads, NULL };
+    if ((r->pid = fork()) == 0) {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        exec_binary(args);
+    } else if (r->pid < 0) {
+        fail("fork");
+    }
+
+    for (double end=now_ms() + CONNECTWAIT;;) {
+        r->sock = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if (!connect(r->sock, (struct sockaddr *)&sa, sizeof(sa))) {
+            break;
+        }
+        close(r->sock);
+        r->sock = -1;
+        if (now_ms() > end || waitpid(r->pid, NULL, WNOHANG) == r->pid) {
+            fprintf(stderr, "bench: server didn't start on port %d\n", r->port);
+            exit(1);
+        }
+        usleep(10000);
+    }
+    int one = 1;
+    setsockopt(r->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    r->rxlen = r->rxpos = 0;
+}
+
+/**
+ * Stop the server and return its peak RSS in KB
+ */
+static long server_stop(runner_t *r) {
+    char path[64], line[256];
+    long rss = 0;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)r->pid);
+    FILE *f = fopen(path, "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, "VmHWM:", 6)) {
+            rss = atol(line + 6);
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    if (r->sock >= 0) {
+        close(r->sock);
+        r->sock = -1;
+    }
+    kill(r->pid, SIGTERM);
+    waitpid(r->pid, NULL, 0);
+    return rss;
+}
+
+/**
+ * Run a request as a CGI. The response headers are parsed for the status
+ * and the rest counted as the body
+ */
+static int request_cgi(runner_t *r, const char *method, const char *path, const char *query, int bodyfd, off_t bodyoff, size_t bodylen, size_t *received) {
+    int pfd[2];
+    if (pipe2(pfd, O_CLOEXEC)) {
+        fail("pipe");
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        char len[32];
+        int in = bodyfd >= 0 ? dup(bodyfd) : open("/dev/null", O_RDONLY);
+        lseek(in, bodyoff, SEEK_SET);
+        dup2(in, STDIN_FILENO);
+        dup2(pfd[1], STDOUT_FILENO);
+        snprintf(len, sizeof(len), "%zu", bodylen);
+        setenv("CONTENT_LENGTH", len, 1);
+        const char *args[] = { "--method", method, "--path", path, "--query", query, NULL };
+        exec_binary(args);
+    } else if (pid < 0) {
+        fail("fork");
+    }
+    close(pfd[1]);
+
+    char buf[RXBUF], head[4096];
+    size_t headlen = 0, body = 0;
+    int status = 200, inbody = 0;
+    ssize_t l;
+    while ((l=read(pfd[0], buf, sizeof(buf))) > 0 || (l < 0 && errno == EINTR)) {
+        if (inbody) {
+            body += l > 0 ? l : 0;
+        } else if (l > 0) {
+            size_t n = l < sizeof(head) - 1 - headlen ? l : sizeof(head) - 1 - headlen;
+            memcpy(head + headlen, buf, n);
+            headlen += n;
+            head[headlen] = 0;
+            char *end = strstr(head, "\r\n\r\n");
+            if (end) {
+                inbody = 1;
+                body = l - (end + 4 - head - (headlen - n));
+                if (!strncmp(head, "Status: ", 8)) {
+                    status = atoi(head + 8);
+                }
+            }
+        }
+    }
+    close(pfd[0]);
+    struct rusage ru;
+    int ws;
+    if (wait4(pid, &ws, 0, &ru) == pid && ru.ru_maxrss > r->rss) {
+        r->rss = ru.ru_maxrss;
+    }
+    *received = body;
+    return !WIFEXITED(ws) || WEXITSTATUS(ws) || !inbody ? -1 : status;
+}
+
+/**
+ * Read a line of the response into "line", returning -1 if the connection
+ * closes first
+ */
+static int rx_line(runner_t *r, char *line, size_t size) {
+    size_t n = 0;
+    for (;;) {
+        if (r->rxpos == r->rxlen) {
+            ssize_t l = read(r->sock, r->rx, sizeof(r->rx));
+            if (l <= 0) {
+                return -1;
+            }
+            r->rxlen = l;
+            r->rxpos = 0;
+        }
+        char c = r->rx[r->rxpos++];
+        if (c == '\n') {
+            line[n > 0 && line[n - 1] == '\r' ? n - 1 : n] = 0;
+            return 0;
+        } else if (n < size - 1) {
+            line[n++] = c;
+        }
+    }
+}
+
+/**
+ * Discard "len" bytes of the response
+ */
+static int rx_skip(runner_t *r, size_t len) {
+    while (len) {
+        if (r->rxpos == r->rxlen) {
+            ssize_t l = read(r->sock, r->rx, sizeof(r->rx));
+            if (l <= 0) {
+                return -1;
+            }
+            r->rxlen = l;
+            r->rxpos = 0;
+        }
+        size_t n = r->rxlen - r->rxpos < len ? r->rxlen - r->rxpos : len;
+        r->rxpos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Run a request over the connection to the server
+ */
+static int request_http(runner_t *r, const char *method, const char *path, const char *query, int bodyfd, off_t bodyoff, size_t bodylen, size_t *received) {
+    char line[4096];
+    int n = snprintf(line, sizeof(line), "%s %s?%s HTTP/1.1\r\nHost: bench\r\nContent-Length: %zu\r\n\r\n", method, path, query, bodylen);
+    if (write(r->sock, line, n) != n) {
+        return -1;
+    }
+    for (size_t sent=0;sent<bodylen;) {
+        ssize_t l = sendfile(r->sock, bodyfd, &bodyoff, bodylen - sent);
+        if (l <= 0) {
+            return -1;
+        }
+        sent += l;
+    }
+
+    int status = -1, chunked = 0, closing = 0;
+    size_t length = 0;
+    if (rx_line(r, line, sizeof(line)) || sscanf(line, "HTTP/1.%*d %d", &status) != 1) {
+        return -1;
+    }
+    while (!rx_line(r, line, sizeof(line)) && *line) {
+        if (!strncasecmp(line, "Content-Length:", 15)) {
+            length = strtoul(line + 15, NULL, 10);
+        } else if (!strncasecmp(line, "Transfer-Encoding:", 18) && strstr(line, "chunked")) {
+            chunked = 1;
+        } else if (!strncasecmp(line, "Connection:", 11) && strstr(line, "close")) {
+            closing = 1;
+        }
+    }
+    *received = 0;
+    if (chunked) {
+        while (!rx_line(r, line, sizeof(line)) && (length = strtoul(line, NULL, 16)) > 0) {
+            if (rx_skip(r, length) || rx_line(r, line, sizeof(line))) {
+                return -1;
+            }
+            *received += length;
+        }
+        rx_line(r, line, sizeof(line));
+    } else if (rx_skip(r, length)) {
+        return -1;
+    } else {
+        *received = length;
+    }
+    if (closing) {
+        return -1;      // requests are meant to keep the connection open
+    }
+    return status;
+}
+
+/**
+ * Time one request, adding it to the result unless it's the warm-up
+ */
+static void request(runner_t *r, result_t *res, int warmup, const char *method, const char *path, const char *query, int bodyfd, off_t bodyoff, size_t bodylen) {
+    size_t received = 0;
+    double start = now_ms();
+    int status = r->pid ? request_http(r, method, path, query, bodyfd, bodyoff, bodylen, &received) : request_cgi(r, method, path, query, bodyfd, bodyoff, bodylen, &received);
+    double ms = now_ms() - start;
+    if (status < 200 || status > 299) {
+        fprintf(stderr, "bench: %s %s?%s: status %d\n", method, path, query, status);
+        if (r->pid && status < 0) {
+            exit(1);    // the connection is in an unknown state
+        }
+    }
+    if (warmup) {
+        res->first = ms;
+    } else {
+        res->lat = realloc(res->lat, (res->ops + 1) * sizeof(double));
+        res->lat[res->ops++] = ms;
+        res->errors += status < 200 || status > 299;
+        res->bytes += bodylen + received;
+    }
+}
+
+//-------------------------------------------------------------------------
+// Results
+
+static int cmpdouble(const void *a, const void *b) {
+    double x = *(double *)a, y = *(double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(result_t *res, double p) {
+    if (!res->ops) {
+        return 0;
+    }
+    int i = (int)(p * res->ops + 0.5) - 1;
+    return res->lat[i < 0 ? 0 : i >= res->ops ? res->ops - 1 : i];
+}
+
+static void begin(runner_t *r, result_t *res) {
+    memset(res, 0, sizeof(*res));
+    res->first = -1;
+    r->rss = 0;
+    if (!strcmp(r->mode, "http")) {
+        server_start(r);
+    } else {
+        r->pid = 0;
+    }
+}
+
+/**
+ * Print the result as a line of JSON. "params" is more JSON members
+ * describing the scenario. "bytes" are only counted for MB/s if "transfer"
+ */
+static void report(runner_t *r, result_t *res, const char *scenario, const char *params, int transfer) {
+    double secs = 0;
+    long rss = r->pid ? server_stop(r) : r->rss;
+    for (int i=0;i<res->ops;i++) {
+        secs += res->lat[i] / 1000;
+    }
+    qsort(res->lat, res->ops, sizeof(double), cmpdouble);
+    printf("{\"scenario\":\"%s\",%s,\"mode\":\"%s\",\"ops\":%d,\"errors\":%d,\"seconds\":%.3f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.1f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,",
+        scenario, params, r->mode, res->ops, res->errors, secs, secs > 0 ? res->ops / secs : 0,
+        transfer && secs > 0 ? res->bytes / (1 << 20) / secs : 0, percentile(res, 0.5), percentile(res, 0.99));
+    if (res->first >= 0) {
+        printf("\"first_ms\":%.3f,", res->first);
+    }
+    printf("\"peak_rss_kb\":%ld}\n", rss);
+    fflush(stdout);
+    free(res->lat);
+}
+
+//-------------------------------------------------------------------------
+// Scenarios
+
+static void bench_list(runner_t *r, size_t entries) {
+    char dir[64], query[128], params[64];
+    result_t res;
+    int iterations = entries <= 1000 ? 100 : entries <= 100000 ? 10 : 3;
+    snprintf(dir, sizeof(dir), "%s/list%zu", root, entries);
+    if (mkdir(dir, 0755) == 0) {
+        fprintf(stderr, "bench: creating %zu files\n", entries);
+        char *path = malloc(strlen(dir) + 16);
+        for (size_t i=0;i<entries;i++) {
+            sprintf(path, "%s/f%07zu", dir, i);
+            mkfile(path);
+        }
+        free(path);
+    }
+    fprintf(stderr, "bench: list %zu %s\n", entries, r->mode);
+    snprintf(query, sizeof(query), "path=list%zu", entries);
+    snprintf(params, sizeof(params), "\"entries\":%zu", entries);
+    begin(r, &res);
+    request(r, &res, 1, "GET", "/info", query, -1, 0, 0);
+    for (int i=0;i<iterations;i++) {
+        request(r, &res, 0, "GET", "/info", query, -1, 0, 0);
+    }
+    report(r, &res, "list", params, 1);
+}
+
+static void bench_put(runner_t *r, int srcfd, size_t chunk, size_t total) {
+    char query[128], params[64];
+    result_t res;
+    fprintf(stderr, "bench: put %zu byte chunks %s\n", chunk, r->mode);
+    mkdir(strcat(strcpy(query, root), "/put"), 0755);
+    snprintf(params, sizeof(params), "\"chunk\":%zu,\"total\":%zu", chunk, total);
+    begin(r, &res);
+    for (size_t off=0;off<total;off+=chunk) {
+        snprintf(query, sizeof(query), "path=put/%zu-%s.bin&off=%zu", chunk, r->mode, off);
+        request(r, &res, 0, "POST", "/put", query, srcfd, off, chunk < total - off ? chunk : total - off);
+    }
+    report(r, &res, "put", params, 1);
+}
+
+static void bench_get(runner_t *r, size_t size) {
+    char params[64];
+    result_t res;
+    fprintf(stderr, "bench: get %zu bytes %s\n", size, r->mode);
+    snprintf(params, sizeof(params), "\"size\":%zu", size);
+    begin(r, &res);
+    request(r, &res, 1, "GET", "/get", "path=get/large.bin", -1, 0, 0);
+    for (int i=0;i<5;i++) {
+        request(r, &res, 0, "GET", "/get", "path=get/large.bin", -1, 0, 0);
+    }
+    report(r, &res, "get", params, 1);
+}
+
+/**
+ * Create a tree "depth" directories deep with "width" subdirectories in each
+ * of the first level and "files" files in every directory
+ */
+static size_t mktree(char *path, int depth, int width, int files) {
+    size_t len = strlen(path), n = 1;
+    if (mkdir(path, 0755)) {
+        fail(path);
+    }
+    for (int i=0;i<files;i++) {
+        sprintf(path + len, "/f%d", i);
+        mkfile(path);
+        n++;
+    }
+    for (int i=0;depth > 1 && i<width;i++) {
+        sprintf(path + len, "/d%d", i);
+        n += mktree(path, depth - 1, 1, files);
+    }
+    path[len] = 0;
+    return n;
+}
+
+static void bench_delete(runner_t *r, const char *shape, int depth, int width, int files) {
+    char path[16384], query[128], params[128];
+    result_t res;
+    size_t entries = 0;
+    fprintf(stderr, "bench: delete %s tree %s\n", shape, r->mode);
+    snprintf(query, sizeof(query), "path=delete-%s", shape);
+    begin(r, &res);
+    for (int i=0;i<3;i++) {
+        snprintf(path, sizeof(path), "%s/delete-%s", root, shape);
+        entries = mktree(path, depth, width, files);
+        request(r, &res, 0, "POST", "/delete", query, -1, 0, 0);
+    }
+    snprintf(params, sizeof(params), "\"shape\":\"%s\",\"depth\":%d,\"entries\":%zu", shape, depth, entries);
+    report(r, &res, "delete", params, 0);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: bench [options]\n");
+    fprintf(stderr, "  --binary <path>        the filemanager binary. Default is ./filemanager\n");
+    fprintf(stderr, "  --mode <cgi|http|all>  how to run it. Default is all\n");
+    fprintf(stderr, "  --only <scenario>      run only \"list\", \"put\", \"get\" or \"delete\"\n");
+    fprintf(stderr, "  --quick                smaller directories and files, for a fast check\n");
+    fprintf(stderr, "  --threads <n>          worker threads for the server\n");
+    fprintf(stderr, "  --arg <arg>            pass another argument to the binary, eg \"--arg --io --arg uring\"\n");
+    fprintf(stderr, "  --keep                 don't remove the temporary directory\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *modes[] = { "cgi", "http" }, *only = NULL;
+    int mode0 = 0, mode1 = 2, keep = 0;
+    for (int i=1;i<argc;i++) {
+        if (!strcmp(argv[i], "--binary") && i + 1 < argc) {
+            binary = argv[++i];
+        } else if (!strcmp(argv[i], "--mode") && i + 1 < argc) {
+            i++;
+            mode0 = !strcmp(argv[i], "http");
+            mode1 = !strcmp(argv[i], "cgi") ? 1 : 2;
+        } else if (!strcmp(argv[i], "--only") && i + 1 < argc) {
+            only = argv[++i];
+        } else if (!strcmp(argv[i], "--quick")) {
+            quick = 1;
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--arg") && i + 1 < argc && nextra < MAXARGS) {
+            extra[nextra++] = argv[++i];
+        } else if (!strcmp(argv[i], "--keep")) {
+            keep = 1;
+        } else {
+            usage();
+        }
+    }
+    if (access(binary, X_OK)) {
+        fail(binary);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char work[] = "/tmp/fmbench.XXXXXX", src[64];
+    if (!mkdtemp(work)) {
+        fail("mkdtemp");
+    }
+    root = malloc(strlen(work) + 8);
+    sprintf(root, "%s/root", work);
+    sprintf(src, "%s/src.bin", work);
+    mkdir(root, 0755);
+
+    size_t lists[] = { 1000, 100000, 1000000 }, quicklists[] = { 1000, 10000 };
+    size_t chunks[] = { 65536, 1 << 20, 16 << 20 };
+    size_t puttotal = quick ? 16 << 20 : 256 << 20;
+    size_t getsize = quick ? 32 << 20 : 1 << 30;
+    int srcfd = -1;
+    if (!only || !strcmp(only, "put")) {
+        mkdata(src, puttotal);
+        srcfd = open(src, O_RDONLY);
+    }
+    if (!only || !strcmp(only, "get")) {
+        mkdir(strcat(strcpy(src, root), "/get"), 0755);
+        mkdata(strcat(src, "/large.bin"), getsize);
+    }
+
+    runner_t *r = calloc(1, sizeof(runner_t));
+    r->sock = -1;
+    for (int m=mode0;m<mode1;m++) {
+        r->mode = modes[m];
+        if (!only || !strcmp(only, "list")) {
+            for (int i=0;i<(quick ? 2 : 3);i++) {
+                bench_list(r, quick ? quicklists[i] : lists[i]);
+            }
+        }
+        if (!only || !strcmp(only, "put")) {
+            for (int i=0;i<3;i++) {
+                bench_put(r, srcfd, chunks[i], puttotal);
+            }
+        }
+        if (!only || !strcmp(only, "get")) {
+            bench_get(r, getsize);
+        }
+        if (!only || !strcmp(only, "delete")) {
+            bench_delete(r, "deep", quick ? 100 : 1000, 1, 1);
+            bench_delete(r, "wide", 2, quick ? 10 : 100, quick ? 100 : 1000);
+        }
+    }
+    if (keep) {
+        fprintf(stderr, "bench: left files in %s\n", work);
+    } else {
+        rmtree(work);
+    }
+    return 0;
+}
@@ -0,0 +1,491 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#define BULKSMALL (1<<20)       // files up to this size are queued for the writer, larger ones copied in directly
+#define BULKQUEUE (16<<20)      // maximum bytes of files queued for the writer
+#define BULKHEADER (1<<20)      // maximum size of a long name or pax header
+
+/*
+ * Bulk extracts a tar archive sent as the request body, so many small files
+ * can be uploaded in one request rather than one "put" each. Names are
+ * checked as put checks them, and are relative to "path".
+ *
+ * The archive is read by the request thread and the files written by a
+ * writer thread, so reading the next file overlaps with creating the last.
+ * Small files are read into memory and queued, up to BULKQUEUE bytes; a
+ * large one waits for the queue to empty and is then copied from the
+ * request straight to the file with copyin(). The directory of each file
+ * is remembered, so parents are only created when it changes. The indexes
+ * of the directories written to are removed at the end, to be rebuilt.
+ * Small files are hashed as they're written; large ones when first asked.
+ *
+ * Ordinary files and directories are extracted. GNU long names and pax
+ * "path", "size" and "mtime" records are understood; other entries are
+ * skipped and reported as failed.
+ */
+
+typedef struct bulkfile {
+    struct bulkfile *next;
+    char *path;             // full path
+    int isdir;
+    const char *err;        // not written because of this
+    time_t mtime;
+    size_t len;
+    char data[];
+} bulkfile_t;
+
+typedef struct bulkstate {
+    context_t *ctx;
+    jsonw_t *w;
+    pthread_mutex_t lock;   // guards everything below, and writing to w
+    pthread_cond_t cond;
+    bulkfile_t *head, *tail;
+    size_t queued;          // bytes of files in the queue
+    int busy;               // the writer has a file
+    int done;               // no more files are coming
+    size_t files, failed;
+    // Used only by the writer, or by the request thread when the writer is idle
+    char *lastdir;          // the directory of the last file written, which exists
+    char **dirs;            // directories written to
+    size_t ndirs;
+} bulkstate_t;
+
+/**
+ * Add a written path to the response, with the error if it failed
+ */
+static void bulk_report(bulkstate_t *st, const char *path, const char *err) {
+    pthread_mutex_lock(&st->lock);
+    jw_object(st->w);
+    jw_key(st->w, "path");
+    jw_string(st->w, path + strlen(st->ctx->root));
+    jw_key(st->w, "ok");
+    jw_boolean(st->w, !err);
+    if (err) {
+        jw_key(st->w, "msg");
+        jw_string(st->w, err);
+        st->failed++;
+    } else {
+        st->files++;
+    }
+    jw_object_end(st->w);
+    pthread_mutex_unlock(&st->lock);
+}
+
+/**
+ * Create the parents of path unless they're those of the last file
+ */
+static void bulk_parent(bulkstate_t *st, char *path) {
+    size_t len = strrchr(path, '/') - path;
+    if (!st->lastdir || strlen(st->lastdir) != len || strncmp(st->lastdir, path, len)) {
+        mkparents(path);
+        free(st->lastdir);
+        st->lastdir = strndup(path, len);
+        st->dirs = realloc(st->dirs, (st->ndirs + 1) * sizeof(char *));
+        st->dirs[st->ndirs++] = strdup(st->lastdir);
+    }
+}
+
+static void bulk_mtime(int fd, time_t mtime) {
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { mtime, 0 } };
+    futimens(fd, times);
+}
+
+static void bulk_write(bulkstate_t *st, bulkfile_t *f) {
+    struct stat sb;
+    if (f->err) {
+        bulk_report(st, f->path, f->err);
+        return;
+    }
+    bulk_parent(st, f->path);
+    if (f->isdir) {
+        int err = mkdir(f->path, 0777) ? errno : 0;
+        if (err == EEXIST && !stat(f->path, &sb) && S_ISDIR(sb.st_mode)) {
+            err = 0;
+        } else if (err) {
+            logmsg(st->ctx, "bulk mkdir \"%s\": %s", f->path, strerror(err));
+        }
+        bulk_report(st, f->path, err ? strerror(err) : NULL);
+        return;
+    }
+    int err = 0;
+    int fd = open(f->path, O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, 0666);
+    if (fd < 0) {
+        err = errno;
+    } else {
+        for (size_t i=0;i<f->len;) {
+            ssize_t l = write(fd, f->data + i, f->len - i);
+            if (l > 0) {
+                i += l;
+            } else if (l < 0 && errno != EINTR) {
+                err = errno;
+                break;
+            }
+        }
+        bulk_mtime(fd, f->mtime);
+        if (!err) {
+            xxh64_t state;
+            xxh64_init(&state);
+            xxh64_update(&state, f->data, f->len);
+            hash_set(st->ctx, fd, f->path + strlen(st->ctx->root) + 1, &state);
+        }
+        close(fd);
+    }
+    if (err) {
+        logmsg(st->ctx, "bulk write \"%s\": %s", f->path, strerror(err));
+    }
+    bulk_report(st, f->path, err ? strerror(err) : NULL);
+}
+
+static void *bulk_writer(void *arg) {
+    bulkstate_t *st = arg;
+    pthread_mutex_lock(&st->lock);
+    for (;;) {
+        while (!st->head && !st->done) {
+            pthread_cond_wait(&st->cond, &st->lock);
+        }
+        bulkfile_t *f = st->head;
+        if (!f) {
+            break;
+        }
+        st->head = f->next;
+        st->busy = 1;
+        pthread_mutex_unlock(&st->lock);
+        bulk_write(st, f);
+        pthread_mutex_lock(&st->lock);
+        st->queued -= f->len;
+        st->busy = 0;
+        pthread_cond_broadcast(&st->cond);
+        free(f->path);
+        free(f);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+/**
+ * Queue f for the writer, waiting while the queue is full
+ */
+static void bulk_queue(bulkstate_t *st, bulkfile_t *f) {
+    pthread_mutex_lock(&st->lock);
+    while (st->head && st->queued + f->len > BULKQUEUE) {
+        pthread_cond_wait(&st->cond, &st->lock);
+    }
+    if (st->head) {
+        st->tail->next = f;
+    } else {
+        st->head = f;
+    }
+    st->tail = f;
+    st->queued += f->len;
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+}
+
+/**
+ * Wait until the writer has written everything queued
+ */
+static void bulk_drain(bulkstate_t *st) {
+    pthread_mutex_lock(&st->lock);
+    while (st->head || st->busy) {
+        pthread_cond_wait(&st->cond, &st->lock);
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+/**
+ * Read exactly len bytes of the request body into buf, or discard them if
+ * buf is NULL. Return 0 on success
+ */
+static int bulk_read(context_t *ctx, void *buf, size_t len) {
+    char skip[4096];
+    while (len) {
+        size_t n = buf || len < sizeof(skip) ? len : sizeof(skip);
+        ssize_t l = read_body(ctx, buf ? buf : skip, n);
+        if (l <= 0) {
+            return -1;
+        }
+        len -= l;
+        if (buf) {
+            buf = (char *)buf + l;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Return the value of a tar header number field: octal, or base-256 if
+ * the top bit of the first byte is set
+ */
+static uint64_t tar_number(const unsigned char *p, size_t len) {
+    uint64_t v = 0;
+    if (*p & 0x80) {
+        v = *p & 0x7F;
+        for (size_t i=1;i<len;i++) {
+            v = (v << 8) | p[i];
+        }
+        return v;
+    }
+    for (;len && *p == ' ';len--) {
+        p++;
+    }
+    for (;len && *p >= '0' && *p <= '7';len--) {
+        v = v * 8 + *p++ - '0';
+    }
+    return v;
+}
+
+/**
+ * Return non-zero if the 512-byte tar header h has a valid checksum
+ */
+static int tar_valid(const unsigned char *h) {
+    unsigned long sum = 0;
+    for (int i=0;i<512;i++) {
+        sum += i >= 148 && i < 156 ? ' ' : h[i];
+    }
+    return sum == tar_number(h + 148, 8);
+}
+
+/**
+ * Apply the records of a pax extended header - "<len> <key>=<value>\n" -
+ * that we use
+ */
+static void tar_pax(char *data, size_t len, char **name, uint64_t *size, time_t *mtime) {
+    for (char *c=data;c<data+len;) {
+        char *e;
+        size_t rlen = strtoul(c, &e, 10);
+        if (rlen == 0 || *e != ' ' || c + rlen > data + len || c[rlen - 1] != '\n') {
+            break;
+        }
+        char *key = e + 1, *end = c + rlen - 1;
+        char *value = memchr(key, '=', end - key);
+        if (value++) {
+            if (!strncmp(key, "path=", 5)) {
+                free(*name);
+                *name = strndup(value, end - value);
+            } else if (!strncmp(key, "size=", 5)) {
+                *size = strtoull(value, NULL, 10);
+            } else if (!strncmp(key, "mtime=", 6)) {
+                *mtime = strtoll(value, NULL, 10);
+            }
+        }
+        c += rlen;
+    }
+}
+
+/**
+ * Read the archive, queueing or writing each entry. Return NULL at the end
+ * of the archive, or a message for an archive that can't be read
+ */
+static const char *bulk_extract(bulkstate_t *st, const char *base, int threaded) {
+    context_t *ctx = st->ctx;
+    unsigned char h[512];
+    char *name = NULL;
+    uint64_t size = UINT64_MAX;
+    time_t mtime = -1;
+    const char *err = NULL;
+
+    while (!err) {
+        if (bulk_read(ctx, h, sizeof(h))) {
+            err = "archive is truncated";
+            break;
+        }
+        int i = 0;
+        while (i < 512 && h[i] == 0) {
+            i++;
+        }
+        if (i == 512) {
+            break;          // end of archive
+        } else if (!tar_valid(h)) {
+            err = "invalid tar header";
+            break;
+        }
+        int type = h[156];
+        uint64_t len = tar_number(h + 124, 12);
+        size_t pad = (512 - len % 512) % 512;
+        if (type == 'x' || type == 'L') {
+            // Extended header or GNU long name, for the next entry
+            char *data = len <= BULKHEADER ? malloc(len + 1) : NULL;
+            if (!data || bulk_read(ctx, data, len) || bulk_read(ctx, NULL, pad)) {
+                err = data ? "archive is truncated" : "tar header too long";
+                free(data);
+                break;
+            }
+            data[len] = 0;
+            if (type == 'L') {
+                free(name);
+                name = strndup(data, len);
+            } else {
+                tar_pax(data, len, &name, &size, &mtime);
+            }
+            free(data);
+            continue;
+        }
+        if (size != UINT64_MAX) {
+            len = size;
+            pad = (512 - len % 512) % 512;
+        }
+        if (mtime == -1) {
+            mtime = tar_number(h + 136, 12);
+        }
+        if (!name) {
+            // ustar splits a long name between "prefix" and "name"
+            size_t plen = memcmp(h + 257, "ustar", 5) ? 0 : strnlen((char *)h + 345, 155), nlen = strnlen((char *)h, 100);
+            name = malloc(plen + nlen + 2);
+            sprintf(name, "%.*s%s%.*s", (int)plen, h + 345, plen ? "/" : "", (int)nlen, h);
+        }
+
+        char *rel = name;
+        while (*rel == '/' || (rel[0] == '.' && rel[1] == '/')) {
+            rel += *rel == '/' ? 1 : 2;
+        }
+        for (size_t l=strlen(rel);l>0 && rel[l-1]=='/';) {
+            rel[--l] = 0;
+        }
+        char *path = malloc(strlen(ctx->root) + strlen(base) + strlen(rel) + 3);
+        sprintf(path, "%s/%s%s%s", ctx->root, base, *base ? "/" : "", rel);
+        int isdir = type == '5', isfile = type == '0' || type == 0 || type == '7';
+        const char *bad = !isdir && !isfile ? "not a file or directory" : rel[0] == 0 || rel[0] == '.' || strstr(rel, "/.") ? "invalid path" : NULL;
+        if (!bad && !isdir && len > BULKSMALL) {
+            // Copied straight from the request once the writer's done, so it's in order
+            size_t count = 0;
+            const char *how;
+            int fd = -1;
+            if (threaded) {
+                bulk_drain(st);
+            }
+            bulk_parent(st, path);
+            if ((fd = open(path, O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, 0666)) < 0) {
+                bulk_report(st, path, strerror(errno));
+            } else {
+                int e = copyin(ctx, fd, 0, len, &count, &how);
+                bulk_mtime(fd, mtime);
+                close(fd);
+                logmsg(ctx, "bulk \"%s\": wrote %lu bytes with %s", path, (unsigned long)count, how);
+                if (e || count != len) {
+                    bulk_report(st, path, e ? strerror(e) : "archive is truncated");
+                    err = "archive is truncated";
+                } else {
+                    bulk_report(st, path, NULL);
+                }
+            }
+            if (fd < 0 && bulk_read(ctx, NULL, len)) {
+                err = "archive is truncated";
+            }
+        } else {
+            // Rejected entries are queued too, so the reply is in the order of the archive
+            int keep = !bad && !isdir;
+            bulkfile_t *f = malloc(sizeof(bulkfile_t) + (keep ? len : 0));
+            f->next = NULL;
+            f->path = path;
+            f->isdir = isdir;
+            f->err = bad;
+            f->mtime = mtime;
+            f->len = keep ? len : 0;
+            path = NULL;
+            if (bulk_read(ctx, f->data, f->len) || (!keep && bulk_read(ctx, NULL, len))) {
+                err = "archive is truncated";
+                free(f->path);
+                free(f);
+            } else if (threaded) {
+                bulk_queue(st, f);
+            } else {
+                bulk_write(st, f);
+                free(f->path);
+                free(f);
+            }
+        }
+        free(path);
+        if (!err && bulk_read(ctx, NULL, pad)) {
+            err = "archive is truncated";
+        }
+        free(name);
+        name = NULL;
+        size = UINT64_MAX;
+        mtime = -1;
+    }
+    free(name);
+    return err;
+}
+
+/**
+ * Extract the tar archive in the request body under "path", or the root,
+ * replying with each path written and whether it succeeded
+ */
+void bulk(context_t *ctx) {
+    char *base = "";
+    for (char **q=ctx->query;*q;) {
+        char *qkey = *q++;
+        char *qval = *q++;
+        if (!strcmp(qkey, "path")) {
+            base = qval + (*qval == '/');
+            for (char *c=qval+strlen(qval);c>base && c[-1]=='/';) {
+                *--c = 0;
+            }
+        }
+    }
+    if (base[0] == '.' || strstr(base, "/.")) {
+        send_msg(ctx, 400, "invalid path \"%s\"", base);
+        return;
+    }
+
+    jsonw_t w;
+    bulkstate_t st;
+    pthread_t writer;
+    memset(&st, 0, sizeof(st));
+    st.ctx = ctx;
+    st.w = &w;
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
+    jw_start(&w, ctx, 200);
+    jw_object(&w);
+    jw_key(&w, "paths");
+    jw_array(&w);
+    int threaded = !pthread_create(&writer, NULL, bulk_writer, &st);
+    const char *err = bulk_extract(&st, base, threaded);
+    if (threaded) {
+        pthread_mutex_lock(&st.lock);
+        st.done = 1;
+        pthread_cond_broadcast(&st.cond);
+        pthread_mutex_unlock(&st.lock);
+        pthread_join(writer, NULL);
+    }
+    // Whatever was written, the indexes of those directories may now be wrong
+    for (size_t i=0;i<st.ndirs;i++) {
+        size_t len = strlen(ctx->root);
+        index_forget(ctx, strlen(st.dirs[i]) > len ? st.dirs[i] + len + 1 : "");
+        free(st.dirs[i]);
+    }
+    if (!err) {
+        jw_array_end(&w);
+        jw_key(&w, "ok");
+        jw_boolean(&w, 1);
+        jw_object_end(&w);
+        logmsg(ctx, "tx 200 bulk: %lu files, %lu failed, in %lu bytes", (unsigned long)st.files, (unsigned long)st.failed, (unsigned long)jw_end(&w));
+    } else if (jw_discard(&w)) {
+        logmsg(ctx, "bulk: %s after %lu files", err, (unsigned long)st.files);
+        send_msg(ctx, 400, "%s after %lu files", err, (unsigned long)st.files);
+    } else {
+        logmsg(ctx, "bulk: %s after %lu files", err, (unsigned long)st.files);
+        jw_array_end(&w);
+        jw_key(&w, "ok");
+        jw_boolean(&w, 0);
+        jw_key(&w, "msg");
+        jw_string(&w, err);
+        jw_object_end(&w);
+        jw_end(&w);
+    }
+    free(st.dirs);
+    free(st.lastdir);
+    pthread_mutex_destroy(&st.lock);
+    pthread_cond_destroy(&st.cond);
+}
@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <fcntl.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define GZIPFAST 1              // compression levels for responses made as they're sent...
+#define ZSTDFAST 1
+#define GZIPBEST 6              // ...and for files compressed once and kept
+#define ZSTDBEST 9
+#define COMPRESSMAX (64<<20)    // largest file we'll compress for get
+#define SNIFFLEN 16384          // bytes of a file examined to decide if it's worth compressing
+#define SNIFFENTROPY 7.0        // bits per byte above which a file is taken to be compressed already
+#define SOURCEATTR "user.filemanager.source"    // extended attribute naming a compressed copy's file
+
+/*
+ * Responses are compressed if the client's "Accept-Encoding" allows. JSON
+ * from the writer is compressed as it's generated, quickly rather than well
+ * as it's done for every request. A file for get is compressed once, well,
+ * into STATEDIR/compressed, and that copy sent while the file is unchanged.
+ * The copy is named for the file's path and has an extended attribute
+ * with the path and the file's inode, size, mtime and ctime; as ctime can't
+ * be set, a file that's replaced or rewritten, even with the same mtime,
+ * won't match. Where there are no extended attributes a copy is used once
+ * and not kept. Copies of files that are deleted or moved are removed. Only
+ * files that look like they'll compress are tried: the start of the file
+ * mustn't be in a compressed format we recognise, nor look random.
+ */
+
+typedef struct sourceattr {
+    uint64_t ino, size;
+    int64_t mtime, ctime;       // in ns
+    char path[PATH_MAX];        // relative to the root; stored up to its NUL
+} sourceattr_t;
+
+struct encoder {
+    int encoding;
+    z_stream z;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zc;
+#endif
+    unsigned char out[JSONW_BUFSIZE];
+};
+
+/**
+ * Return the encoding to use for the response from "Accept-Encoding": the
+ * one we support with the highest "q" value, preferring zstd on a tie
+ */
+int accept_encoding(context_t *ctx) {
+    char *v = getheader(ctx, "accept-encoding");
+    double q[3] = { -1, -1, -1 }, star = -1;
+    for (const char *c=v;c && *c;) {
+        while (*c == ' ' || *c == '\t' || *c == ',') {
+            c++;
+        }
+        const char *name = c;
+        while (*c && *c != ',' && *c != ';' && *c != ' ' && *c != '\t') {
+            c++;
+        }
+        size_t len = c - name;
+        double quality = 1;
+        for (;*c && *c != ',';c++) {
+            if (*c == ';') {
+                while (c[1] == ' ' || c[1] == '\t') {
+                    c++;
+                }
+                if (!strncasecmp(c + 1, "q=", 2)) {
+                    quality = strtod(c + 3, NULL);
+                }
+            }
+        }
+        if (len == 1 && *name == '*') {
+            star = quality;
+        } else if ((len == 4 && !strncasecmp(name, "gzip", 4)) || (len == 6 && !strncasecmp(name, "x-gzip", 6))) {
+            q[ENC_GZIP] = quality;
+        } else if (len == 4 && !strncasecmp(name, "zstd", 4)) {
+            q[ENC_ZSTD] = quality;
+        }
+    }
+    int best = ENC_IDENTITY;
+    double bestq = 0;
+#ifdef HAVE_ZSTD
+    int first = ENC_ZSTD;
+#else
+    int first = ENC_GZIP;
+#endif
+    for (int e=first;e>ENC_IDENTITY;e--) {
+        double eq = q[e] < 0 ? star : q[e];
+        if (eq > bestq) {
+            best = e;
+            bestq = eq;
+        }
+    }
+    return best;
+}
+
+/**
+ * Return the name of an encoding for "Content-Encoding"
+ */
+const char *encoding_name(int encoding) {
+    return encoding == ENC_GZIP ? "gzip" : encoding == ENC_ZSTD ? "zstd" : "identity";
+}
+
+/**
+ * Return a new encoder, compressing fast or well, or NULL if the encoding
+ * isn't supported or there's no memory
+ */
+encoder_t *encoder_new(int encoding, int best) {
+    encoder_t *e = calloc(1, sizeof(encoder_t));
+    if (!e) {
+        return NULL;
+    }
+    e->encoding = encoding;
+    if (encoding == ENC_GZIP) {
+        // windowBits + 16 for a gzip header rather than zlib
+        if (deflateInit2(&e->z, best ? GZIPBEST : GZIPFAST, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+            return e;
+        }
+#ifdef HAVE_ZSTD
+    } else if (encoding == ENC_ZSTD) {
+        if ((e->zc = ZSTD_createCCtx()) != NULL) {
+            ZSTD_CCtx_setParameter(e->zc, ZSTD_c_compressionLevel, best ? ZSTDBEST : ZSTDFAST);
+            return e;
+        }
+#endif
+    }
+    free(e);
+    return NULL;
+}
+
+/**
+ * Compress len bytes of data, passing the output to "out" as it's made. With
+ * ENC_FLUSH everything written so far is output, so the client can decode
+ * it; with ENC_END the stream is finished. Return 0 on success
+ */
+int encoder_write(encoder_t *e, const void *data, size_t len, int mode, encout_t out, void *arg) {
+    if (e->encoding == ENC_GZIP) {
+        int flush = mode == ENC_END ? Z_FINISH : mode == ENC_FLUSH ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+        int ret;
+        e->z.next_in = (unsigned char *)data;
+        e->z.avail_in = len;
+        do {
+            e->z.next_out = e->out;
+            e->z.avail_out = sizeof(e->out);
+            ret = deflate(&e->z, flush);
+            if (ret == Z_STREAM_ERROR) {
+                return -1;
+            } else if (e->z.avail_out != sizeof(e->out)) {
+                out(arg, e->out, sizeof(e->out) - e->z.avail_out);
+            }
+        } while (e->z.avail_out == 0 || (mode == ENC_END && ret != Z_STREAM_END));
+        return 0;
+#ifdef HAVE_ZSTD
+    } else if (e->encoding == ENC_ZSTD) {
+        ZSTD_EndDirective op = mode == ENC_END ? ZSTD_e_end : mode == ENC_FLUSH ? ZSTD_e_flush : ZSTD_e_continue;
+        ZSTD_inBuffer in = { data, len, 0 };
+        size_t remaining;
+        do {
+            ZSTD_outBuffer o = { e->out, sizeof(e->out), 0 };
+            remaining = ZSTD_compressStream2(e->zc, &o, &in, op);
+            if (ZSTD_isError(remaining)) {
+                return -1;
+            } else if (o.pos) {
+                out(arg, e->out, o.pos);
+            }
+        } while (op == ZSTD_e_continue ? in.pos < in.size : remaining != 0);
+        return 0;
+#endif
+    }
+    return -1;
+}
+
+void encoder_free(encoder_t *e) {
+    if (e) {
+        if (e->encoding == ENC_GZIP) {
+            deflateEnd(&e->z);
+#ifdef HAVE_ZSTD
+        } else if (e->encoding == ENC_ZSTD) {
+            ZSTD_freeCCtx(e->zc);
+#endif
+        }
+        free(e);
+    }
+}
+
+/**
+ * Return non-zero if the file fd of the given size is worth compressing
+ */
+int compressible(int fd, off_t size) {
+    static const struct {
+        int off, len;
+        const char *magic;
+    } packed[] = {
+        { 0, 2, "\x1f\x8b" },                   // gzip
+        { 0, 4, "\x28\xb5\x2f\xfd" },           // zstd
+        { 0, 4, "PK\x03\x04" },                 // zip, and docx, jar etc.
+        { 0, 6, "\xfd" "7zXZ\0" },              // xz
+        { 0, 3, "BZh" },                        // bzip2
+        { 0, 6, "7z\xbc\xaf\x27\x1c" },         // 7-zip
+        { 0, 4, "Rar!" },
+        { 0, 4, "\x89PNG" },
+        { 0, 3, "\xff\xd8\xff" },               // jpeg
+        { 0, 4, "GIF8" },
+        { 0, 4, "RIFF" },                       // webp, avi, wav
+        { 0, 4, "OggS" },
+        { 0, 4, "fLaC" },
+        { 0, 3, "ID3" },                        // mp3
+        { 0, 4, "\x1a\x45\xdf\xa3" },           // matroska, webm
+        { 4, 4, "ftyp" },                       // mp4, mov, heic
+    };
+    unsigned char buf[SNIFFLEN];
+    ssize_t len;
+    if (size < COMPRESSMIN || size > COMPRESSMAX || (len = pread(fd, buf, sizeof(buf), 0)) <= 0) {
+        return 0;
+    }
+    for (size_t i=0;i<sizeof(packed)/sizeof(packed[0]);i++) {
+        if (len >= packed[i].off + packed[i].len && !memcmp(buf + packed[i].off, packed[i].magic, packed[i].len)) {
+            return 0;
+        }
+    }
+    // Compressed or encrypted data is close to 8 bits of entropy per byte; text is under 5
+    size_t counts[256] = { 0 };
+    double entropy = 0;
+    for (ssize_t i=0;i<len;i++) {
+        counts[buf[i]]++;
+    }
+    for (int i=0;i<256;i++) {
+        if (counts[i]) {
+            double p = (double)counts[i] / len;
+            entropy -= p * log2(p);
+        }
+    }
+    return entropy < SNIFFENTROPY;
+}
+
+typedef struct fileout {
+    int fd;
+    int err;
+} fileout_t;
+
+static void file_out(void *arg, const void *data, size_t len) {
+    fileout_t *f = arg;
+    for (size_t i=0;i<len && !f->err;) {
+        ssize_t l = write(f->fd, (const char *)data + i, len - i);
+        if (l > 0) {
+            i += l;
+        } else if (l < 0 && errno != EINTR) {
+            f->err = errno;
+        }
+    }
+}
+
+static void source_set(sourceattr_t *a, const struct stat *sb, const char *relpath) {
+    memset(a, 0, offsetof(sourceattr_t, path));
+    a->ino = sb->st_ino;
+    a->size = sb->st_size;
+    a->mtime = (int64_t)sb->st_mtim.tv_sec * 1000000000 + sb->st_mtim.tv_nsec;
+    a->ctime = (int64_t)sb->st_ctim.tv_sec * 1000000000 + sb->st_ctim.tv_nsec;
+    snprintf(a->path, sizeof(a->path), "%s", relpath);
+}
+
+/**
+ * Remove the compressed copies of relpath and of anything under it, after
+ * it's been deleted or moved. There are only as many copies as files that
+ * have been sent compressed, so they're read rather than every file under
+ * relpath. A copy that doesn't say what it's of is removed too
+ */
+void compressed_forget(context_t *ctx, const char *relpath) {
+    sourceattr_t a;
+    struct dirent *e;
+    size_t len = strlen(relpath);
+    char *cpath = statepath(ctx, "compressed", "x");
+    DIR *d = NULL;
+    if (cpath) {
+        *strrchr(cpath, '/') = 0;
+        d = opendir(cpath);
+        free(cpath);
+    }
+    while (d && (e=readdir(d))) {
+        const char *dot = strchr(e->d_name, '.');
+        if (e->d_name[0] == '.' || (dot && strchr(dot + 1, '.'))) {
+            continue;       // not a copy, or a copy being made
+        }
+        int fd = openat(dirfd(d), e->d_name, O_RDONLY|O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        ssize_t l = fgetxattr(fd, SOURCEATTR, &a, sizeof(a) - 1);
+        close(fd);
+        if (l > (ssize_t)offsetof(sourceattr_t, path)) {
+            ((char *)&a)[l] = 0;
+        }
+        if (l <= (ssize_t)offsetof(sourceattr_t, path) || (!strncmp(a.path, relpath, len) && (!a.path[len] || a.path[len] == '/'))) {
+            unlinkat(dirfd(d), e->d_name, 0);
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+}
+
+/**
+ * Return a descriptor on the file fd, whose path relative to the root is
+ * relpath, compressed with the given encoding - from the cache if it's
+ * there and current, otherwise compressed now and saved. Set *size to its
+ * length. Return -1 if it can't be done, to send the file as it is
+ */
+int compressed_file(context_t *ctx, int fd, const char *relpath, const struct stat *sb, int encoding, off_t *size) {
+    char id[24], buf[65536];
+    struct stat csb;
+    statehash(relpath, id);
+    strcat(id, encoding == ENC_GZIP ? ".gz" : ".zst");
+    char *cpath = statepath(ctx, "compressed", id);
+    if (!cpath) {
+        return -1;
+    }
+    sourceattr_t want, have;
+    source_set(&want, sb, relpath);
+    size_t wantlen = offsetof(sourceattr_t, path) + strlen(want.path) + 1;
+    int cfd = open(cpath, O_RDONLY|O_CLOEXEC);
+    if (cfd >= 0 && !fstat(cfd, &csb) && fgetxattr(cfd, SOURCEATTR, &have, sizeof(have)) == (ssize_t)wantlen && !memcmp(&have, &want, wantlen)) {
+        free(cpath);
+        *size = csb.st_size;
+        return cfd;
+    } else if (cfd >= 0) {
+        close(cfd);
+    }
+
+    char *tmp = malloc(strlen(cpath) + 8);
+    sprintf(tmp, "%s.XXXXXX", cpath);
+    fileout_t f = { mkstemp(tmp), 0 };
+    encoder_t *e = f.fd < 0 ? NULL : encoder_new(encoding, 1);
+    int err = !e;
+    off_t off = 0;
+    ssize_t l;
+    while (!err && !f.err && (l=pread(fd, buf, sizeof(buf), off)) > 0) {
+        off += l;
+        err = encoder_write(e, buf, l, ENC_CONTINUE, file_out, &f);
+    }
+    if (!err && !f.err) {
+        err = encoder_write(e, NULL, 0, ENC_END, file_out, &f);
+    }
+    encoder_free(e);
+    // Mark the copy with what it's a copy of, unless the file changed while we read it
+    if (err || f.err || off != sb->st_size || fstat(fd, &csb) || (source_set(&have, &csb, relpath), memcmp(&have, &want, wantlen)) || fstat(f.fd, &csb)) {
+        if (f.fd >= 0) {
+            logmsg(ctx, "compress \"%s\": %s", relpath, f.err ? strerror(f.err) : "failed");
+            unlink(tmp);
+            close(f.fd);
+        }
+        f.fd = -1;
+    } else {
+        if (fsetxattr(f.fd, SOURCEATTR, &want, wantlen, 0) || rename(tmp, cpath)) {
+            unlink(tmp);        // no extended attributes here: send it this once
+        }
+        logmsg(ctx, "compress \"%s\": %lu to %lu bytes with %s", relpath, (unsigned long)sb->st_size, (unsigned long)csb.st_size, encoding_name(encoding));
+        *size = csb.st_size;
+    }
+    free(tmp);
+    free(cpath);
+    return f.fd;
+}
@@ -0,0 +1,436 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#define DELETETHREADS 8         // workers removing a tree
+#define DELETEFLUSH 200         // ms between flushes of the path list with "stream=1"
+
+/*
+ * Delete is done in two passes, so nothing is removed unless everything can
+ * be. The first checks the whole tree: every directory must be readable and
+ * writable, every file too, and no directory may contain a dotfile (they're
+ * hidden from the user, so the directory appears empty when it isn't). The
+ * second removes it, with a pool of workers (pool.c) that each take a directory from
+ * a queue, unlink its files and queue its subdirectories. A directory is
+ * removed when the last of its subdirectories is, so the queue and the
+ * directories waiting on it are the only memory used - nothing is held for
+ * each file.
+ *
+ * Everything is relative to a descriptor on the root, and symlinks are
+ * removed rather than followed.
+ */
+
+typedef struct deldir {
+    pooljob_t job;
+    struct deldir *parent;
+    int pending;            // subdirectories not yet removed, plus one until it's been read
+    char path[];            // relative to the root
+} deldir_t;
+
+typedef struct delstate {
+    context_t *ctx;
+    jsonw_t *w;
+    int rootfd;
+    int stream;
+    pool_t pool;            // whose lock guards everything below, and writing to w
+    int failed;
+    char *error;            // the first failure
+    size_t files, dirs;
+    struct timespec flushed;
+} delstate_t;
+
+/**
+ * A growable buffer for building paths
+ */
+typedef struct pathbuf {
+    char *s;
+    size_t len, size;
+} pathbuf_t;
+
+/**
+ * Set p to its first len bytes, followed by "/name" unless name is empty
+ */
+static void path_set(pathbuf_t *p, size_t len, const char *name) {
+    size_t n = strlen(name);
+    if (len + n + 2 > p->size) {
+        p->size = (len + n + 2) * 2;
+        p->s = realloc(p->s, p->size);
+    }
+    if (n) {
+        if (len) {
+            p->s[len++] = '/';
+        }
+        memcpy(p->s + len, name, n + 1);
+        p->len = len + n;
+    } else {
+        p->s[p->len = len] = 0;
+    }
+}
+
+/**
+ * Check everything under "name" can be deleted. Return zero if so, or send
+ * an error and return -1. The walk is iterative, with one open directory for
+ * each level, so only the depth of the tree matters
+ */
+static int delete_verify(context_t *ctx, int rootfd, const char *name) {
+    struct stat sb;
+    DIR **stack = NULL;
+    size_t *lens = NULL, depth = 0, size = 0;
+    pathbuf_t p = { NULL, 0, 0 };
+    int ret = 0;
+
+    path_set(&p, 0, name);
+    if (fstatat(rootfd, name, &sb, AT_SYMLINK_NOFOLLOW)) {
+        logmsg(ctx, "delete stat \"%s\": %s", name, strerror(errno));
+        send_msg(ctx, errno == ENOENT ? 404 : 500, "delete stat \"%s\": %s", name, strerror(errno));
+        ret = -1;
+    } else if (!S_ISDIR(sb.st_mode) && !S_ISLNK(sb.st_mode) && faccessat(rootfd, name, R_OK|W_OK, 0)) {
+        logmsg(ctx, "delete access file \"%s\": not writable", name);
+        send_msg(ctx, 400, "delete not writable \"%s\"", name);
+        ret = -1;
+    }
+    if (ret || !S_ISDIR(sb.st_mode)) {
+        free(p.s);
+        return ret;
+    }
+
+    int fd = -1;
+    DIR *dir = NULL;
+    if (faccessat(rootfd, name, R_OK|W_OK|X_OK, 0)) {
+        logmsg(ctx, "delete access dir \"%s\": not writable", name);
+        send_msg(ctx, 403, "delete not writable \"%s\"", name);
+        ret = -1;
+    } else if ((fd = openat(rootfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) < 0 || !(dir = fdopendir(fd))) {
+        logmsg(ctx, "opendir \"%s\": %s", name, strerror(errno));
+        send_msg(ctx, 500, "opendir \"%s\": %s", name, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        ret = -1;
+    }
+    if (dir) {
+        size = 16;
+        stack = malloc(size * sizeof(DIR *));
+        lens = malloc(size * sizeof(size_t));
+        stack[0] = dir;
+        lens[0] = p.len;
+        depth = 1;
+    }
+    while (depth > 0 && !ret) {
+        DIR *top = stack[depth - 1];
+        struct dirent *dp = readdir(top);
+        if (!dp) {
+            closedir(top);
+            depth--;
+            continue;
+        } else if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) {
+            continue;
+        }
+        path_set(&p, lens[depth - 1], "");
+        if (dp->d_name[0] == '.') {
+            send_msg(ctx, 400, "directory not empty \"%s\"", p.s);
+            ret = -1;
+            break;
+        }
+        path_set(&p, lens[depth - 1], dp->d_name);
+        int dfd = dirfd(top);
+        int type = dp->d_type;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(dfd, dp->d_name, &sb, AT_SYMLINK_NOFOLLOW)) {
+                logmsg(ctx, "delete stat \"%s\": %s", p.s, strerror(errno));
+                send_msg(ctx, 500, "delete stat \"%s\": %s", p.s, strerror(errno));
+                ret = -1;
+                break;
+            }
+            type = S_ISDIR(sb.st_mode) ? DT_DIR : S_ISLNK(sb.st_mode) ? DT_LNK : DT_REG;
+        }
+        if (type == DT_DIR) {
+            if (faccessat(dfd, dp->d_name, R_OK|W_OK|X_OK, 0)) {
+                logmsg(ctx, "delete access dir \"%s\": not writable", p.s);
+                send_msg(ctx, 403, "delete not writable \"%s\"", p.s);
+                ret = -1;
+            } else if ((fd = openat(dfd, dp->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) < 0 || !(dir = fdopendir(fd))) {
+                logmsg(ctx, "opendir \"%s\": %s", p.s, strerror(errno));
+                send_msg(ctx, 500, "opendir \"%s\": %s", p.s, strerror(errno));
+                if (fd >= 0) {
+                    close(fd);
+                }
+                ret = -1;
+            } else {
+                if (depth == size) {
+                    size *= 2;
+                    stack = realloc(stack, size * sizeof(DIR *));
+                    lens = realloc(lens, size * sizeof(size_t));
+                }
+                stack[depth] = dir;
+                lens[depth++] = p.len;
+            }
+        } else if (type != DT_LNK && faccessat(dfd, dp->d_name, R_OK|W_OK, 0)) {
+            logmsg(ctx, "delete access file \"%s\": not writable", p.s);
+            send_msg(ctx, 400, "delete not writable \"%s\"", p.s);
+            ret = -1;
+        }
+    }
+    while (depth > 0) {
+        closedir(stack[--depth]);
+    }
+    free(stack);
+    free(lens);
+    free(p.s);
+    return ret;
+}
+
+static void delete_fail(delstate_t *st, const char *op, const char *path, int err) {
+    logmsg(st->ctx, "%s \"%s\": %s", op, path, strerror(err));
+    if (!st->error && asprintf(&st->error, "%s \"%s\": %s", op, path, strerror(err)) < 0) {
+        st->error = NULL;
+    }
+    st->failed = 1;
+}
+
+/**
+ * Add a removed path to the response. Called with the lock held
+ */
+static void delete_report(delstate_t *st, const char *path, int isdir) {
+    if (isdir) {
+        char *s = malloc(strlen(path) + 2);
+        sprintf(s, "%s/", path);
+        jw_string(st->w, s);
+        free(s);
+        st->dirs++;
+    } else {
+        jw_string(st->w, path);
+        st->files++;
+    }
+    if (st->stream) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - st->flushed.tv_sec) * 1000 + (now.tv_nsec - st->flushed.tv_nsec) / 1000000 >= DELETEFLUSH) {
+            jw_flush(st->w);
+            st->flushed = now;
+        }
+    }
+}
+
+static deldir_t *deldir_new(deldir_t *parent, const char *name) {
+    size_t len = parent ? strlen(parent->path) + 1 : 0;
+    deldir_t *d = malloc(sizeof(deldir_t) + len + strlen(name) + 1);
+    d->parent = parent;
+    d->pending = 1;
+    if (parent) {
+        sprintf(d->path, "%s/%s", parent->path, name);
+    } else {
+        strcpy(d->path, name);
+    }
+    return d;
+}
+
+/**
+ * Mark d as read, or one of its subdirectories as removed, and remove it
+ * and then its parents if that was the last thing they were waiting on.
+ * Called with the lock held. After a failure nothing more is removed, but
+ * the directories are still freed
+ */
+static void delete_finish(void *arg, pooljob_t *job) {
+    delstate_t *st = arg;
+    deldir_t *d = (deldir_t *)job;
+    while (d && --d->pending == 0) {
+        deldir_t *parent = d->parent;
+        if (!st->failed) {
+            pthread_mutex_unlock(&st->pool.lock);
+            int r = unlinkat(st->rootfd, d->path, AT_REMOVEDIR);
+            int err = errno;
+            pthread_mutex_lock(&st->pool.lock);
+            if (r) {
+                delete_fail(st, "rmdir", d->path, err);
+            } else {
+                index_forget(st->ctx, d->path);
+                delete_report(st, d->path, 1);
+            }
+        }
+        free(d);
+        d = parent;
+    }
+}
+
+/**
+ * Unlink the files in d and queue its subdirectories
+ */
+static void delete_dir(void *arg, pooljob_t *job) {
+    delstate_t *st = arg;
+    deldir_t *d = (deldir_t *)job;
+    struct stat sb;
+    struct dirent *dp;
+    pathbuf_t p = { NULL, 0, 0 };
+    size_t len = strlen(d->path);
+    if (st->failed) {
+        return;
+    }
+    int fd = openat(st->rootfd, d->path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) {
+        int err = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        pthread_mutex_lock(&st->pool.lock);
+        delete_fail(st, "opendir", d->path, err);
+        pthread_mutex_unlock(&st->pool.lock);
+        return;
+    }
+    path_set(&p, 0, d->path);
+    while (!st->failed && (dp = readdir(dir))) {
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) {
+            continue;
+        }
+        int isdir = dp->d_type == DT_DIR;
+        if (dp->d_type == DT_UNKNOWN && !fstatat(dirfd(dir), dp->d_name, &sb, AT_SYMLINK_NOFOLLOW)) {
+            isdir = S_ISDIR(sb.st_mode);
+        }
+        if (isdir) {
+            deldir_t *kid = deldir_new(d, dp->d_name);
+            pthread_mutex_lock(&st->pool.lock);
+            d->pending++;
+            pool_add(&st->pool, &kid->job);
+            pthread_mutex_unlock(&st->pool.lock);
+        } else {
+            path_set(&p, len, dp->d_name);
+            int r = unlinkat(dirfd(dir), dp->d_name, 0);
+            int err = errno;
+            pthread_mutex_lock(&st->pool.lock);
+            if (r) {
+                delete_fail(st, "unlink", p.s, err);
+            } else {
+                delete_report(st, p.s, 0);
+            }
+            pthread_mutex_unlock(&st->pool.lock);
+        }
+    }
+    closedir(dir);
+    free(p.s);
+}
+
+/**
+ * Remove "name", which has been verified, and everything under it
+ */
+static void delete_tree(delstate_t *st, const char *name) {
+    struct stat sb, before;
+    char *path = arena_printf(st->ctx, "%s/%s", st->ctx->root, name);
+    index_before(path, &before);
+    if (fstatat(st->rootfd, name, &sb, AT_SYMLINK_NOFOLLOW)) {
+        delete_fail(st, "stat", name, errno);
+    } else if (!S_ISDIR(sb.st_mode)) {
+        if (unlinkat(st->rootfd, name, 0)) {
+            delete_fail(st, "unlink", name, errno);
+        } else {
+            delete_report(st, name, 0);
+        }
+    } else {
+        pthread_mutex_unlock(&st->pool.lock);
+        pool_run(&st->pool, &deldir_new(NULL, name)->job, DELETETHREADS);
+        pthread_mutex_lock(&st->pool.lock);
+    }
+    index_update(st->ctx, path, &before);
+    compressed_forget(st->ctx, name);
+}
+
+/**
+ * Delete each "path" and everything under it, replying with the list of
+ * paths removed, directories ending in "/". With "stream=1" the list is
+ * flushed as it grows, so the client can show progress
+ */
+void delete(context_t *ctx) {
+    const char **names = calloc(1, sizeof(char *));
+    size_t count = 0;
+    int stream = 0, failed = 0;
+    int rootfd = open(*ctx->root ? ctx->root : "/", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+    if (rootfd < 0) {
+        logmsg(ctx, "delete open \"%s\": %s", ctx->root, strerror(errno));
+        send_msg(ctx, 500, "delete: %s", strerror(errno));
+        free(names);
+        return;
+    }
+    for (char **q=ctx->query;*q;) {
+        char *qkey = *q++;
+        char *qval = *q++;
+        if (!strcmp(qkey, "stream")) {
+            stream = !strcmp(qval, "1") || !strcmp(qval, "true");
+        } else if (!strcmp(qkey, "path")) {
+            const char *name = qval;
+            if (name[0] == '/') {
+                name++;
+            }
+            if (name[0] == 0 || name[0] == '.' || strstr(name, "/.")) {
+                send_msg(ctx, 400, "invalid path \"%s\"", name);
+                failed = 1;
+                break;
+            } else if (delete_verify(ctx, rootfd, name)) {
+                failed = 1;
+                break;      // error already sent
+            }
+            names = realloc(names, (count + 2) * sizeof(char *));
+            names[count++] = name;
+        }
+    }
+    if (failed) {
+        // error already sent
+    } else if (!count) {
+        send_msg(ctx, 400, "missing path");
+    } else {
+        jsonw_t w;
+        delstate_t st;
+        memset(&st, 0, sizeof(st));
+        st.ctx = ctx;
+        st.w = &w;
+        st.rootfd = rootfd;
+        st.stream = stream;
+        pool_init(&st.pool, delete_dir, delete_finish, &st);
+        jw_start(&w, ctx, 200);
+        jw_object(&w);
+        jw_key(&w, "paths");
+        jw_array(&w);
+        if (stream) {
+            jw_flush(&w);
+            clock_gettime(CLOCK_MONOTONIC, &st.flushed);
+        }
+        pthread_mutex_lock(&st.pool.lock);
+        for (size_t i=0;i<count && !st.failed;i++) {
+            delete_tree(&st, names[i]);
+        }
+        pthread_mutex_unlock(&st.pool.lock);
+        if (!st.failed) {
+            jw_array_end(&w);
+            jw_key(&w, "ok");
+            jw_boolean(&w, 1);
+            jw_object_end(&w);
+            logmsg(ctx, "tx 200 delete: %lu files and %lu directories in %lu bytes", (unsigned long)st.files, (unsigned long)st.dirs, (unsigned long)jw_end(&w));
+        } else if (jw_discard(&w)) {
+            send_msg(ctx, 500, "%s", st.error ? st.error : "delete failed");
+        } else {
+            // Some of the list has gone, so the error goes at the end
+            jw_array_end(&w);
+            jw_key(&w, "ok");
+            jw_boolean(&w, 0);
+            if (st.error) {
+                jw_key(&w, "msg");
+                jw_string(&w, st.error);
+            }
+            jw_object_end(&w);
+            jw_end(&w);
+        }
+        free(st.error);
+        pool_destroy(&st.pool);
+    }
+    free(names);
+    close(rootfd);
+}
@@ -1,14 +1,19 @@
-#include <jansson.h>
+#define _GNU_SOURCE
+#include "filemanager.h"
 #include <unistd.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <syslog.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/sendfile.h>
 
 #ifndef ROOT
 #define ROOT ""
@@ -21,51 +26,25 @@
 #define SIZE_MAX ((size_t)(-1))
 #endif
 
-#define INITBUF 500
+#define STATEDIR ".filemanager"     // hidden directory under the root for our own files
+#define COPYCHUNK (1<<30)       // maximum bytes per sendfile() or splice() call
+#define COPYPIPE (1<<20)        // pipe size when splicing from a socket
+#define READAHEAD (2<<20)       // bytes to ask the kernel to read ahead when sending a file
+#define MAXRANGES 64            // maximum ranges in a "Range" header before we ignore it
+#define INFOBODY (64<<20)       // largest request body for "info"
 
-typedef struct strlist {
-    char *value;
-    struct strlist *next;
-} strlist_t;
-
-typedef struct context {
-    char *root;
-    char *log;
-    char **query;
-} context_t;
-
-void logmsg(context_t *ctx, char *fmt, ...) {
-    if (ctx->log) {
-        char *buf = malloc(INITBUF);
-        va_list va;
-        va_start(va, fmt);
-        int len = vsnprintf(buf, INITBUF - 2, fmt, va);
-        va_end(va);
-        if (len >= INITBUF - 2) {
-            free(buf);
-            buf = malloc(len + 5);
-            va_start(va, fmt);
-            len = vsnprintf(buf, len + 5, fmt, va);
-            va_end(va);
-        }
-        if (!strcmp(ctx->log, "syslog")) {
-            buf[len++] = 0;
-            syslog(LOG_USER|LOG_INFO, "%s", buf);
-        } else {
-            buf[len++] = '\n';
-            buf[len++] = 0;
-            int fd = open(ctx->log, O_CREAT|O_WRONLY|O_APPEND, 0666);
-            write(fd, buf, strlen(buf));
-            close(fd);
-        }
-    }
-}
+extern char **environ;
 
 void help(context_t *ctx) {
     printf("\nUsage: \"filemanager\" runs as a cgi-script.\n");
-    printf("No REQUEST_METHOD environment variable detected, so this is not a CGI environment\n\n");
+    printf("No REQUEST_METHOD environment variable detected and no --listen, so this is not a CGI environment\n\n");
     printf("  --root <dir>           specify the root directory for files. Must be writable\n");
     printf("  --log <file|\"syslog\">  specify file to write log messages to, or syslog. optional\n");
+    printf("  --loglevel <level>     log messages at \"error\", \"warning\", \"info\" or \"debug\" and above. Default is info\n");
+    printf("  --listen <[addr:]port> run as a standalone HTTP/1.1 server instead of a CGI\n");
+    printf("  --threads <n>          number of worker threads for --listen. Default is 16 per CPU, at least 64\n");
+    printf("  --io <sync|uring>      move file data with blocking calls or io_uring. Default is sync\n");
+    printf("  --method <method>      (for non-CGI debugging) specify the REQUEST_METHOD variable\n");
     printf("  --path <dir>           (for non-CGI debugging) specify the PATH_INFO variable\n");
     printf("  --query <dir>          (for non-CGI debugging) specify the QUERY_STRING variable\n");
     printf("Also override root directory and log-file with ROOT and LOG environments variable\n");
@@ -74,263 +53,1493 @@ void help(context_t *ctx) {
     } else {
         printf("  Default root directory: unspecified\n");
     }
-    if (ctx->log) {
-        printf("  Default logfile: \"%s\"\n", ctx->log);
-    } else {
-        printf("  Default logfile: unspecified\n");
+    if (ctx->log) {
+        printf("  Default logfile: \"%s\"\n", ctx->log);
+    } else {
+        printf("  Default logfile: unspecified\n");
+    }
+    printf("\n");
+    exit(0);
+}
+
+static int hexval(int c) {
+    return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+/**
+ * URL-decode the string from s to e in place and terminate it
+ */
+static char *urldecode(char *s, char *e) {
+    char *out = s;
+    for (char *in=s;in<e;in++) {
+        if (*in == '+') {
+            *out++ = ' ';
+        } else if (*in == '%' && in + 2 < e && hexval(in[1]) >= 0 && hexval(in[2]) >= 0) {
+            *out++ = (hexval(in[1]) << 4) | hexval(in[2]);
+            in += 2;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = 0;
+    return s;
+}
+
+/**
+ * Given a query string, return an array of strings [key,value,key,value,...,0].
+ * The string is decoded in place, so the keys and values point into it, and
+ * the array is in the request's arena
+ */
+char **parse_querystring(context_t *ctx, char *s) {
+    int count = 0;
+    for (char *c=s;c && *c;c++) {
+        count += *c == '&';
+    }
+    char **out = arena_alloc(ctx, sizeof(char *) * (count * 2 + 3)), **z = out;
+    while (s && *s) {
+        char *e = strchr(s, '&'), *eq;
+        if (!e) {
+            e = s + strlen(s);
+        }
+        char *next = *e ? e + 1 : e;
+        if (e > s) {
+            if (!(eq = memchr(s, '=', e - s))) {
+                *z++ = urldecode(s, e);
+                *z = arena_alloc(ctx, 1);  // no value, so it's empty
+                **z++ = 0;
+            } else {
+                *z++ = urldecode(s, eq);
+                *z++ = urldecode(eq + 1, e);
+            }
+        }
+        s = next;
+    }
+    *z = NULL;
+    return out;
+}
+
+/**
+ * Return the path of "name" in the "sub" directory of our state directory
+ * under the root, creating the directories if required. The state directory
+ * begins with "." so it can't be reached by any command. The return value
+ * should be freed, or is NULL if the directories can't be created
+ */
+char *statepath(context_t *ctx, const char *sub, const char *name) {
+    char *path = malloc(strlen(ctx->root) + strlen(STATEDIR) + strlen(sub) + strlen(name) + 4);
+    sprintf(path, "%s/%s/%s/%s", ctx->root, STATEDIR, sub, name);
+    char *c = strrchr(path, '/');
+    *c = 0;
+    if (access(path, F_OK)) {
+        mkparents(path);
+        if (mkdir(path, 0700) && errno != EEXIST) {
+            free(path);
+            return NULL;
+        }
+    }
+    *c = '/';
+    return path;
+}
+
+/**
+ * Set id to a name for a path in the state directory - a 16 digit hex
+ * FNV-1a hash of it
+ */
+void statehash(const char *name, char *id) {
+    sprintf(id, "%016llx", (unsigned long long)fnv1a(FNVINIT, name, strlen(name)));
+}
+
+/**
+ * Add len bytes to the FNV-1a hash h, which starts as FNVINIT
+ */
+uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    for (const unsigned char *c=data;len--;c++) {
+        h = (h ^ *c) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * Create every missing parent directory of path
+ */
+void mkparents(char *path) {
+    for (char *c=path;*c;c++) {
+        if (*c == '/' && c != path) {
+            *c = 0;
+            mkdir(path, 0777);
+            *c = '/';
+        }
+    }
+}
+
+/**
+ * Collect the request headers from a CGI environment, returning an array
+ * of [name,value,name,value,...,0] with names as they'd appear in HTTP
+ * but in lower case: HTTP_IF_NONE_MATCH becomes "if-none-match". The
+ * array and the names are in the request's arena, the values belong to environ
+ */
+static char **parse_environ(context_t *ctx) {
+    int count = 0;
+    for (char **e=environ;*e;e++) {
+        count++;
+    }
+    char **out = arena_alloc(ctx, sizeof(char *) * (count * 2 + 1));
+    char **z = out;
+    for (char **e=environ;*e;e++) {
+        char *eq = strchr(*e, '=');
+        char *name = NULL;
+        if (!eq) {
+            continue;
+        } else if (!strncmp(*e, "HTTP_", 5)) {
+            name = arena_strndup(ctx, *e + 5, eq - *e - 5);
+        } else if (!strncmp(*e, "CONTENT_LENGTH=", 15) || !strncmp(*e, "CONTENT_TYPE=", 13)) {
+            name = arena_strndup(ctx, *e, eq - *e);
+        }
+        if (name) {
+            for (char *c=name;*c;c++) {
+                *c = *c == '_' ? '-' : tolower(*c);
+            }
+            *z++ = name;
+            *z++ = eq + 1;
+        }
+    }
+    *z = NULL;
+    return out;
+}
+
+/**
+ * Return the value of the named request header, or NULL if not set.
+ * The name must be in lower case
+ */
+char *getheader(context_t *ctx, const char *name) {
+    if (ctx->headers) {
+        for (char **h=ctx->headers;*h;h+=2) {
+            if (!strcmp(*h, name)) {
+                return h[1];
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Read up to len bytes of the request body, returning the number of bytes
+ * read, 0 at the end of the body or -1 on error. Any body bytes that were
+ * read along with the headers are returned first.
+ */
+ssize_t read_body(context_t *ctx, void *buf, size_t len) {
+    if (len > ctx->inlen) {
+        len = ctx->inlen;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    ssize_t l;
+    if (ctx->inbuflen) {
+        l = len < ctx->inbuflen ? len : ctx->inbuflen;
+        memcpy(buf, ctx->inbuf, l);
+        ctx->inbuf += l;
+        ctx->inbuflen -= l;
+    } else {
+        do {
+            l = read(ctx->infd, buf, len);
+        } while (l < 0 && errno == EINTR);
+    }
+    if (l > 0 && ctx->inlen != SIZE_MAX) {
+        ctx->inlen -= l;
+    }
+    return l;
+}
+
+/**
+ * Read the whole request body into the request's arena, terminated, and
+ * set *len to its length. Return NULL if it's over max bytes. A chunked
+ * body's space is doubled as it arrives
+ */
+char *read_body_all(context_t *ctx, size_t max, size_t *len) {
+    if (ctx->inlen != SIZE_MAX && ctx->inlen > max) {
+        return NULL;
+    }
+    size_t size = ctx->inlen == SIZE_MAX ? 65536 : ctx->inlen, n = 0;
+    char *s = arena_alloc(ctx, size + 1);
+    for (ssize_t l=1;l > 0;) {
+        if (n == size) {
+            if (ctx->inlen != SIZE_MAX || size > max) {
+                break;
+            }
+            size = size * 2 < max + 1 ? size * 2 : max + 1;
+            s = memcpy(arena_alloc(ctx, size + 1), s, n);
+        }
+        if ((l=read_body(ctx, s + n, size - n)) > 0) {
+            n += l;
+        }
+    }
+    if (n > max) {
+        return NULL;
+    }
+    s[n] = 0;
+    *len = n;
+    return s;
+}
+
+static const char *reason(int code) {
+    switch (code) {
+        case 200: return "OK";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 409: return "Conflict";
+        case 411: return "Length Required";
+        case 413: return "Payload Too Large";
+        case 416: return "Range Not Satisfiable";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 505: return "HTTP Version Not Supported";
+        case 507: return "Insufficient Storage";
+        default:  return "Unknown";
+    }
+}
+
+/**
+ * Write the first line of the response - a "Status" header for a CGI, or
+ * the status line for HTTP. The caller writes the remaining headers
+ */
+void send_status(context_t *ctx, int code) {
+    ctx->status = code;
+    if (ctx->http) {
+        fprintf(ctx->out, "HTTP/1.1 %d %s\r\n", code, reason(code));
+        if (!ctx->keepalive) {
+            fputs("Connection: close\r\n", ctx->out);
+        }
+    } else {
+        fprintf(ctx->out, "Status: %d\r\n", code);
+    }
+}
+
+void send_json(context_t *ctx, int code, json_t *json) {
+    if (json) {
+        jsonw_t w;
+        jw_start(&w, ctx, code);
+        jw_value(&w, json);
+        logmsg(ctx, "tx %d %lu bytes", code, (unsigned long)jw_end(&w));
+    } else {
+        logmsg(ctx, "tx %d", code);
+        send_status(ctx, code);
+        fputs("Content-Length: 0\r\n\r\n", ctx->out);
+    }
+}
+
+void send_msg(context_t *ctx, int code, char *fmt, ...) {
+    jsonw_t w;
+    char *buf = NULL;
+    jw_start(&w, ctx, code);
+    jw_object(&w);
+    jw_key(&w, "ok");
+    jw_boolean(&w, code >= 200 && code < 300);
+    if (fmt) {
+        va_list va;
+        va_start(va, fmt);
+        buf = arena_vprintf(ctx, fmt, va);
+        va_end(va);
+        if (buf) {
+            jw_key(&w, "msg");
+            jw_string(&w, buf);
+        }
+    }
+    jw_object_end(&w);
+    jw_end(&w);
+    logat(ctx, code >= 500 ? LOG_ERR : code >= 400 ? LOG_WARNING : LOG_INFO, "tx %d %s", code, buf ? buf : "");
+}
+
+/**
+ * Format t as an HTTP date
+ */
+static void httpdate(time_t t, char *buf, size_t len) {
+    struct tm tm;
+    strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&t, &tm));
+}
+
+static int parse_httpdate(const char *s, time_t *t) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *e = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!e || *e) {
+        return -1;
+    }
+    *t = timegm(&tm);
+    return 0;
+}
+
+/**
+ * Write the headers that let a response be cached and revalidated to buf:
+ * the ETag, Last-Modified unless mtime is zero, and Cache-Control. Caches
+ * may keep the response, but must check it's still current before using it
+ */
+static void cache_headers(char *buf, size_t len, const char *etag, time_t mtime) {
+    char date[40] = "";
+    if (mtime) {
+        httpdate(mtime, date, sizeof(date));
+        snprintf(buf, len, "ETag: %s\r\nLast-Modified: %s\r\nCache-Control: no-cache\r\n", etag, date);
+    } else {
+        snprintf(buf, len, "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+    }
+}
+
+/**
+ * Return non-zero if the client's copy of the response, which has this
+ * etag and mtime, is current: its tag is in If-None-Match, or failing that
+ * it's dated no earlier than mtime by If-Modified-Since. An mtime of zero
+ * means the date can't be relied on
+ */
+static int not_modified(context_t *ctx, const char *etag, time_t mtime) {
+    char *inm = getheader(ctx, "if-none-match");
+    char *ims = getheader(ctx, "if-modified-since");
+    time_t t;
+    if (inm) {
+        // A list of tags, compared ignoring any "W/" (weak) prefix
+        size_t len = strlen(etag);
+        for (const char *c=inm;*c;) {
+            while (*c == ' ' || *c == ',') {
+                c++;
+            }
+            if (*c == '*') {
+                return 1;
+            } else if (!strncmp(c, "W/", 2)) {
+                c += 2;
+            }
+            if (!strncmp(c, etag, len) && (c[len] == 0 || c[len] == ',' || c[len] == ' ')) {
+                return 1;
+            }
+            while (*c && *c != ',') {
+                c++;
+            }
+        }
+        return 0;
+    }
+    return ims && mtime && !parse_httpdate(ims, &t) && mtime <= t;
+}
+
+static void send_not_modified(context_t *ctx, const char *headers) {
+    logmsg(ctx, "tx 304");
+    send_status(ctx, 304);
+    fputs(headers, ctx->out);
+    fputs("\r\n", ctx->out);
+}
+
+/**
+ * Return non-zero if a Range request should be honoured: there's no
+ * If-Range, or it names the current version of the file
+ */
+static int if_range(context_t *ctx, const char *etag, time_t mtime) {
+    char *v = getheader(ctx, "if-range");
+    time_t t;
+    if (!v) {
+        return 1;
+    } else if (*v == '"') {
+        return !strcmp(v, etag);
+    } else {
+        return !parse_httpdate(v, &t) && t == mtime;
+    }
+}
+
+/**
+ * Return non-zero if we have "mode" access (a mask of R_OK, W_OK and X_OK)
+ * to a file, judged from its stat alone rather than calling access() for
+ * every directory entry. Like access() this uses the real user and group.
+ * ACLs are not considered
+ */
+int canaccess(struct stat *sb, int mode) {
+    static uid_t uid = (uid_t)-1;
+    static gid_t gid, groups[NGROUPS_MAX];
+    static int ngroups;
+    if (uid == (uid_t)-1) {
+        gid = getgid();
+        ngroups = getgroups(NGROUPS_MAX, groups);
+        uid = getuid();
+    }
+    if (uid == 0) {
+        return !(mode & X_OK) || S_ISDIR(sb->st_mode) || (sb->st_mode & (S_IXUSR|S_IXGRP|S_IXOTH));
+    }
+    int shift = 0;      // bits for "other"
+    if (sb->st_uid == uid) {
+        shift = 6;
+    } else if (sb->st_gid == gid) {
+        shift = 3;
+    } else {
+        for (int i=0;i<ngroups;i++) {
+            if (sb->st_gid == groups[i]) {
+                shift = 3;
+                break;
+            }
+        }
+    }
+    return ((sb->st_mode >> shift) & mode) == mode;
+}
+
+/**
+ * Stat the entry dp of the open directory dfd. Return non-zero if it's a
+ * file or directory we can read, which is all we list. Other types are
+ * skipped on their d_type without calling stat(); symlinks are followed
+ */
+int kidstat(int dfd, struct dirent *dp, struct stat *sb) {
+    if (dp->d_type != DT_UNKNOWN && dp->d_type != DT_REG && dp->d_type != DT_DIR && dp->d_type != DT_LNK) {
+        return 0;
+    } else if (fstatat(dfd, dp->d_name, sb, 0)) {
+        return 0;
+    } else if (S_ISDIR(sb->st_mode)) {
+        return canaccess(sb, R_OK|X_OK);
+    } else {
+        return S_ISREG(sb->st_mode) && canaccess(sb, R_OK);
+    }
+}
+
+/**
+ * Write the details of a file or directory, with "key" set to value - the
+ * path for a requested path, the name for a child. The object is left open
+ * so more can be added to it
+ */
+void stat_write(jsonw_t *w, const char *key, const char *value, struct stat *sb, int readonly) {
+    jw_object(w);
+    jw_key(w, key);
+    jw_string(w, value);
+    jw_key(w, "type");
+    jw_string(w, S_ISDIR(sb->st_mode) ? "dir" : "file");
+    if (readonly) {
+        jw_key(w, "readonly");
+        jw_boolean(w, 1);
+    }
+    jw_key(w, "ctime");
+    jw_integer(w, (long long)sb->st_ctime);
+    jw_key(w, "mtime");
+    jw_integer(w, (long long)sb->st_mtime);
+    if (!S_ISDIR(sb->st_mode)) {
+        jw_key(w, "length");
+        jw_integer(w, (long long)sb->st_size);
+    }
+}
+
+/**
+ * How info lists a directory
+ */
+typedef struct listopts {
+    int detail;         // kids are objects rather than names
+    int sort;           // 0 for directory order, or 'n', 'm' or 's' for name, mtime or size
+    int reverse;        // sort descending
+    int hash;           // requested files have their content "hash"
+    size_t limit;       // maximum number of kids, or SIZE_MAX
+    char *cursor;       // return kids after this one, or NULL
+} listopts_t;
+
+typedef struct kid {
+    char *name;
+    struct stat sb;
+} kid_t;
+
+static void kid_write(jsonw_t *w, listopts_t *opts, const char *name, struct stat *sb) {
+    if (opts->detail) {
+        stat_write(w, "name", name, sb, !canaccess(sb, W_OK));
+        jw_object_end(w);
+    } else {
+        jw_string(w, name);
+    }
+}
+
+/**
+ * Compare two kids in the sort order in opts
+ */
+static int kid_compare(const void *va, const void *vb, void *vopts) {
+    const kid_t *a = va, *b = vb;
+    listopts_t *opts = vopts;
+    int d = 0;
+    if (opts->sort == 'm') {
+        d = a->sb.st_mtime < b->sb.st_mtime ? -1 : a->sb.st_mtime > b->sb.st_mtime ? 1 : 0;
+    } else if (opts->sort == 's') {
+        d = a->sb.st_size < b->sb.st_size ? -1 : a->sb.st_size > b->sb.st_size ? 1 : 0;
+    }
+    if (d == 0) {
+        d = strcmp(a->name, b->name);
+    }
+    return opts->reverse ? -d : d;
+}
+
+/**
+ * Move kid i of the heap up to its place. The heap has the kid that
+ * sorts last at the top, so it can be replaced by one that sorts earlier
+ */
+static void heap_up(kid_t *heap, size_t i, listopts_t *opts) {
+    while (i > 0 && kid_compare(&heap[(i - 1) / 2], &heap[i], opts) < 0) {
+        kid_t t = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[i = (i - 1) / 2] = t;
+    }
+}
+
+/**
+ * Move the top kid of the heap of n kids down to its place
+ */
+static void heap_down(kid_t *heap, size_t n, listopts_t *opts) {
+    for (size_t i=0;;) {
+        size_t m = i, l = i * 2 + 1, r = l + 1;
+        if (l < n && kid_compare(&heap[l], &heap[m], opts) > 0) {
+            m = l;
+        }
+        if (r < n && kid_compare(&heap[r], &heap[m], opts) > 0) {
+            m = r;
+        }
+        if (m == i) {
+            break;
+        }
+        kid_t t = heap[i];
+        heap[i] = heap[m];
+        heap[i = m] = t;
+    }
+}
+
+/**
+ * Where the kids of a directory are read from: its index, if there's a valid
+ * one, otherwise the directory itself
+ */
+typedef struct kidsrc {
+    DIR *dir;
+    dirindex_t *index;
+    size_t pos;         // in the index
+    long here;          // position of the kid last returned, for a cursor
+} kidsrc_t;
+
+/**
+ * Return the name of the next kid we can list, with its stat in sb, or NULL
+ */
+static const char *kid_next(kidsrc_t *src, struct stat *sb) {
+    const char *name;
+    if (src->index) {
+        while ((src->here = index_next(src->index, &src->pos, &name, sb))) {
+            if (canaccess(sb, S_ISDIR(sb->st_mode) ? R_OK|X_OK : R_OK)) {
+                return name;
+            }
+        }
+        return NULL;
+    }
+    for (;;) {
+        struct dirent *dp;
+        src->here = telldir(src->dir);
+        if (!(dp = readdir(src->dir))) {
+            return NULL;
+        } else if (dp->d_name[0] != '.' && kidstat(dirfd(src->dir), dp, sb)) {
+            return dp->d_name;
+        }
+    }
+}
+
+/**
+ * Write the kids from src as opts describes. Return the cursor for the
+ * next page, in the request's arena, or NULL if this is the last.
+ *
+ * In directory order, the cursor is the position of the next kid: its
+ * telldir() position, or "i<generation>.<offset>" in the index. Sorted,
+ * it's the sort key and name of the last kid on this page; to keep memory
+ * bounded by the page size rather than the directory size, the kids for
+ * the page are collected in a heap of "limit" entries as they're read. A
+ * kid that displaces another reuses its name's space if it fits.
+ */
+static char *list_dir(kidsrc_t *src, jsonw_t *w, listopts_t *opts) {
+    const char *name;
+    struct stat sb;
+    char *next = NULL;
+    size_t n = 0;
+    if (!opts->sort) {
+        if (opts->cursor && src->index) {
+            src->pos = strtoul(strchr(opts->cursor, '.') + 1, NULL, 10);
+        } else if (opts->cursor) {
+            seekdir(src->dir, strtol(opts->cursor, NULL, 10));
+        }
+        while ((name = kid_next(src, &sb))) {
+            if (n++ == opts->limit) {
+                if (src->index) {
+                    next = arena_printf(w->ctx, "i%llx.%ld", (unsigned long long)index_gen(src->index), src->here);
+                } else {
+                    next = arena_printf(w->ctx, "%ld", src->here);
+                }
+                break;
+            }
+            kid_write(w, opts, name, &sb);
+        }
+        return next;
+    }
+
+    kid_t after, *heap = NULL;
+    size_t size = 0;
+    int more = 0;
+    if (opts->cursor) {
+        memset(&after, 0, sizeof(after));
+        char *slash = strchr(opts->cursor, '/');
+        after.name = slash ? slash + 1 : opts->cursor;
+        after.sb.st_mtime = after.sb.st_size = strtoll(opts->cursor, NULL, 10);
+    }
+    while ((name = kid_next(src, &sb))) {
+        kid_t kid;
+        kid.name = (char *)name;
+        kid.sb = sb;
+        if (opts->cursor && kid_compare(&kid, &after, opts) <= 0) {
+            continue;
+        } else if (n == opts->limit) {
+            more = 1;
+            if (kid_compare(&kid, &heap[0], opts) < 0) {
+                char *old = heap[0].name;
+                heap[0] = kid;
+                heap[0].name = strlen(name) <= strlen(old) ? strcpy(old, name) : arena_strdup(w->ctx, name);
+                heap_down(heap, n, opts);
+            }
+        } else {
+            if (n == size) {
+                size = size ? size * 2 : 64;
+                heap = realloc(heap, size * sizeof(kid_t));
+            }
+            heap[n] = kid;
+            heap[n].name = arena_strdup(w->ctx, name);
+            heap_up(heap, n++, opts);
+        }
+    }
+    qsort_r(heap, n, sizeof(kid_t), kid_compare, opts);
+    for (size_t i=0;i<n;i++) {
+        kid_write(w, opts, heap[i].name, &heap[i].sb);
+    }
+    if (more) {
+        kid_t *last = &heap[n - 1];
+        if (opts->sort == 'n') {
+            next = last->name;
+        } else {
+            next = arena_printf(w->ctx, "%lld/%s", (long long)(opts->sort == 'm' ? last->sb.st_mtime : last->sb.st_size), last->name);
+        }
+    }
+    free(heap);
+    return next;
+}
+
+/**
+ * Return the full path for an "info" path, which may be empty for the root
+ */
+static char *info_fullpath(context_t *ctx, const char *qval) {
+    return arena_printf(ctx, "%s/%s", ctx->root, qval[0] == '/' ? qval + 1 : qval);
+}
+
+/**
+ * Open the index of the directory dfd at the full path. The index is keyed
+ * on the path relative to the root, without slashes at either end
+ */
+static dirindex_t *info_index(context_t *ctx, int dfd, const char *path) {
+    char *rel = arena_strdup(ctx, path + strlen(ctx->root) + 1);
+    for (size_t l=strlen(rel);l>0 && rel[l-1]=='/';) {
+        rel[--l] = 0;
+    }
+    return index_open(ctx, dfd, rel);
+}
+
+/**
+ * Write the "hash" of the open file fd, if it can be had
+ */
+static void info_hash(context_t *ctx, jsonw_t *w, int fd, struct stat *sb, const char *relpath) {
+    uint64_t hash;
+    if (!hash_file(ctx, fd, sb, relpath, &hash)) {
+        char hex[17];
+        sprintf(hex, "%016llx", (unsigned long long)hash);
+        jw_key(w, "hash");
+        jw_string(w, hex);
+    }
+}
+
+/**
+ * Write the details of one requested path, or nothing if it can't be read.
+ * Directories have their "kids" listed as opts describes, with a "cursor"
+ * for the next page if they don't all fit in the limit. The kids come from
+ * the directory's index unless the cursor is a position in the directory.
+ * Return -1 if the cursor is a position in an index that's been rebuilt
+ */
+static int info_path(context_t *ctx, jsonw_t *w, const char *qval, listopts_t *opts) {
+    struct stat sb;
+    int ret = 0;
+    char *path = info_fullpath(ctx, qval);
+    int fd = strstr(path, "/.") ? -1 : open(path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);    // not blocking on a FIFO, which isn't listed
+    if (fd >= 0 && !fstat(fd, &sb)) {
+        kidsrc_t src;
+        memset(&src, 0, sizeof(src));
+        if (S_ISDIR(sb.st_mode) && (src.dir=fdopendir(fd)) != NULL) {
+            fd = -1;    // owned by dir
+            int atpos = opts->cursor && !opts->sort;
+            if (!atpos || *opts->cursor == 'i') {
+                src.index = info_index(ctx, dirfd(src.dir), path);
+            }
+            if (atpos && *opts->cursor == 'i' && (!src.index || strtoull(opts->cursor + 1, NULL, 16) != index_gen(src.index) || !strchr(opts->cursor, '.') || !index_valid(src.index, strtoul(strchr(opts->cursor, '.') + 1, NULL, 10)))) {
+                ret = -1;
+            } else {
+                stat_write(w, "path", qval, &sb, !canaccess(&sb, W_OK));
+                jw_key(w, "kids");
+                jw_array(w);
+                char *next = list_dir(&src, w, opts);
+                jw_array_end(w);
+                if (next) {
+                    jw_key(w, "cursor");
+                    jw_string(w, next);
+                }
+                jw_object_end(w);
+            }
+            index_close(src.index);
+            closedir(src.dir);
+        } else if (S_ISREG(sb.st_mode)) {
+            stat_write(w, "path", qval, &sb, !canaccess(&sb, W_OK));
+            if (opts->hash) {
+                info_hash(ctx, w, fd, &sb, path + strlen(ctx->root) + 1);
+            }
+            jw_object_end(w);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ret;
+}
+
+typedef struct infoname {
+    const char *qval;
+    size_t dirlen;      // the length of its directory in qval
+    size_t order;
+} infoname_t;
+
+static int infoname_compare(const void *a, const void *b) {
+    const infoname_t *x = a, *y = b;
+    int c = memcmp(x->qval, y->qval, x->dirlen < y->dirlen ? x->dirlen : y->dirlen);
+    if (c || x->dirlen != y->dirlen) {
+        return c ? c : x->dirlen < y->dirlen ? -1 : 1;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**
+ * Write the details of the paths from an "info" POST body, which may be
+ * many. They're grouped by directory so each directory is opened once and
+ * the files in it are read with fstatat(), rather than every path being
+ * resolved from the root; so they're written in order of directory, then
+ * as requested. Directories, and paths that aren't a name in a directory,
+ * are written by info_path(). Return -1 as info_path() does
+ */
+static int info_batch(context_t *ctx, jsonw_t *w, char **paths, listopts_t *opts) {
+    size_t n = 0;
+    while (paths[n]) {
+        n++;
+    }
+    infoname_t *names = arena_alloc(ctx, n * sizeof(infoname_t) + 1);
+    for (size_t i=0;i<n;i++) {
+        char *slash = strrchr(paths[i], '/');
+        names[i].qval = paths[i];
+        names[i].dirlen = slash ? slash - paths[i] : 0;
+        names[i].order = i;
+    }
+    qsort(names, n, sizeof(infoname_t), infoname_compare);
+
+    int dfd = -1, ret = 0;
+    for (size_t i=0;i<n && !ret;i++) {
+        const infoname_t *p = names + i;
+        const char *name = p->qval + p->dirlen + (p->qval[p->dirlen] == '/');
+        struct stat sb;
+        if (i == 0 || p->dirlen != p[-1].dirlen || memcmp(p->qval, p[-1].qval, p->dirlen)) {
+            if (dfd >= 0) {
+                close(dfd);
+            }
+            char *dir = arena_printf(ctx, "%s/%.*s", ctx->root, (int)p->dirlen, p->qval);
+            dfd = strstr(dir, "/.") ? -1 : open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        }
+        if (!*name) {
+            ret = info_path(ctx, w, p->qval, opts);
+        } else if (dfd < 0 || *name == '.' || fstatat(dfd, name, &sb, 0)) {
+            // nothing to say, as with info_path()
+        } else if (S_ISDIR(sb.st_mode)) {
+            ret = info_path(ctx, w, p->qval, opts);
+        } else if (S_ISREG(sb.st_mode) && canaccess(&sb, R_OK)) {
+            stat_write(w, "path", p->qval, &sb, !canaccess(&sb, W_OK));
+            int fd = opts->hash ? openat(dfd, name, O_RDONLY|O_CLOEXEC) : -1;
+            if (fd >= 0) {
+                info_hash(ctx, w, fd, &sb, p->qval + (*p->qval == '/'));
+                close(fd);
+            }
+            jw_object_end(w);
+        }
+    }
+    if (dfd >= 0) {
+        close(dfd);
     }
-    printf("\n");
-    exit(0);
+    return ret;
 }
 
 /**
- * Given a query string, return an array of strings [key,value,key,value,...,0]
- * each individual string should be freed when done, as should the return value
+ * Parse the paths in an "info" POST body, either a JSON array of strings
+ * or one path per line, decoding them in place. Return a NULL terminated
+ * list in the request's arena, or NULL if the JSON is invalid
  */
-char **parse_querystring(char *s) {
-    char **out;
-    int count = 0;
-    if (s && *s) {
-        count = 1;
-        for (char *c=s;*c;c++) {
-            if (*c == '&') {
-                count++;
+static char **info_body(context_t *ctx, char *s) {
+    size_t max = 1, n = 0;
+    for (char *c=s;*c;c++) {
+        max += *c == '\n' || *c == ',';
+    }
+    char **paths = arena_alloc(ctx, (max + 1) * sizeof(char *));
+    s += strspn(s, " \t\r\n");
+    if (*s != '[') {
+        while (*s) {
+            char *e = s + strcspn(s, "\n"), *next = *e ? e + 1 : e;
+            if (e > s && e[-1] == '\r') {
+                e--;
             }
+            *e = 0;
+            if (*s) {
+                paths[n++] = s;
+            }
+            s = next;
         }
+        paths[n] = NULL;
+        return paths;
     }
-    out = calloc(sizeof(char*), count * 2 + 1);
-    if (count > 0) {
-        char **z = out;
-        char *in = s, *in0 = s;
-        char boundary = '=';
-        do {
-            if (!*in || *in == boundary || *in == '&') {
-                char *e = in;
-                char *out = *z = malloc(in - in0 + 1);
-                for (in=in0;in!=e;in++) {
-                    if (*in == '+') {
-                        *out++ = ' ';
-                    } else if (*in == '%') {
-                        int v = *(in + 1);
-                        if (v >= '0' && v <= '9') {
-                            v = v - '0';
-                        } else if (v >= 'a' && v <= 'f') {
-                            v = v - 'a' + 10;
-                        } else if (v >= 'A' && v <= 'F') {
-                            v = v - 'A' + 10;
-                        } else {
-                            *out++ = '%';
-                            *out++ = *(++in);
-                            continue;
+    s += 1 + strspn(s + 1, " \t\r\n");
+    while (*s != ']') {
+        if (*s++ != '"') {
+            return NULL;
+        }
+        // The decoded string is never longer than the JSON, so it's written over it
+        char *d = paths[n++] = s;
+        while (*s != '"') {
+            if ((unsigned char)*s < 0x20) {
+                return NULL;        // including the end of the body
+            } else if (*s != '\\') {
+                *d++ = *s++;
+                continue;
+            }
+            s += 2;
+            switch (s[-1]) {
+                case '"': case '\\': case '/': *d++ = s[-1]; break;
+                case 'b': *d++ = '\b'; break;
+                case 'f': *d++ = '\f'; break;
+                case 'n': *d++ = '\n'; break;
+                case 'r': *d++ = '\r'; break;
+                case 't': *d++ = '\t'; break;
+                case 'u': {
+                    unsigned int c = 0;
+                    for (int i=0;i<4;i++) {
+                        if (hexval(s[i]) < 0) {
+                            return NULL;
+                        }
+                        c = (c << 4) | hexval(s[i]);
+                    }
+                    s += 4;
+                    if (c >= 0xd800 && c < 0xdc00 && s[0] == '\\' && s[1] == 'u') {
+                        unsigned int lo = 0;
+                        for (int i=2;i<6 && hexval(s[i]) >= 0;i++) {
+                            lo = (lo << 4) | hexval(s[i]);
                         }
-                        int v1 = *(in + 2);
-                        if (v1 >= '0' && v1 <= '9') {
-                            v = (v << 4) | (v1 - '0');
-                        } else if (v1 >= 'a' && v1 <= 'f') {
-                            v = (v << 4) | (v1 - 'a' + 10);
-                        } else if (v1 >= 'A' && v1 <= 'F') {
-                            v = (v << 4) | (v1 - 'A' + 10);
-                        } else {
-                            *out++ = '%';
-                            *out++ = *(++in);
-                            *out++ = *(++in);
-                            continue;
+                        if (lo >= 0xdc00 && lo < 0xe000) {
+                            c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                            s += 6;
                         }
-                        *out++ = v;
-                        in += 2;
+                    }
+                    if (c < 0x80) {
+                        *d++ = c;
+                    } else if (c < 0x800) {
+                        *d++ = 0xc0 | (c >> 6);
+                        *d++ = 0x80 | (c & 0x3f);
+                    } else if (c < 0x10000) {
+                        *d++ = 0xe0 | (c >> 12);
+                        *d++ = 0x80 | ((c >> 6) & 0x3f);
+                        *d++ = 0x80 | (c & 0x3f);
                     } else {
-                        *out++ = *in;
+                        *d++ = 0xf0 | (c >> 18);
+                        *d++ = 0x80 | ((c >> 12) & 0x3f);
+                        *d++ = 0x80 | ((c >> 6) & 0x3f);
+                        *d++ = 0x80 | (c & 0x3f);
                     }
+                    break;
                 }
-                if (boundary == '=' && (!*e || *e == '&')) { // Malformed, create a dummy value
-                    z++;
-                    *z = malloc(1);
-                    **z = 0;
-                }
-                boundary = boundary == '=' ? '&' : '=';
-                in0 = *e ? ++e : e;
-                z++;
+                default:
+                    return NULL;
             }
-            in++;
-        } while (*in0);
+        }
+        *d = 0;
+        s++;
+        s += strspn(s, " \t\r\n");
+        if (*s == ',') {
+            s += 1 + strspn(s + 1, " \t\r\n");
+        } else if (*s != ']') {
+            return NULL;
+        }
     }
-    return out;
-}
-
-
-void send(context_t *ctx, int code, json_t *json) {
-    char *s = json ? json_dumps(json, 0) : NULL;
-    logmsg(ctx, "tx %d %s", code, s);
-    printf("Status: %d\r\n", code);
-    if (s) {
-        printf("Content-Type: application/json\r\n");
-        printf("Content-Length: %lu\r\n", (long unsigned int)strlen(s));
-        fputs("\r\n", stdout);
-        fputs(s, stdout);
-        free(s);
-    } else {
-        fputs("\r\n", stdout);
+    s += 1 + strspn(s + 1, " \t\r\n");
+    if (*s) {
+        return NULL;
     }
+    paths[n] = NULL;
+    return paths;
 }
 
-void sendmsg(context_t *ctx, int code, char *fmt, ...) {
-    json_t *j = json_object();
-    json_object_set_new(j, "ok", json_boolean(code >= 200 && code < 300));
-    if (fmt) {
-        char *buf = malloc(INITBUF);
-        va_list va; 
-        va_start(va, fmt);
-        int len = vsnprintf(buf, INITBUF, fmt, va);
-        va_end(va);
-        if (len > INITBUF) {
-            free(buf);
-            buf = malloc(len + 2);
-            va_start(va, fmt);
-            vsnprintf(buf, len + 2, fmt, va);
-            va_end(va);
+/**
+ * Add one requested path to the validator h for an "info" response, and
+ * raise *mtime to its modification time. A directory's own times change
+ * when an entry is added, removed or renamed, but not when a file in it is
+ * rewritten or has its mode changed; yet its kids' details, the order
+ * they're sorted in, where a cursor or limit falls and which kids can be
+ * read all depend on them. So for a directory the index must be current and
+ * its version is added too, and *listed is set as its kids' times aren't in
+ * *mtime. Return 0 if there's no index, in which case the response can't
+ * be validated
+ */
+static uint64_t info_validate(context_t *ctx, uint64_t h, const char *qval, time_t *mtime, int *listed) {
+    struct stat sb;
+    char *path = info_fullpath(ctx, qval);
+    int fd = strstr(path, "/.") ? -1 : open(path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+    if (fd >= 0 && !fstat(fd, &sb)) {
+        uint64_t v[] = { sb.st_dev, sb.st_ino, sb.st_size, sb.st_mode, (uint64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec, (uint64_t)sb.st_ctim.tv_sec * 1000000000 + sb.st_ctim.tv_nsec, !canaccess(&sb, W_OK) };
+        h = fnv1a(h, v, sizeof(v));
+        if (sb.st_mtime > *mtime) {
+            *mtime = sb.st_mtime;
         }
-        json_object_set_new(j, "msg", json_string(buf));
+        if (S_ISDIR(sb.st_mode)) {
+            dirindex_t *ix = info_index(ctx, fd, path);
+            *listed = 1;
+            uint64_t version = ix ? index_version(ix) : 0;
+            h = ix ? fnv1a(h, &version, sizeof(version)) : 0;
+            index_close(ix);
+        }
+    } else {
+        h = fnv1a(h, "", 1);
+    }
+    if (fd >= 0) {
+        close(fd);
     }
-    send(ctx, code, j);
-    json_decref(j);
+    return h;
 }
 
+/**
+ * Return the details of each requested path, or of the root if none are
+ * given. Paths may also be POSTed, as many as needed, as a JSON array of
+ * strings or one per line. With "detail=1" the details of each child of a directory are
+ * included too, saving a further request for them. Directories may be
+ * listed a page at a time with "limit", passing the "cursor" from each
+ * page to get the next, and sorted with "sort=name", "mtime" or "size",
+ * prefixed with "-" to sort descending. With "hash=1" each requested file
+ * has the XXH64 "hash" of its content, as "have" compares. The response
+ * has an ETag so a client can revalidate its copy rather than fetch it again
+ */
 void info(context_t *ctx) {
-    json_t *a = json_array();
-    struct stat sb;
+    jsonw_t w;
     int found = 0;
+    listopts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.limit = SIZE_MAX;
     for (char **q=ctx->query;*q;) {
+        char *qkey = *q++;
+        char *qval = *q++;
+        if (!strcmp(qkey, "detail")) {
+            opts.detail = !strcmp(qval, "1") || !strcmp(qval, "true");
+        } else if (!strcmp(qkey, "hash")) {
+            opts.hash = !strcmp(qval, "1") || !strcmp(qval, "true");
+        } else if (!strcmp(qkey, "cursor") && *qval) {
+            opts.cursor = qval;
+        } else if (!strcmp(qkey, "limit")) {
+            char *c;
+            opts.limit = strtoul(qval, &c, 10);
+            if (*c || !*qval || !opts.limit) {
+                send_msg(ctx, 400, "invalid limit \"%s\"", qval);
+                return;
+            }
+        } else if (!strcmp(qkey, "sort")) {
+            char *key = qval + (*qval == '-');
+            opts.reverse = *qval == '-';
+            if (!strcmp(key, "name") || !strcmp(key, "mtime") || !strcmp(key, "size")) {
+                opts.sort = *key;
+            } else {
+                send_msg(ctx, 400, "invalid sort \"%s\"", qval);
+                return;
+            }
+        }
+    }
+    char **body = NULL, *s = NULL;
+    size_t len;
+    if (ctx->inlen && !(s=read_body_all(ctx, INFOBODY, &len))) {
+        send_msg(ctx, 413, "request body over %d bytes", INFOBODY);
+        return;
+    } else if (s && !(body=info_body(ctx, s))) {
+        send_msg(ctx, 400, "invalid JSON in request body");
+        return;
+    }
+
+    // The response is identified by the query and the state of each path, though not for a POST
+    time_t mtime = 0;
+    int listed = 0;
+    int encoding = accept_encoding(ctx);
+    uint64_t h = body ? 0 : fnv1a(FNVINIT, &encoding, sizeof(encoding));
+    for (char **q=ctx->query;*q && h;q+=2) {
+        h = fnv1a(fnv1a(h, q[0], strlen(q[0]) + 1), q[1], strlen(q[1]) + 1);
+        if (!strcmp(q[0], "path")) {
+            found = 1;
+            h = info_validate(ctx, h, q[1], &mtime, &listed);
+        }
+    }
+    if (!found && h) {
+        h = info_validate(ctx, h, "", &mtime, &listed);
+    }
+    found = 0;
+    char etag[24], cache[256];
+    if (h) {
+        snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)h);
+        // Kids' times aren't reflected in the directory's, so there's no date to compare
+        cache_headers(cache, sizeof(cache), etag, listed ? 0 : mtime);
+        if (not_modified(ctx, etag, listed ? 0 : mtime)) {
+            send_not_modified(ctx, cache);
+            return;
+        }
+    }
+
+    jw_start(&w, ctx, 200);
+    w.headers = h ? cache : NULL;
+    jw_object(&w);
+    jw_key(&w, "paths");
+    jw_array(&w);
+    int stale = 0;
+    for (char **q=ctx->query;*q && !stale;) {
         char *qkey = *q++;
         char *qval = *q++;
         if (!strcmp(qkey, "path")) {
             found = 1;
-            char *path = calloc(strlen(ctx->root) + strlen(qval) + 2, 1);
-            if (strlen(qval)) {
-                sprintf(path, "%s/%s", ctx->root, qval[0] == '/' ? qval+1 : qval);
-            } else {
-                strcpy(path, ctx->root);
-            }
-            if (!strstr(path, "/.") && !stat(path, &sb)) {
-                DIR *dir;
-                json_t *j = NULL;
-                if (S_ISDIR(sb.st_mode) && (dir=opendir(path)) != NULL) {
-                    j = json_object();
-                    json_object_set_new(j, "path", json_string(qval));
-                    json_object_set_new(j, "type", json_string("dir"));
-                    if (access(path, W_OK)) {
-                        json_object_set_new(j, "readonly", json_true());
-                    }
-                    json_object_set_new(j, "ctime", json_integer((json_int_t)sb.st_ctime));
-                    json_object_set_new(j, "mtime", json_integer((json_int_t)sb.st_mtime));
-                    json_t *c = json_array();
-                    json_object_set_new(j, "kids", c);
-                    struct dirent *dp;
-                    int path2len = 100;
-                    char *path2 = calloc(strlen(path) + path2len + 3, 1);
-                    while ((dp = readdir(dir))) {
-                        if (dp->d_name[0] != '.') {
-                            if (strlen(dp->d_name) > path2len) {
-                                free(path2);
-                                path2len = strlen(dp->d_name);
-                                path2 = calloc(strlen(path) + path2len + 3, 1);
-                            }
-                            sprintf(path2, "%s/%s", path, dp->d_name);
-                            if (!stat(path2, &sb) && !access(path2, S_ISDIR(sb.st_mode) ? R_OK|X_OK : R_OK)) {
-                                json_array_append_new(c, json_string(dp->d_name));
-                            }
-                        }
-                    }
-                    closedir(dir);
-                    free(path2);
-                } else if (S_ISREG(sb.st_mode) && !access(path, R_OK)) {
-                    j = json_object();
-                    json_object_set_new(j, "path", json_string(qval));
-                    json_object_set_new(j, "type", json_string("file"));
-                    if (access(path, W_OK)) {
-                        json_object_set_new(j, "readonly", json_true());
+            stale = info_path(ctx, &w, qval, &opts);
+        }
+    }
+    if (!stale && body) {
+        stale = info_batch(ctx, &w, body, &opts);
+    } else if (!stale && !found) {
+        stale = info_path(ctx, &w, "", &opts);
+    }
+    if (stale && jw_discard(&w)) {
+        send_msg(ctx, 409, "cursor is out of date, the directory has changed");
+        return;
+    }
+    // If part of the list has gone, the error goes at the end, as ok is
+    jw_array_end(&w);
+    jw_key(&w, "ok");
+    jw_boolean(&w, !stale);
+    if (stale) {
+        jw_key(&w, "msg");
+        jw_string(&w, "cursor is out of date, the directory has changed");
+    }
+    jw_object_end(&w);
+    logmsg(ctx, "tx 200 info: %lu bytes", (unsigned long)jw_end(&w));
+}
+
+/**
+ * Write len bytes from offset off of the file fd to the response, avoiding
+ * a copy through userspace where we can: sendfile() if the response is a
+ * socket, splice() if it's a pipe (as it is for most CGI servers), otherwise
+ * or if those fail before sending anything, read() and write(). With
+ * "--io uring" it's read and written with io_uring instead. Return the
+ * number of bytes written and set "how" to the method used. If that's
+ * short of a Content-Length already sent, the caller must end the response
+ * there and not keep the connection
+ */
+size_t copyout(context_t *ctx, int fd, off_t off, size_t len, const char **how) {
+    struct stat sb;
+    size_t sent = 0;
+    ssize_t l;
+    int mode = fstat(ctx->outfd, &sb) ? 0 : S_ISSOCK(sb.st_mode) ? 1 : S_ISFIFO(sb.st_mode) ? 2 : 0;
+
+    fflush(ctx->out);
+    posix_fadvise(fd, off, len, POSIX_FADV_SEQUENTIAL);
+    if (ctx->uring && !uring_copyout(ctx, fd, off, len, &sent)) {
+        *how = "io_uring";
+        ctx->sent += sent;
+        return sent;
+    }
+    posix_fadvise(fd, off, len < READAHEAD ? len : READAHEAD, POSIX_FADV_WILLNEED);
+    while (mode && sent < len) {
+        size_t n = len - sent < COPYCHUNK ? len - sent : COPYCHUNK;
+        if (mode == 1) {
+            l = sendfile(ctx->outfd, fd, &off, n);
+        } else {
+            l = splice(fd, &off, ctx->outfd, NULL, n, SPLICE_F_MOVE|SPLICE_F_MORE);
+        }
+        if (l > 0) {
+            sent += l;
+        } else if (l < 0 && errno == EINTR) {
+            continue;
+        } else if (l < 0 && sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            mode = 0;   // not supported here, fall back
+        } else {
+            break;
+        }
+    }
+    *how = mode == 1 ? "sendfile" : mode == 2 ? "splice" : "read/write";
+    if (mode == 0) {
+        char buf[32768];
+        while (sent < len && (l=pread(fd, buf, len - sent < sizeof(buf) ? len - sent : sizeof(buf), off)) > 0) {
+            off += l;
+            for (ssize_t i=0,w;i<l;i+=w) {
+                if ((w=write(ctx->outfd, buf + i, l - i)) <= 0) {
+                    if (w < 0 && errno == EINTR) {
+                        w = 0;
+                        continue;
                     }
-                    json_object_set_new(j, "ctime", json_integer((json_int_t)sb.st_ctime));
-                    json_object_set_new(j, "ctime", json_integer((json_int_t)sb.st_mtime));
-                    json_object_set_new(j, "length", json_integer((json_int_t)sb.st_size));
-                }
-                if (j) {
-                    json_array_append_new(a, j);
+                    ctx->sent += sent + i;
+                    return sent + i;
                 }
             }
+            sent += l;
         }
     }
-    if (!found) {
-        json_decref(a);
-        void *old = ctx->query;
-        ctx->query = parse_querystring("path=");
-        info(ctx);
-        for (char **q=ctx->query;*q;q++) {
-            free(*q);
+    ctx->sent += sent;
+    return sent;
+}
+
+/**
+ * Parse the value of a "Range" header for a file of the given size, storing
+ * up to max [first,last] byte pairs in ranges. Return the number of ranges
+ * that can be satisfied, 0 if none can, or -1 if the header is invalid or has
+ * too many ranges - in which case it's ignored and the whole file is sent
+ */
+static int parse_range(const char *s, off_t size, off_t *ranges, int max) {
+    int n = 0;
+    if (strncmp(s, "bytes=", 6)) {
+        return -1;
+    }
+    for (s+=6;*s;) {
+        off_t first, last;
+        char *e;
+        while (*s == ' ' || *s == '\t' || *s == ',') {
+            s++;
         }
-        free(ctx->query);
-        ctx->query = old;
-    } else {
-        json_t *o = json_object();
-        json_object_set_new(o, "ok", json_true());
-        json_object_set_new(o, "paths", a);
-        send(ctx, 200, o);
-        json_decref(o);
+        if (!*s) {
+            break;
+        } else if (*s == '-' && isdigit(s[1])) {                // "-500" is the last 500 bytes
+            off_t suffix = strtoll(s + 1, &e, 10);
+            first = suffix >= size ? 0 : size - suffix;
+            last = suffix ? size - 1 : -1;
+        } else if (isdigit(*s)) {                               // "500-999" or "500-"
+            first = strtoll(s, &e, 10);
+            if (*e++ != '-') {
+                return -1;
+            } else if (isdigit(*e)) {
+                last = strtoll(e, &e, 10);
+                if (last < first) {
+                    return -1;
+                } else if (last >= size) {
+                    last = size - 1;
+                }
+            } else {
+                last = size - 1;
+            }
+        } else {
+            return -1;
+        }
+        while (*e == ' ' || *e == '\t') {
+            e++;
+        }
+        if (*e && *e != ',') {
+            return -1;
+        } else if (first <= last && first < size) {
+            if (n == max) {
+                return -1;
+            }
+            ranges[n * 2] = first;
+            ranges[n * 2 + 1] = last;
+            n++;
+        }
+        s = e;
     }
+    return n;
 }
 
+/**
+ * Retrieve a file. Supports a "Range" header (returning multipart/byteranges
+ * for more than one range) and equivalent "off" and "len" query parameters,
+ * and conditional requests with "If-None-Match", "If-Modified-Since" and
+ * "If-Range". A directory is sent as an archive, see archive.c
+ */
 void get(context_t *ctx) {
     struct stat sb;
+    char *path = NULL;
+    const char *name = NULL;
+    size_t off = SIZE_MAX, len = SIZE_MAX;
+
     for (char **q=ctx->query;*q;) {
         char *qkey = *q++;
         char *qval = *q++;
-        if (!strcmp(qkey, "path")) {
-            const char *name = qval;
+        if (!strcmp(qkey, "path") && !path) {
+            name = qval;
             if (*name == '/') {
                 name++;
             }
             if (name[0] == 0 || name[0] == '.' || strstr(name, "/.")) {
-                sendmsg(ctx, 400, "invalid path \"%s\"", name);
+                send_msg(ctx, 400, "invalid path \"%s\"", name);
                 return;
             } else {
-                char *path = calloc(strlen(ctx->root) + strlen(name) + 2, 1);
-                sprintf(path, "%s/%s", ctx->root, name);
-                if (stat(path, &sb)) {
-                    logmsg(ctx, "get stat \"%s\": %s", path, strerror(errno));
-                    sendmsg(ctx, 404, "get stat \"%s\": %s", name, strerror(errno));
-                    return;
+                path = arena_printf(ctx, "%s/%s", ctx->root, name);
+            }
+        } else if ((!strcmp(qkey, "off") && off == SIZE_MAX) || (!strcmp(qkey, "len") && len == SIZE_MAX)) {
+            char *c;
+            size_t v = strtoul(qval, &c, 10);
+            if (*c || !*qval || (*qkey == 'l' && v == 0)) {
+                send_msg(ctx, 400, "invalid %s \"%s\"", qkey, qval);
+                return;
+            }
+            *(*qkey == 'o' ? &off : &len) = v;
+        }
+    }
+    if (!path) {
+        send_msg(ctx, 400, "missing path");
+    } else if (stat(path, &sb)) {
+        logmsg(ctx, "get stat \"%s\": %s", path, strerror(errno));
+        send_msg(ctx, 404, "get stat \"%s\": %s", name, strerror(errno));
+    } else if (S_ISDIR(sb.st_mode)) {
+        get_archive(ctx, path, name);
+    } else if (!S_ISREG(sb.st_mode)) {
+        send_msg(ctx, 403, "not a file");
+    } else {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &sb)) {
+            logmsg(ctx, "get open \"%s\": %s", path, strerror(errno));
+            send_msg(ctx, 404, "get open: %s", strerror(errno));
+        } else {
+            // Strong validator: a file rewritten in place gets a new mtime, replaced gets a new inode.
+            // Each encoding is a different response so gets its own
+            const char *suffix[] = { "", "-gz", "-zst" };
+            unsigned long long mtime = (unsigned long long)sb.st_mtim.tv_sec * 1000000000ULL + sb.st_mtim.tv_nsec;
+            char etag[72], cache[256];
+            snprintf(etag, sizeof(etag), "\"%lx-%lx-%llx\"", (unsigned long)sb.st_ino, (unsigned long)sb.st_size, mtime);
+
+            off_t ranges[MAXRANGES * 2];
+            int nranges = -1;
+            char *range = if_range(ctx, etag, sb.st_mtime) ? getheader(ctx, "range") : NULL;
+            // Only the whole file is sent compressed
+            int encoding = !range && off == SIZE_MAX && len == SIZE_MAX ? accept_encoding(ctx) : ENC_IDENTITY;
+            if (encoding && compressible(fd, sb.st_size)) {
+                snprintf(etag, sizeof(etag), "\"%lx-%lx-%llx%s\"", (unsigned long)sb.st_ino, (unsigned long)sb.st_size, mtime, suffix[encoding]);
+            } else {
+                encoding = ENC_IDENTITY;
+            }
+            cache_headers(cache, sizeof(cache), etag, sb.st_mtime);
+            if (off != SIZE_MAX || len != SIZE_MAX) {
+                ranges[0] = off == SIZE_MAX ? 0 : off;
+                ranges[1] = len == SIZE_MAX || len > sb.st_size - ranges[0] ? sb.st_size - 1 : ranges[0] + len - 1;
+                nranges = ranges[0] < sb.st_size ? 1 : 0;
+            } else if (range) {
+                nranges = parse_range(range, sb.st_size, ranges, MAXRANGES);
+            }
+
+            const char *how = NULL, *coding = "identity";
+            size_t sent = 0, total = 0;
+            if (not_modified(ctx, etag, sb.st_mtime)) {
+                send_not_modified(ctx, cache);
+                nranges = -2;
+            } else if (nranges == 0) {
+                send_status(ctx, 416);
+                fprintf(ctx->out, "Content-Range: bytes */%lu\r\n", (unsigned long)sb.st_size);
+                fputs("Content-Length: 0\r\n\r\n", ctx->out);
+            } else if (nranges < 0) {
+                off_t csize;
+                int cfd = encoding ? compressed_file(ctx, fd, name, &sb, encoding, &csize) : -1;
+                if (encoding && cfd < 0) {
+                    snprintf(etag, sizeof(etag), "\"%lx-%lx-%llx\"", (unsigned long)sb.st_ino, (unsigned long)sb.st_size, mtime);
+                    cache_headers(cache, sizeof(cache), etag, sb.st_mtime);
+                }
+                send_status(ctx, 200);
+                fprintf(ctx->out, "Content-Type: application/octet-stream\r\n");
+                if (cfd >= 0) {
+                    fprintf(ctx->out, "Content-Encoding: %s\r\n", encoding_name(encoding));
+                    fprintf(ctx->out, "Content-Length: %lu\r\n", (unsigned long)csize);
                 } else {
-                    int fd = open(path, O_RDONLY);
-                    if (fd < 0) {
-                        logmsg(ctx, "get open \"%s\": %s", path, strerror(errno));
-                        sendmsg(ctx, 404, "get open: %s", strerror(errno));
-                        return;
-                    } else {
-                        printf("Content-Type: application/octet-stream\r\n");
-                        printf("Content-Length: %lu\r\n", sb.st_size);
-                        fputs("\r\n", stdout);
-                        fflush(stdout);
-                        char buf[32768];
-                        int l;
-                        while ((l=read(fd, buf, sizeof(buf))) > 0) {
-                            write(STDOUT_FILENO, buf, l);
-                        }
-                        close(fd);
+                    fprintf(ctx->out, "Content-Length: %lu\r\n", sb.st_size);
+                    fputs("Accept-Ranges: bytes\r\n", ctx->out);
+                }
+                fputs("Vary: Accept-Encoding\r\n", ctx->out);
+                fputs(cache, ctx->out);
+                fputs("\r\n", ctx->out);
+                if (cfd >= 0) {
+                    sent = copyout(ctx, cfd, 0, total = csize, &how);
+                    coding = encoding_name(encoding);
+                    close(cfd);
+                } else {
+                    sent = copyout(ctx, fd, 0, total = sb.st_size, &how);
+                }
+            } else if (nranges == 1) {
+                total = ranges[1] - ranges[0] + 1;
+                send_status(ctx, 206);
+                fprintf(ctx->out, "Content-Type: application/octet-stream\r\n");
+                fprintf(ctx->out, "Content-Length: %lu\r\n", (unsigned long)total);
+                fprintf(ctx->out, "Content-Range: bytes %lu-%lu/%lu\r\n", (unsigned long)ranges[0], (unsigned long)ranges[1], (unsigned long)sb.st_size);
+                fputs("Accept-Ranges: bytes\r\n", ctx->out);
+                fputs(cache, ctx->out);
+                fputs("\r\n", ctx->out);
+                sent = copyout(ctx, fd, ranges[0], total, &how);
+            } else {
+                // Each part is preceded by its own headers; measure them first for Content-Length
+                const char *part = "\r\n--%s\r\nContent-Type: application/octet-stream\r\nContent-Range: bytes %lu-%lu/%lu\r\n\r\n";
+                char boundary[40];
+                snprintf(boundary, sizeof(boundary), "filemanager-%lx%lx", (unsigned long)sb.st_ino, (unsigned long)sb.st_mtime);
+                size_t length = strlen(boundary) + 8;   // "\r\n--" boundary "--\r\n"
+                for (int i=0;i<nranges;i++) {
+                    total += ranges[i * 2 + 1] - ranges[i * 2] + 1;
+                    length += snprintf(NULL, 0, part, boundary, (unsigned long)ranges[i * 2], (unsigned long)ranges[i * 2 + 1], (unsigned long)sb.st_size);
+                }
+                send_status(ctx, 206);
+                fprintf(ctx->out, "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary);
+                fprintf(ctx->out, "Content-Length: %lu\r\n", (unsigned long)(length + total));
+                fputs("Accept-Ranges: bytes\r\n", ctx->out);
+                fputs(cache, ctx->out);
+                fputs("\r\n", ctx->out);
+                for (int i=0;i<nranges;i++) {
+                    size_t n = ranges[i * 2 + 1] - ranges[i * 2] + 1;
+                    fprintf(ctx->out, part, boundary, (unsigned long)ranges[i * 2], (unsigned long)ranges[i * 2 + 1], (unsigned long)sb.st_size);
+                    size_t l = copyout(ctx, fd, ranges[i * 2], n, &how);
+                    sent += l;
+                    if (l != n) {
+                        break;
                     }
-                    return;
                 }
-                free(path);
+                if (sent == total) {
+                    fprintf(ctx->out, "\r\n--%s--\r\n", boundary);
+                }
+            }
+            if (sent != total) {
+                // Short of its Content-Length, so the client can't find the next response
+                ctx->keepalive = 0;
+            }
+            if (how) {
+                logmsg(ctx, "get \"%s\": sent %lu of %lu bytes in %d ranges with %s, %s", path, (unsigned long)sent, (unsigned long)total, nranges < 0 ? 1 : nranges, how, coding);
+            } else if (nranges == 0) {
+                logmsg(ctx, "get \"%s\": range not satisfiable", path);
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+/**
+ * Write up to max bytes of the request body to the file fd at offset off.
+ * Any body read along with the headers is written first; the rest is moved
+ * with splice() if the body is a pipe (as it is for most CGI servers) or a
+ * socket (through a pipe), otherwise or if splice() is refused before any
+ * data is moved, with read() and pwrite(). With "--io uring" a body of
+ * known length is moved with io_uring instead. Return 0 or an errno value, and
+ * set count to the number of bytes written and "how" to the method used
+ */
+int copyin(context_t *ctx, int fd, off_t off, size_t max, size_t *count, const char **how) {
+    struct stat sb;
+    ssize_t l;
+    int err = 0;
+    int mode = fstat(ctx->infd, &sb) ? 0 : S_ISFIFO(sb.st_mode) ? 1 : S_ISSOCK(sb.st_mode) ? 2 : 0;
+    int pipefd[2] = { -1, -1 };
+
+    *count = 0;
+    if (max > ctx->inlen) {
+        max = ctx->inlen;
+    }
+    while (ctx->inbuflen && *count < max) {
+        size_t n = max - *count < ctx->inbuflen ? max - *count : ctx->inbuflen;
+        if ((l=pwrite(fd, ctx->inbuf, n, off)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        ctx->inbuf += l;
+        ctx->inbuflen -= l;
+        if (ctx->inlen != SIZE_MAX) {
+            ctx->inlen -= l;
+        }
+        off += l;
+        *count += l;
+    }
+    if (ctx->uring && mode && *count < max && ctx->inlen != SIZE_MAX && (err=uring_copyin(ctx, fd, off, max - *count, count)) >= 0) {
+        *how = "io_uring";
+        return err;
+    }
+    err = 0;
+    if (mode == 2 && pipe2(pipefd, O_CLOEXEC)) {
+        mode = 0;
+    } else if (mode == 2) {
+        fcntl(pipefd[1], F_SETPIPE_SZ, COPYPIPE);
+    }
+    while (mode && *count < max) {
+        size_t n = max - *count < COPYCHUNK ? max - *count : COPYCHUNK;
+        if (mode == 1) {
+            l = splice(ctx->infd, NULL, fd, &off, n, SPLICE_F_MOVE|SPLICE_F_MORE);
+        } else if ((l=splice(ctx->infd, NULL, pipefd[1], NULL, n < COPYPIPE ? n : COPYPIPE, SPLICE_F_MOVE|SPLICE_F_MORE)) > 0) {
+            for (ssize_t i=0,w;i<l;i+=w) {
+                if ((w=splice(pipefd[0], NULL, fd, &off, l - i, SPLICE_F_MOVE|SPLICE_F_MORE)) <= 0) {
+                    if (w < 0 && errno == EINTR) {
+                        w = 0;
+                        continue;
+                    }
+                    err = w < 0 ? errno : EIO;
+                    *count += i;
+                    mode = 0;
+                    break;
+                }
+            }
+            if (err) {
+                break;
+            }
+        }
+        if (l > 0) {
+            *count += l;
+            if (ctx->inlen != SIZE_MAX) {
+                ctx->inlen -= l;
+            }
+        } else if (l == 0) {
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (*count == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            mode = 0;   // not supported here, fall back
+        } else {
+            err = errno;
+            break;
+        }
+    }
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    *how = mode == 1 ? "splice" : mode == 2 ? "splice via pipe" : "read/write";
+    if (mode == 0 && !err) {
+        char buf[65536];
+        l = 0;
+        while (*count < max && (l=read_body(ctx, buf, max - *count < sizeof(buf) ? max - *count : sizeof(buf))) > 0) {
+            for (ssize_t i=0,w;i<l;i+=w) {
+                if ((w=pwrite(fd, buf + i, l - i, off + i)) < 0) {
+                    if (errno != EINTR) {
+                        return errno;
+                    }
+                    w = 0;
+                }
+                *count += w;
             }
+            off += l;
+        }
+        if (l < 0) {
+            err = errno;
         }
     }
-    sendmsg(ctx, 400, "missing path");
+    return err;
 }
 
+/**
+ * Upload a chunk of a file. Without "len", chunks must be sent in order and
+ * each is appended to the file. With "len", the total length of the file,
+ * chunks may be sent in any order and in parallel - see put_session()
+ */
 void put(context_t *ctx) {
-    size_t off = SIZE_MAX;
+    size_t off = SIZE_MAX, length = SIZE_MAX;
     char *path = NULL;
     struct stat sb;
     memset(&sb, 0, sizeof(sb));
-    char buf[65536];
 
     for (char **q=ctx->query;*q;) {
         char *qkey = *q++;
@@ -341,59 +1550,80 @@ void put(context_t *ctx) {
                 name++;
             }
             if (name[0] == 0 || name[0] == '.' || strstr(name, "/.")) {
-                sendmsg(ctx, 400, "invalid path \"%s\"", name);
+                send_msg(ctx, 400, "invalid path \"%s\"", name);
                 return;
             } else {
-                path = calloc(strlen(ctx->root) + strlen(name) + 2, 1);
-                sprintf(path, "%s/%s", ctx->root, name);
+                path = arena_printf(ctx, "%s/%s", ctx->root, name);
             }
-        } else if (!strcmp(qkey, "off") && *(qval) && off == SIZE_MAX) {
+        } else if ((!strcmp(qkey, "off") && off == SIZE_MAX) || (!strcmp(qkey, "len") && length == SIZE_MAX)) {
             char *c;
-            off = strtoul(qval, &c, 10);
-            if (*c) {
-                sendmsg(ctx, 400, "invalid off \"%s\"", qval);
+            size_t v = strtoul(qval, &c, 10);
+            if (*c || !*qval) {
+                send_msg(ctx, 400, "invalid %s \"%s\"", qkey, qval);
                 return;
             }
+            *(*qkey == 'o' ? &off : &length) = v;
         }
     }
     int fd = 0;
     if (!path) {
-        sendmsg(ctx, 400, "missing path");
+        send_msg(ctx, 400, "missing path");
+    } else if (length != SIZE_MAX) {
+        put_session(ctx, path, path + strlen(ctx->root) + 1, off, length);
     } else if ((access(path, F_OK) || !access(path, W_OK)) && (off == SIZE_MAX || off == 0)) {
         fd = O_CREAT|O_WRONLY|O_TRUNC;
     } else if (access(path, W_OK)) {
         logmsg(ctx, "put access \"%s\": not writable", path);
-        sendmsg(ctx, 403, "not writable: %s", strerror(errno));
+        send_msg(ctx, 403, "not writable: %s", strerror(errno));
     } else if (stat(path, &sb)) {
         logmsg(ctx, "put stat \"%s\": %s", path, strerror(errno));
-        sendmsg(ctx, 500, "put stat: %s", strerror(errno));
+        send_msg(ctx, 500, "put stat: %s", strerror(errno));
     } else if (!S_ISREG(sb.st_mode)) {
-        sendmsg(ctx, 403, "not a file");
+        send_msg(ctx, 403, "not a file");
     } else if (off != sb.st_size) {
-        sendmsg(ctx, 400, "offset %lu should be %lu", off, sb.st_size);
+        send_msg(ctx, 400, "offset %lu should be %lu", off, sb.st_size);
     } else {
-        fd = O_APPEND|O_WRONLY;
+        fd = O_WRONLY;
     }
     if (fd) {
-        for (char *c=path;*c;c++) {
-            if (*c == '/' && c != path) {
-                *c = 0;
-                mkdir(path, 0777);
-                *c = '/';
-            }
-        }
+        struct stat before;
+        mkparents(path);
+        index_before(path, &before);
         fd = open(path, fd, 0666);
+        off = sb.st_size;       // 0 unless appending
+        // Carry the file's hash on over what's written, if we have it so far
+        xxh64_t state;
+        int hashing = fd >= 0 && (off == 0 || (!fstat(fd, &sb) && !hash_get(fd, &sb, &state)));
+        if (off == 0) {
+            xxh64_init(&state);
+        }
         if (fd < 0) {
-            sendmsg(ctx, 403, "put open: %s", strerror(errno));
+            send_msg(ctx, 403, "put open: %s", strerror(errno));
+        } else if (ctx->inlen != SIZE_MAX && ctx->inlen && fallocate(fd, FALLOC_FL_KEEP_SIZE, off, ctx->inlen) && errno == ENOSPC) {
+            send_msg(ctx, 507, "put allocate: %s", strerror(errno));
+            close(fd);
         } else {
-            int l;
-            size_t count = 0;
-            while ((l=read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
-                write(fd, buf, l);
-                count += l;
+            size_t count;
+            const char *how;
+            int err = copyin(ctx, fd, off, SIZE_MAX, &count, &how);
+            // Read back what was written to hash it; if the file can't be read, it's hashed when asked
+            int rfd = !err && hashing ? open(path, O_RDONLY|O_CLOEXEC) : -1;
+            struct stat rsb;
+            if (rfd >= 0 && !fstat(rfd, &rsb) && !fstat(fd, &sb) && rsb.st_ino == sb.st_ino && rsb.st_dev == sb.st_dev && !hash_read(rfd, off, count, &state)) {
+                hash_set(ctx, fd, path + strlen(ctx->root) + 1, &state);
+            }
+            if (rfd >= 0) {
+                close(rfd);
             }
             close(fd);
-            sendmsg(ctx, 200, "wrote %d bytes", count);
+            index_update(ctx, path, &before);
+            logmsg(ctx, "put \"%s\": wrote %lu bytes at %lu with %s", path, (unsigned long)count, (unsigned long)off, how);
+            if (err) {
+                logmsg(ctx, "put write \"%s\": %s", path, strerror(err));
+                send_msg(ctx, 500, "put write: %s after %lu bytes", strerror(err), (unsigned long)count);
+            } else {
+                send_msg(ctx, 200, "wrote %lu bytes", (unsigned long)count);
+            }
         }
     }
 }
@@ -408,180 +1638,91 @@ void domkdir(context_t *ctx) {
                 name++;
             }
             if (name[0] == 0 || name[0] == '.' || strstr(name, "/.")) {
-                sendmsg(ctx, 400, "invalid path \"%s\"", name);
+                send_msg(ctx, 400, "invalid path \"%s\"", name);
                 return;
             } else {
-                char *path = calloc(strlen(ctx->root) + strlen(name) + 2, 1);
-                sprintf(path, "%s/%s", ctx->root, name);
-                if (!strstr(path, "/.")) {
-                    sendmsg(ctx, 400, "invalid path");
-                } else if (!access(path, F_OK)) {
+                struct stat before;
+                char *path = arena_printf(ctx, "%s/%s", ctx->root, name);
+                index_before(path, &before);
+                if (!access(path, F_OK)) {
                     logmsg(ctx, "mkdir \"%s\": path exists", path);
-                    sendmsg(ctx, 403, "mkdir: path exists");
+                    send_msg(ctx, 403, "mkdir: path exists");
                 } else if (mkdir(path, 0777)) {
                     logmsg(ctx, "mkdir \"%s\": %s", path, strerror(errno));
-                    sendmsg(ctx, 403, "mkdir: %s", strerror(errno));
+                    send_msg(ctx, 403, "mkdir: %s", strerror(errno));
                 } else {
-                    sendmsg(ctx, 200, "mkdir \"%s\"", name);
+                    index_update(ctx, path, &before);
+                    send_msg(ctx, 200, "mkdir \"%s\"", name);
                 }
                 return;
             }
         }
     }
-    sendmsg(ctx, 400, "missing path");
-}
-
-
-static strlist_t *free_strlist(strlist_t *n) {
-    if (n) {
-        strlist_t *start = n;
-        do {
-            free(n->value);
-            strlist_t *next = n->next;
-            free(n);
-            n = next;
-        } while (n && n != start);
-    }
-    return NULL;
+    send_msg(ctx, 400, "missing path");
 }
 
 /**
- * Traverse everything under "path" and add to end of list,
- * allocating if necessary. Files ending in "/" are directories.
- * If anything can't be traversed, send an error message and return null
- * returned list is a loop
+ * Run the command named by "path" - this is the PATH_INFO for a CGI, or the
+ * last segment of the request path for the HTTP server.
  */
-void traverse(context_t *ctx, const char *path, strlist_t **start, strlist_t **end) {
-    struct stat sb;
-    char *buf = calloc(strlen(ctx->root) + strlen(path) + 3, 1);
-    if (*path == 0) {
-        sprintf(buf, "%s", ctx->root);
-    } else {
-        sprintf(buf, "%s/%s", ctx->root, path);
-    }
-    if (stat(buf, &sb)) {
-        logmsg(ctx, "traverse stat \"%s\": %s", path, strerror(errno));
-        sendmsg(ctx, 500, "traverse stat \"%s\": %s", path, strerror(errno));
-        *start = *end = free_strlist(*start);
-    } else {
-        if (S_ISDIR(sb.st_mode)) {
-            DIR *dir = opendir(buf);
-            if (!dir) {
-                logmsg(ctx, "opendir \"%s\": %s", path, strerror(errno));
-                sendmsg(ctx, 500, "opendir \"%s\": %s", path, strerror(errno));
-                *start = *end = free_strlist(*start);
-            } else {
-                struct dirent *dp;
-                while ((dp = readdir(dir))) {
-                    if (strcmp(dp->d_name, ".") && strcmp(dp->d_name, "..")) {
-                        char *buf2 = calloc(strlen(path) + strlen(dp->d_name) + 2, 1);
-                        sprintf(buf2, "%s/%s", path, dp->d_name);
-                        traverse(ctx, buf2, start, end);
-                        free(buf2);
-                        if (!*end) {
-                            return;
-                        }
-                    }
-                }
-            }
-            buf[strlen(buf)] = '/';
-        }
-        strlist_t *next = calloc(sizeof(strlist_t), 1);
-        next->value = buf;
-        if (!*end) {
-            *start = *end = next;
+void dispatch(context_t *ctx, char *method, char *path) {
+    struct timespec start, end;
+    size_t inlen = ctx->inlen;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ctx->status = 0;
+    ctx->sent = 0;
+    if (strcmp("GET", method) && strcmp("POST", method)) {
+        send_msg(ctx, 405, "method \"%s\" invalid for \"%s\"", method, path + 1);
+    } else if (!strcmp("/info", path)) {
+        info(ctx);
+    } else if (!strcmp("/get", path)) {
+        get(ctx);
+    } else if (!strcmp("/mkdir", path) && !strcmp("POST", method)) {
+        domkdir(ctx);
+    } else if (!strcmp("/delete", path)) {
+        delete(ctx);
+    } else if (!strcmp("/move", path) && !strcmp("POST", method)) {
+        move(ctx);
+    } else if (!strcmp("/copy", path) && !strcmp("POST", method)) {
+        copy(ctx);
+    } else if (!strcmp("/tree", path)) {
+        tree(ctx);
+    } else if (!strcmp("/bulk", path) && !strcmp("POST", method)) {
+        bulk(ctx);
+    } else if (!strcmp("/have", path) && !strcmp("POST", method)) {
+        have(ctx);
+    } else if (!strcmp("/upload", path)) {
+        upload(ctx, !strcmp("POST", method));
+    } else if (!strcmp("/watch", path)) {
+        watch(ctx);
+    } else if (!strcmp("/stats", path)) {
+        stats(ctx);
+    } else if (!strcmp("/put", path) && !strcmp("POST", method)) {
+        if (!strcmp("POST", method)) {
+            put(ctx);
         } else {
-            (*end)->next = next;
-            *end = next;
-        }
-    }
-}
-
-void delete(context_t *ctx) {
-    strlist_t *names = NULL, *names_end = NULL;
-
-    for (char **q=ctx->query;*q;) {
-        char *qkey = *q++;
-        char *qval = *q++;
-        if (!strcmp(qkey, "path") && qval) {
-            const char *name = qval;
-            if (name[0] == '/') {
-                name++;
-            }
-            if (name[0] == 0 || name[0] == '.' || strstr(name, "/.")) {
-                sendmsg(ctx, 400, "invalid path \"%s\"", name);
-                return;
-            } else {
-                traverse(ctx, name, &names, &names_end);
-            }
-        }
-    }
-    for (strlist_t *n=names;n;n=n->next) {
-        char *path = n->value;
-        char *relpath = path + strlen(ctx->root) + 1;
-        if (path[strlen(path) - 1] == '/') {    // directory
-            path[strlen(path) - 1] = 0;
-            if (access(path, R_OK|X_OK|W_OK)) {
-                logmsg(ctx, "delete access dir \"%s\": not writable", path);
-                sendmsg(ctx, 403, "delete not writable \"%s\"", relpath);
-                names = free_strlist(names);
-                break;
-            }
-            path[strlen(path)] = '/';
-        } else if (strstr(relpath, "/.")) {     // directory contains .file
-            *(rindex(relpath, '/')) = 0;
-            sendmsg(ctx, 400, "directory not empty \"%s\"", relpath);
-            names = free_strlist(names);
-            break;
-        } else if (access(path, R_OK|W_OK)) {
-            logmsg(ctx, "delete access file \"%s\": not writable", path);
-            sendmsg(ctx, 400, "delete not writable \"%s\"", relpath);
-            names = free_strlist(names);
-            break;
-        }
-    }
-    if (names) {
-        json_t *a = json_array();
-        for (strlist_t *n=names;n;n=n->next) {
-            char *path = n->value;
-            char *relpath = path + strlen(ctx->root) + 1;
-            if (path[strlen(path) - 1] == '/') {    // directory
-                if (rmdir(path)) {
-                    logmsg(ctx, "rmdir \"%s\": %s", path, strerror(errno));
-                    sendmsg(ctx, 500, "rmdir \"%s\": %s", relpath, strerror(errno));
-                    names = free_strlist(names);
-                    json_decref(a);
-                    break;
-                } else {
-                    json_array_append_new(a, json_string(relpath));
-                }
-            } else {
-                if (unlink(path)) {
-                    logmsg(ctx, "unlink \"%s\": %s", path, strerror(errno));
-                    sendmsg(ctx, 500, "unlink \"%s\": %s", relpath, strerror(errno));
-                    names = free_strlist(names);
-                    json_decref(a);
-                    break;
-                } else {
-                    json_array_append_new(a, json_string(relpath));
-                }
-            }
-        }
-        if (names) {
-            json_t *o = json_object();
-            json_object_set_new(o, "ok", json_true());
-            json_object_set_new(o, "paths", a);
-            send(ctx, 200, o);
-            names = free_strlist(names);
-            json_decref(o);
+            send_msg(ctx, 405, "method \"%s\" invalid for \"%s\"", method, path + 1);
         }
+    } else {
+        send_msg(ctx, 404, "invalid script path \"%s\"", path);
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    size_t received = inlen == SIZE_MAX ? 0 : inlen - ctx->inlen;
+    stats_record(ctx, path, ctx->status, usec, ctx->sent + received);
+    logat(ctx, LOG_DEBUG, "done %s %d in %lluus, sent %zu received %zu", path, ctx->status, (unsigned long long)usec, ctx->sent, received);
 }
 
 int main(int argc, char **argv) {
     context_t *ctx = calloc(sizeof(context_t), 1);
+    ctx->arena = arena_new();
     ctx->root = ROOT;
     ctx->log = LOG;
+    ctx->out = stdout;
+    ctx->outfd = STDOUT_FILENO;
+    ctx->infd = STDIN_FILENO;
+    ctx->inlen = SIZE_MAX;
+    ctx->loglevel = LOG_INFO;
     if (ctx->root && !*ctx->root) {
         ctx->root = NULL;
     }
@@ -597,6 +1738,8 @@ int main(int argc, char **argv) {
     char *method = getenv("REQUEST_METHOD");
     char *path = getenv("PATH_INFO");
     char *querystring = getenv("QUERY_STRING");
+    char *listen = NULL;
+    int threads = 0;
     struct stat sb;
 //    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
 
@@ -605,6 +1748,14 @@ int main(int argc, char **argv) {
             ctx->root = argv[++i];
         } else if (!strcmp(argv[i], "--log") && i + 1 < argc) {
             ctx->log = argv[++i];
+        } else if (!strcmp(argv[i], "--loglevel") && i + 1 < argc && log_level(argv[i + 1]) >= 0) {
+            ctx->loglevel = log_level(argv[++i]);
+        } else if (!strcmp(argv[i], "--listen") && i + 1 < argc) {
+            listen = argv[++i];
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--io") && i + 1 < argc && (!strcmp(argv[i + 1], "uring") || !strcmp(argv[i + 1], "sync"))) {
+            ctx->uring = !strcmp(argv[++i], "uring");
         } else if (!strcmp(argv[i], "--method") && i + 1 < argc) {
             method = argv[++i];
         } else if (!strcmp(argv[i], "--path") && i + 1 < argc) {
@@ -612,60 +1763,47 @@ int main(int argc, char **argv) {
         } else if (!strcmp(argv[i], "--query") && i + 1 < argc) {
             querystring = argv[++i];
         } else {
-            sendmsg(ctx, 500, "unknown argument \"%s\"", argv[i]);
+            send_msg(ctx, 500, "unknown argument \"%s\"", argv[i]);
             return 0;
         }
     }
-    if (!method) {
+    if (!method && !listen) {
         help(ctx);
     } else if (!ctx->root) {
-        sendmsg(ctx, 500, "root directory not specified");
+        send_msg(ctx, 500, "root directory not specified");
         return 0;
-    } else if (!path) {
-        sendmsg(ctx, 500, "path not specified");
+    } else if (!path && !listen) {
+        send_msg(ctx, 500, "path not specified");
         return 0;
-    } else {
+    } else if (!listen) {
         logmsg(ctx, "rx: path=%s query=%s", path, querystring);
     }
-    ctx->query = parse_querystring(querystring);
     if (ctx->root[strlen(ctx->root) - 1] == '/') {
         ctx->root[strlen(ctx->root) - 1] = 0;
     }
-    if (!chroot(ctx->root)) {
+    if (!chroot(ctx->root) && !chdir("/")) {
         ctx->root = "";     // chroot if we can
     }
-    if (stat(ctx->root, &sb)) {
-        logmsg(ctx, "init stat \"%s\": %s", path, strerror(errno));
-        sendmsg(ctx, 500, "root stat: \"%s\"", strerror(errno));
+    if (stat(*ctx->root ? ctx->root : "/", &sb)) {
+        logmsg(ctx, "init stat \"%s\": %s", ctx->root, strerror(errno));
+        send_msg(ctx, 500, "root stat: \"%s\"", strerror(errno));
         return 0;
     } else if (!S_ISDIR(sb.st_mode)) {
-        sendmsg(ctx, 500, "root directory \"%s\" is not a directory", ctx->root);
+        send_msg(ctx, 500, "root directory \"%s\" is not a directory", ctx->root);
         return 0;
     }
 
-    if (strcmp("GET", method) && strcmp("POST", method)) {
-        sendmsg(ctx, 405, "method \"%s\" invalid for \"%s\"", method, path + 1);
-        return 0;
-    } else if (!strcmp("/info", path)) {
-        info(ctx);
-    } else if (!strcmp("/get", path)) {
-        get(ctx);
-    } else if (!strcmp("/mkdir", path) && !strcmp("POST", method)) {
-        domkdir(ctx);
-    } else if (!strcmp("/delete", path)) {
-        delete(ctx);
-    } else if (!strcmp("/put", path) && !strcmp("POST", method)) {
-        if (!strcmp("POST", method)) {
-            put(ctx);
-        } else {
-            sendmsg(ctx, 405, "method \"%s\" invalid for \"%s\"", method, path + 1);
-        }
-    } else {
-        sendmsg(ctx, 404, "invalid script path \"%s\"", path);
+    if (listen) {
+        return httpd(ctx, listen, threads);
     }
-    for (char **q=ctx->query;*q;q++) {
-        free(*q);
+    if (getenv("CONTENT_LENGTH") && *getenv("CONTENT_LENGTH")) {
+        ctx->inlen = strtoul(getenv("CONTENT_LENGTH"), NULL, 10);
+    } else if (method && strcmp(method, "POST")) {
+        ctx->inlen = 0;         // only a POST without a length is read to EOF
     }
-    free(ctx->query);
+    ctx->query = parse_querystring(ctx, querystring);
+    ctx->headers = parse_environ(ctx);
+    dispatch(ctx, method, path);
+    arena_free(ctx->arena);
     free(ctx);
 }
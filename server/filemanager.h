@@ -0,0 +1,183 @@
+#ifndef FILEMANAGER_H
+#define FILEMANAGER_H
+
+#include <jansson.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <pthread.h>
+
+typedef struct arena arena_t;
+
+typedef struct context {
+    char *root;
+    char *log;
+    char **query;           // [key,value,key,value,...,0]
+    char **headers;         // [name,value,name,value,...,0], names are lower case
+    FILE *out;              // the response is written here
+    int outfd;              // descriptor behind "out", flush "out" before writing to it
+    int infd;               // the request body is read from here
+    char *inbuf;            // request body bytes that were read along with the headers
+    size_t inbuflen;
+    size_t inlen;           // request body bytes remaining, or SIZE_MAX to read until EOF
+    int http;               // non-zero if we are the HTTP server rather than a CGI
+    int keepalive;          // HTTP only, keep the connection open after this response
+    int chunked;            // HTTP only, the client accepts a chunked response
+    int uring;              // move file data with io_uring, see uring.c
+    int loglevel;           // log messages at this level or more urgent, a syslog priority
+    int status;             // the response status, once it's been sent
+    size_t sent;            // response body bytes sent, for stats
+    arena_t *arena;         // memory for the request, see arena.c
+} context_t;
+
+#define JSONW_BUFSIZE 16384
+#define COMPRESSMIN 1024        // responses smaller than this aren't worth compressing
+
+#define ENC_IDENTITY 0          // content encodings
+#define ENC_GZIP 1
+#define ENC_ZSTD 2
+#define ENC_CONTINUE 0          // modes for encoder_write()
+#define ENC_FLUSH 1
+#define ENC_END 2
+
+typedef struct encoder encoder_t;
+typedef void (*encout_t)(void *arg, const void *data, size_t len);
+
+typedef struct jsonw {
+    context_t *ctx;
+    int code;
+    int sent;               // the headers have been sent, so the response can't change
+    int comma;              // the next key or value needs a comma before it
+    size_t len;             // bytes in buf
+    size_t total;           // bytes sent from buf
+    const char *headers;    // more response headers, each ending "\r\n", or NULL
+    int encoding;           // the encoding the client accepts
+    encoder_t *enc;         // compressing the response, once it's begun to be sent
+    char buf[JSONW_BUFSIZE];
+} jsonw_t;
+
+arena_t *arena_new(void);
+void arena_reset(arena_t *a);
+void arena_free(arena_t *a);
+void *arena_alloc(context_t *ctx, size_t len);
+char *arena_strdup(context_t *ctx, const char *s);
+char *arena_strndup(context_t *ctx, const char *s, size_t len);
+char *arena_vprintf(context_t *ctx, const char *fmt, va_list va);
+char *arena_printf(context_t *ctx, const char *fmt, ...);
+
+void logmsg(context_t *ctx, char *fmt, ...);
+void logat(context_t *ctx, int level, char *fmt, ...);
+void log_flush(void);
+int log_level(const char *name);
+void stats_record(context_t *ctx, const char *path, int code, uint64_t usec, uint64_t bytes);
+void stats(context_t *ctx);
+char **parse_querystring(context_t *ctx, char *s);
+char *getheader(context_t *ctx, const char *name);
+ssize_t read_body(context_t *ctx, void *buf, size_t len);
+char *read_body_all(context_t *ctx, size_t max, size_t *len);
+int copyin(context_t *ctx, int fd, off_t off, size_t max, size_t *count, const char **how);
+size_t copyout(context_t *ctx, int fd, off_t off, size_t len, const char **how);
+void get_archive(context_t *ctx, const char *path, const char *name);
+void send_status(context_t *ctx, int code);
+void send_json(context_t *ctx, int code, json_t *json);
+void send_msg(context_t *ctx, int code, char *fmt, ...);
+void dispatch(context_t *ctx, char *method, char *path);
+char *statepath(context_t *ctx, const char *sub, const char *name);
+void statehash(const char *name, char *id);
+#define FNVINIT 0xcbf29ce484222325ULL
+uint64_t fnv1a(uint64_t h, const void *data, size_t len);
+void mkparents(char *path);
+int canaccess(struct stat *sb, int mode);
+int kidstat(int dfd, struct dirent *dp, struct stat *sb);
+void stat_write(jsonw_t *w, const char *key, const char *value, struct stat *sb, int readonly);
+
+void put_session(context_t *ctx, char *path, const char *name, size_t off, size_t length);
+void upload(context_t *ctx, int post);
+
+typedef struct xxh64 {
+    uint64_t v[4];
+    uint64_t total;         // bytes hashed
+    unsigned char buf[32];  // the last stripe, until it's complete
+    uint32_t buflen;
+} xxh64_t;
+void xxh64_init(xxh64_t *s);
+void xxh64_update(xxh64_t *s, const void *data, size_t len);
+uint64_t xxh64_digest(const xxh64_t *s);
+int hash_get(int fd, const struct stat *sb, xxh64_t *state);
+int hash_read(int fd, off_t off, size_t len, xxh64_t *state);
+void hash_set(context_t *ctx, int fd, const char *relpath, const xxh64_t *state);
+int hash_file(context_t *ctx, int fd, const struct stat *sb, const char *relpath, uint64_t *hash);
+void have(context_t *ctx);
+
+typedef struct pooljob {
+    struct pooljob *next;   // in the queue
+} pooljob_t;
+
+typedef struct pool {
+    pthread_mutex_t lock;   // guards the queue, and anything the jobs share
+    pthread_cond_t cond;
+    pooljob_t *queue;
+    int active;             // jobs being run
+    void (*run)(void *arg, pooljob_t *job);         // called without the lock
+    void (*finish)(void *arg, pooljob_t *job);      // then with it
+    void *arg;
+} pool_t;
+void pool_init(pool_t *pool, void (*run)(void *, pooljob_t *), void (*finish)(void *, pooljob_t *), void *arg);
+void pool_destroy(pool_t *pool);
+void pool_add(pool_t *pool, pooljob_t *job);
+void pool_run(pool_t *pool, pooljob_t *job, int threads);
+
+void delete(context_t *ctx);
+void move(context_t *ctx);
+void copy(context_t *ctx);
+int copy_data(int from, int to, size_t len);
+void tree(context_t *ctx);
+void watch(context_t *ctx);
+void bulk(context_t *ctx);
+
+typedef struct dirindex dirindex_t;
+dirindex_t *index_open(context_t *ctx, int dfd, const char *relpath);
+uint64_t index_gen(dirindex_t *ix);
+uint64_t index_version(dirindex_t *ix);
+size_t index_next(dirindex_t *ix, size_t *pos, const char **name, struct stat *sb);
+int index_valid(dirindex_t *ix, size_t pos);
+void index_close(dirindex_t *ix);
+void index_before(const char *path, struct stat *before);
+void index_update(context_t *ctx, const char *path, const struct stat *before);
+void index_forget(context_t *ctx, const char *relpath);
+void index_forget_tree(context_t *ctx, const char *relpath);
+
+int accept_encoding(context_t *ctx);
+const char *encoding_name(int encoding);
+encoder_t *encoder_new(int encoding, int best);
+int encoder_write(encoder_t *e, const void *data, size_t len, int mode, encout_t out, void *arg);
+void encoder_free(encoder_t *e);
+int compressible(int fd, off_t size);
+int compressed_file(context_t *ctx, int fd, const char *relpath, const struct stat *sb, int encoding, off_t *size);
+void compressed_forget(context_t *ctx, const char *relpath);
+
+void jw_start(jsonw_t *w, context_t *ctx, int code);
+void jw_object(jsonw_t *w);
+void jw_object_end(jsonw_t *w);
+void jw_array(jsonw_t *w);
+void jw_array_end(jsonw_t *w);
+void jw_key(jsonw_t *w, const char *key);
+void jw_string(jsonw_t *w, const char *s);
+void jw_integer(jsonw_t *w, long long v);
+void jw_boolean(jsonw_t *w, int v);
+void jw_value(jsonw_t *w, json_t *json);
+void jw_flush(jsonw_t *w);
+int jw_discard(jsonw_t *w);
+size_t jw_end(jsonw_t *w);
+
+int uring_copyout(context_t *ctx, int fd, off_t off, size_t len, size_t *sent);
+int uring_copyin(context_t *ctx, int fd, off_t off, size_t max, size_t *count);
+
+int httpd(context_t *ctx, char *listen, int threads);
+
+#endif
@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <fcntl.h>
+
+#define HASHATTR "user.filemanager.hash"   // extended attribute holding a file's hash
+#define HAVEBODY (16<<20)                   // largest request body for "have"
+
+/*
+ * Each file's content is identified by its length and XXH64 hash, so a
+ * client can tell which of its files the server already has. The hash is
+ * kept in an extended attribute on the file along with the length and
+ * mtime it was computed for, and is recomputed when those no longer match.
+ * The attribute holds the hash's running state rather than just its value,
+ * so put can carry it on as a file is appended to, reading each chunk back
+ * from the page cache after it's written rather than from the request (so
+ * the body can still be spliced to the file).
+ *
+ * The most recent file with each hash is noted in STATEDIR/hash, named for
+ * the hash, so "have" can copy it for a file the client would otherwise
+ * upload. The copy is a reflink where the filesystem supports one, so the
+ * content is only stored once. Hardlinks are not used as put rewrites
+ * files in place, which would change both.
+ */
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+typedef struct hashattr {
+    uint64_t size;          // of the file when the hash was stored
+    int64_t mtime;          // in nanoseconds
+    xxh64_t state;
+} hashattr_t;
+
+static uint64_t rotl(uint64_t v, int r) {
+    return (v << r) | (v >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;       // little-endian hosts only, like the rest of our file formats
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    return rotl(acc + input * P2, 31) * P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+    return (acc ^ xxh_round(0, v)) * P1 + P4;
+}
+
+void xxh64_init(xxh64_t *s) {
+    memset(s, 0, sizeof(*s));
+    s->v[0] = P1 + P2;
+    s->v[1] = P2;
+    s->v[2] = 0;
+    s->v[3] = -P1;
+}
+
+void xxh64_update(xxh64_t *s, const void *data, size_t len) {
+    const unsigned char *p = data;
+    s->total += len;
+    if (s->buflen + len < 32) {
+        memcpy(s->buf + s->buflen, p, len);
+        s->buflen += len;
+        return;
+    }
+    if (s->buflen) {
+        size_t n = 32 - s->buflen;
+        memcpy(s->buf + s->buflen, p, n);
+        for (int i=0;i<4;i++) {
+            s->v[i] = xxh_round(s->v[i], read64(s->buf + i * 8));
+        }
+        p += n;
+        len -= n;
+        s->buflen = 0;
+    }
+    uint64_t v0 = s->v[0], v1 = s->v[1], v2 = s->v[2], v3 = s->v[3];
+    for (;len >= 32;p+=32,len-=32) {
+        v0 = xxh_round(v0, read64(p));
+        v1 = xxh_round(v1, read64(p + 8));
+        v2 = xxh_round(v2, read64(p + 16));
+        v3 = xxh_round(v3, read64(p + 24));
+    }
+    s->v[0] = v0;
+    s->v[1] = v1;
+    s->v[2] = v2;
+    s->v[3] = v3;
+    memcpy(s->buf, p, len);
+    s->buflen = len;
+}
+
+uint64_t xxh64_digest(const xxh64_t *s) {
+    uint64_t h;
+    if (s->total >= 32) {
+        h = rotl(s->v[0], 1) + rotl(s->v[1], 7) + rotl(s->v[2], 12) + rotl(s->v[3], 18);
+        for (int i=0;i<4;i++) {
+            h = xxh_merge(h, s->v[i]);
+        }
+    } else {
+        h = P5;
+    }
+    h += s->total;
+    const unsigned char *p = s->buf, *end = s->buf + s->buflen;
+    for (;p+8<=end;p+=8) {
+        h = rotl(h ^ xxh_round(0, read64(p)), 27) * P1 + P4;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        h = rotl(h ^ (v * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (;p<end;p++) {
+        h = rotl(h ^ (*p * P5), 11) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static int64_t mtime_ns(const struct stat *sb) {
+    return (int64_t)sb->st_mtim.tv_sec * 1000000000 + sb->st_mtim.tv_nsec;
+}
+
+/**
+ * Set *state to the stored hash state of the file fd, which has the stat
+ * sb. Return 0 if there is one and it's still current
+ */
+int hash_get(int fd, const struct stat *sb, xxh64_t *state) {
+    hashattr_t a;
+    if (fgetxattr(fd, HASHATTR, &a, sizeof(a)) != sizeof(a) || a.size != (uint64_t)sb->st_size || a.mtime != mtime_ns(sb) || a.state.total != a.size) {
+        return -1;
+    }
+    *state = a.state;
+    return 0;
+}
+
+/**
+ * Add len bytes at off of the file fd to state. Return 0 on success
+ */
+int hash_read(int fd, off_t off, size_t len, xxh64_t *state) {
+    char buf[65536];
+    while (len) {
+        ssize_t l = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), off);
+        if (l <= 0) {
+            if (l < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        xxh64_update(state, buf, l);
+        off += l;
+        len -= l;
+    }
+    return 0;
+}
+
+/**
+ * Store state as the hash of the whole of the file fd, whose path relative
+ * to the root is relpath, and note it as the file with that content. If
+ * relpath is NULL it's stored but not noted
+ */
+void hash_set(context_t *ctx, int fd, const char *relpath, const xxh64_t *state) {
+    struct stat sb;
+    hashattr_t a;
+    char id[17];
+    if (fstat(fd, &sb) || state->total != (uint64_t)sb.st_size) {
+        return;
+    }
+    memset(&a, 0, sizeof(a));
+    a.size = sb.st_size;
+    a.mtime = mtime_ns(&sb);
+    a.state = *state;
+    if (fsetxattr(fd, HASHATTR, &a, sizeof(a), 0)) {
+        return;     // no xattrs here: computed again each time it's needed
+    }
+    sprintf(id, "%016llx", (unsigned long long)xxh64_digest(state));
+    char *path = relpath ? statepath(ctx, "hash", id) : NULL;
+    if (path) {
+        char *tmp = malloc(strlen(path) + 8);
+        sprintf(tmp, "%s.XXXXXX", path);
+        int tfd = mkstemp(tmp);
+        if (tfd >= 0) {
+            size_t len = strlen(relpath);
+            int ok = write(tfd, relpath, len) == (ssize_t)len;
+            close(tfd);
+            if (!ok || rename(tmp, path)) {
+                unlink(tmp);
+            }
+        }
+        free(tmp);
+        free(path);
+    }
+}
+
+/**
+ * Set *hash to the hash of the file fd, with the stat sb, computing and
+ * storing it if it's not current. Return 0 on success
+ */
+int hash_file(context_t *ctx, int fd, const struct stat *sb, const char *relpath, uint64_t *hash) {
+    xxh64_t state;
+    if (hash_get(fd, sb, &state)) {
+        xxh64_init(&state);
+        if (hash_read(fd, 0, sb->st_size, &state)) {
+            return -1;
+        }
+        hash_set(ctx, fd, relpath, &state);
+    }
+    *hash = xxh64_digest(&state);
+    return 0;
+}
+
+/**
+ * Try to write "path" by copying the file we have with the same length and
+ * hash. Return 0 if it was copied
+ */
+static int have_copy(context_t *ctx, const char *path, size_t length, uint64_t hash) {
+    char id[17], rel[PATH_MAX + 1];
+    struct stat sb, before;
+    xxh64_t state;
+    int ret = -1;
+    sprintf(id, "%016llx", (unsigned long long)hash);
+    char *note = statepath(ctx, "hash", id);
+    int nfd = note ? open(note, O_RDONLY|O_CLOEXEC) : -1;
+    ssize_t l = nfd < 0 ? -1 : read(nfd, rel, PATH_MAX);
+    free(note);
+    if (nfd >= 0) {
+        close(nfd);
+    }
+    if (l <= 0) {
+        return -1;
+    }
+    rel[l] = 0;
+    char *from = malloc(strlen(ctx->root) + l + 2);
+    sprintf(from, "%s/%s", ctx->root, rel);
+    int fd = open(from, O_RDONLY|O_CLOEXEC);
+    // It must still have that content, as far as we know, and not be the file itself
+    if (fd >= 0 && !fstat(fd, &sb) && S_ISREG(sb.st_mode) && (size_t)sb.st_size == length && !hash_get(fd, &sb, &state) && xxh64_digest(&state) == hash && strcmp(from, path)) {
+        mkparents((char *)path);
+        index_before(path, &before);
+        int tfd = open(path, O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, 0666);
+        if (tfd < 0) {
+            logmsg(ctx, "have open \"%s\": %s", path, strerror(errno));
+        } else if (copy_data(fd, tfd, length) < 0) {
+            logmsg(ctx, "have copy \"%s\": %s", path, strerror(errno));
+            ftruncate(tfd, 0);
+        } else {
+            hash_set(ctx, tfd, path + strlen(ctx->root) + 1, &state);
+            logmsg(ctx, "have \"%s\": copied %lu bytes from \"%s\"", path, (unsigned long)length, from);
+            ret = 0;
+        }
+        if (tfd >= 0) {
+            close(tfd);
+            index_update(ctx, path, &before);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(from);
+    return ret;
+}
+
+/**
+ * Say which of a list of files we already have, so the client needn't
+ * upload them. Each file is given as "path", "length" and "hash" (16 hex
+ * digits of XXH64), in the query or in a form-encoded POST body as there
+ * may be many. Each is reported "same" if the file is there with that
+ * content, "copied" if it wasn't but another file had that content and has
+ * been copied to it, or "missing" otherwise
+ */
+void have(context_t *ctx) {
+    char **body = NULL, *s = NULL;
+    size_t len;
+    if (ctx->inlen && !(s=read_body_all(ctx, HAVEBODY, &len))) {
+        send_msg(ctx, 413, "request body over %d bytes", HAVEBODY);
+        return;
+    } else if (s) {
+        body = parse_querystring(ctx, s);
+    }
+
+    jsonw_t w;
+    const char *path = NULL, *error = NULL;
+    size_t length = SIZE_MAX, same = 0, copied = 0, missing = 0;
+    uint64_t hash = 0;
+    int hashed = 0;
+    jw_start(&w, ctx, 200);
+    jw_object(&w);
+    jw_key(&w, "paths");
+    jw_array(&w);
+    for (int pass=0;pass<2 && !error;pass++) {
+        char **q = pass ? body : ctx->query;
+        while (q && *q && !error) {
+            char *qkey = *q++;
+            char *qval = *q++;
+            char *c;
+            if (!strcmp(qkey, "path")) {
+                path = qval + (*qval == '/');
+                length = SIZE_MAX;
+                hashed = 0;
+                if (path[0] == 0 || path[0] == '.' || strstr(path, "/.")) {
+                    error = "invalid path";
+                }
+            } else if (!strcmp(qkey, "length")) {
+                length = strtoull(qval, &c, 10);
+                if (*c || !*qval) {
+                    error = "invalid length";
+                }
+            } else if (!strcmp(qkey, "hash")) {
+                hash = strtoull(qval, &c, 16);
+                hashed = 1;
+                if (*c || strlen(qval) != 16) {
+                    error = "invalid hash";
+                }
+            }
+            if (!error && path && length != SIZE_MAX && hashed) {
+                struct stat sb;
+                uint64_t h;
+                const char *result = "missing";
+                char *full = arena_printf(ctx, "%s/%s", ctx->root, path);
+                int fd = open(full, O_RDONLY|O_NONBLOCK|O_CLOEXEC);     // not blocking on a FIFO or device
+                if (fd >= 0 && !fstat(fd, &sb) && S_ISREG(sb.st_mode) && (size_t)sb.st_size == length && !hash_file(ctx, fd, &sb, path, &h) && h == hash) {
+                    result = "same";
+                    same++;
+                } else if ((fd < 0 || (!fstat(fd, &sb) && S_ISREG(sb.st_mode) && !access(full, W_OK))) && !have_copy(ctx, full, length, hash)) {
+                    result = "copied";
+                    copied++;
+                } else {
+                    missing++;
+                }
+                if (fd >= 0) {
+                    close(fd);
+                }
+                jw_object(&w);
+                jw_key(&w, "path");
+                jw_string(&w, path);
+                jw_key(&w, "have");
+                jw_string(&w, result);
+                jw_object_end(&w);
+                path = NULL;
+            }
+        }
+    }
+    if (error && jw_discard(&w)) {
+        send_msg(ctx, 400, "%s", error);
+        return;
+    }
+    jw_array_end(&w);
+    jw_key(&w, "ok");
+    jw_boolean(&w, !error);
+    if (error) {
+        jw_key(&w, "msg");
+        jw_string(&w, error);
+    }
+    jw_object_end(&w);
+    logmsg(ctx, "tx 200 have: %lu same, %lu copied, %lu missing, in %lu bytes", (unsigned long)same, (unsigned long)copied, (unsigned long)missing, (unsigned long)jw_end(&w));
+}
@@ -0,0 +1,473 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * A standalone HTTP/1.1 server, so the handlers can be run without a process
+ * per request. One thread owns an epoll loop which accepts connections and
+ * reads request headers; once a full set of headers has arrived the connection
+ * is handed to a pool of worker threads which run the request with the same
+ * handlers as the CGI, on a blocking socket. Keep-alive connections go back
+ * to the epoll loop when the response is complete.
+ */
+
+#define HEADERMAX 16384         // maximum size of request line and headers
+#define MAXHEADERS 100          // maximum number of request headers
+#define IDLETIMEOUT 30          // seconds an idle keep-alive connection is kept
+#define HEADERTIMEOUT 10        // seconds from the start of a request to the end of its headers
+#define MAXCONNS 1024           // open connections; more wait in the listen queue
+#define IOTIMEOUT 60            // seconds a worker will wait on a stalled client
+#define CPUTHREADS 16           // default workers for each CPU, as a worker blocks on a slow client
+#define MINTHREADS 64           // and at least this many
+#define DRAINMAX 65536          // unread request body we'll discard to keep a connection
+
+typedef struct conn {
+    int fd;
+    FILE *out;
+    size_t len;                 // bytes in buf
+    time_t idle;                // when the connection went idle, or the request began
+    struct conn *prev, *next;   // in the idle list, or the work queue
+    char buf[HEADERMAX];
+} conn_t;
+
+typedef struct server {
+    context_t *ctx;             // the template for each request context
+    int epfd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    conn_t *head, *tail;        // the work queue
+    conn_t *idle;               // connections waiting in the epoll loop
+    int conns;                  // open connections
+    int lfd;
+    time_t paused;              // when we stopped accepting, or 0
+} server_t;
+
+static void conn_close(server_t *server, conn_t *conn) {
+    fclose(conn->out);          // closes fd
+    free(conn);
+    __atomic_sub_fetch(&server->conns, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Stop polling the listening socket for a while: we're out of file
+ * descriptors or at MAXCONNS, and as it stays readable the loop would spin
+ */
+static void accept_pause(server_t *server) {
+    if (!server->paused) {
+        epoll_ctl(server->epfd, EPOLL_CTL_DEL, server->lfd, NULL);
+        server->paused = time(NULL);
+    }
+}
+
+/**
+ * Put the connection back in the epoll loop to wait for the next request,
+ * or the rest of this one. The timeout runs from when it went idle or the
+ * request began, so a request can't be kept open by trickling it in
+ */
+static void conn_idle(server_t *server, conn_t *conn, int restart) {
+    pthread_mutex_lock(&server->lock);
+    if (restart) {
+        conn->idle = time(NULL);
+    }
+    conn->prev = NULL;
+    conn->next = server->idle;
+    if (conn->next) {
+        conn->next->prev = conn;
+    }
+    server->idle = conn;
+    struct epoll_event ev;
+    ev.events = EPOLLIN|EPOLLRDHUP|EPOLLONESHOT;
+    ev.data.ptr = conn;
+    epoll_ctl(server->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+    pthread_mutex_unlock(&server->lock);     // so the idle sweep can't close it first
+}
+
+/**
+ * Remove the connection from the idle list; call with the lock held
+ */
+static void conn_unidle(server_t *server, conn_t *conn) {
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        server->idle = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    conn->prev = conn->next = NULL;
+}
+
+/**
+ * Return the length of the request line and headers in buf, including
+ * the blank line that ends them, or 0 if they're not complete
+ */
+static size_t header_length(char *buf, size_t len) {
+    for (size_t i=3;i<len;i++) {
+        if (buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\n' && buf[i - 3] == '\r') {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static char *trim(char *s) {
+    while (*s == ' ' || *s == '\t') {
+        s++;
+    }
+    char *e = s + strlen(s);
+    while (e > s && (e[-1] == ' ' || e[-1] == '\t')) {
+        *--e = 0;
+    }
+    return s;
+}
+
+/**
+ * Run one request from the start of conn->buf, which must contain complete
+ * headers. Return non-zero if the connection can be reused
+ */
+static int handle(server_t *server, conn_t *conn, arena_t *arena) {
+    context_t ctx = *server->ctx;
+    char *headers[MAXHEADERS * 2 + 1];
+    int code = 0;
+    char *method = NULL, *target = NULL, *version = NULL;
+    size_t hlen = header_length(conn->buf, conn->len);
+
+    ctx.http = 1;
+    ctx.out = conn->out;
+    ctx.outfd = conn->fd;
+    ctx.infd = conn->fd;
+    ctx.inlen = 0;
+    ctx.keepalive = 0;
+    ctx.chunked = 0;
+    ctx.headers = headers;
+    ctx.query = NULL;
+    ctx.arena = arena;
+    headers[0] = NULL;
+
+    if (!hlen) {
+        code = 431;
+    } else {
+        conn->buf[hlen - 2] = 0;
+        char *line = conn->buf, *next;
+        int count = 0;
+        for (;line && *line;line=next) {
+            next = strstr(line, "\r\n");
+            if (next) {
+                *next = 0;
+                next += 2;
+            }
+            if (!method) {
+                method = line;
+                if ((target = strchr(method, ' ')) && (version = strchr(++target, ' '))) {
+                    *(target - 1) = 0;
+                    *version++ = 0;
+                }
+            } else {
+                char *colon = strchr(line, ':');
+                if (!colon || colon == line || count == MAXHEADERS) {
+                    code = count == MAXHEADERS ? 431 : 400;
+                    break;
+                }
+                *colon = 0;
+                for (char *c=line;*c;c++) {
+                    *c = tolower(*c);
+                }
+                headers[count * 2] = line;
+                headers[count * 2 + 1] = trim(colon + 1);
+                headers[++count * 2] = NULL;
+            }
+        }
+        if (code) {
+            // already failed
+        } else if (!version || *target != '/') {
+            code = 400;
+        } else if (strcmp(version, "HTTP/1.1") && strcmp(version, "HTTP/1.0")) {
+            code = 505;
+        } else {
+            char *connection = getheader(&ctx, "connection");
+            if (!strcmp(version, "HTTP/1.1")) {
+                ctx.keepalive = !connection || strcasecmp(connection, "close");
+                ctx.chunked = 1;
+            } else {
+                ctx.keepalive = connection && !strcasecmp(connection, "keep-alive");
+            }
+            char *length = getheader(&ctx, "content-length");
+            if (getheader(&ctx, "transfer-encoding")) {
+                code = 411;
+            } else if (length) {
+                char *e;
+                ctx.inlen = strtoul(length, &e, 10);
+                if (*e || !*length) {
+                    code = 400;
+                }
+            }
+        }
+    }
+
+    ctx.inbuf = conn->buf + hlen;
+    ctx.inbuflen = conn->len - hlen < ctx.inlen ? conn->len - hlen : ctx.inlen;
+    if (code) {
+        ctx.keepalive = 0;
+        if (!hlen) {
+            logmsg(&ctx, "rx: request headers too large");
+        } else {
+            logmsg(&ctx, "rx: invalid request \"%s\"", method ? method : "");
+        }
+        send_msg(&ctx, code, NULL);
+    } else {
+        char *querystring = strchr(target, '?');
+        if (querystring) {
+            *querystring++ = 0;
+        }
+        char *path = strrchr(target, '/');    // the command is the last path segment
+        char *expect = getheader(&ctx, "expect");
+        if (expect && !strcasecmp(expect, "100-continue") && ctx.inlen > ctx.inbuflen) {
+            fputs("HTTP/1.1 100 Continue\r\n\r\n", ctx.out);
+            fflush(ctx.out);
+        }
+        logmsg(&ctx, "rx: path=%s query=%s", path, querystring);
+        ctx.query = parse_querystring(&ctx, querystring);
+        dispatch(&ctx, method, path);
+    }
+    arena_reset(arena);
+    if (fflush(ctx.out) || ferror(ctx.out)) {
+        return 0;
+    }
+    if (ctx.keepalive && ctx.inlen > 0 && ctx.inlen <= DRAINMAX) {
+        char tmp[4096];
+        while (read_body(&ctx, tmp, sizeof(tmp)) > 0);
+    }
+    if (!ctx.keepalive || ctx.inlen > 0) {
+        return 0;
+    }
+    // Keep anything pipelined after this request
+    size_t used = ctx.inbuf - conn->buf;
+    memmove(conn->buf, ctx.inbuf, conn->len - used);
+    conn->len -= used;
+    return 1;
+}
+
+static void *worker(void *arg) {
+    server_t *server = arg;
+    arena_t *arena = arena_new();
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (!server->head) {
+            pthread_cond_wait(&server->cond, &server->lock);
+        }
+        conn_t *conn = server->head;
+        server->head = conn->next;
+        if (!server->head) {
+            server->tail = NULL;
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        int keep;
+        do {
+            keep = handle(server, conn, arena);
+        } while (keep && header_length(conn->buf, conn->len));
+        if (keep) {
+            conn_idle(server, conn, 1);
+        } else {
+            conn_close(server, conn);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Parse "[addr:]port" into a socket address. The address must be numeric,
+ * IPv6 addresses must be in brackets. Return the address length or 0
+ */
+static socklen_t parse_listen(char *s, struct sockaddr_storage *sa) {
+    char *addr = NULL, *port = s;
+    char *colon = strrchr(s, ':');
+    memset(sa, 0, sizeof(*sa));
+    if (colon) {
+        addr = strndup(s, colon - s);
+        port = colon + 1;
+    }
+    char *e;
+    long p = strtol(port, &e, 10);
+    if (*e || !*port || p < 0 || p > 65535) {
+        free(addr);
+        return 0;
+    }
+    socklen_t len = 0;
+    if (addr && addr[0] == '[' && addr[strlen(addr) - 1] == ']') {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sa;
+        addr[strlen(addr) - 1] = 0;
+        if (inet_pton(AF_INET6, addr + 1, &sin6->sin6_addr) == 1) {
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(p);
+            len = sizeof(*sin6);
+        }
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(p);
+        sin->sin_addr.s_addr = htonl(INADDR_ANY);
+        if (!addr || !*addr || inet_pton(AF_INET, addr, &sin->sin_addr) == 1) {
+            len = sizeof(*sin);
+        }
+    }
+    free(addr);
+    return len;
+}
+
+int httpd(context_t *ctx, char *addr, int threads) {
+    struct sockaddr_storage sa;
+    socklen_t salen = parse_listen(addr, &sa);
+    int one = 1;
+    if (!salen) {
+        fprintf(stderr, "invalid listen address \"%s\"\n", addr);
+        return 1;
+    }
+    int lfd = socket(sa.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (lfd < 0) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        return 1;
+    }
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(lfd, (struct sockaddr *)&sa, salen) || listen(lfd, SOMAXCONN)) {
+        fprintf(stderr, "listen \"%s\": %s\n", addr, strerror(errno));
+        return 1;
+    }
+    if (threads <= 0) {
+        // Workers mostly wait on the network or the disk, so there are many more than CPUs
+        threads = sysconf(_SC_NPROCESSORS_ONLN) * CPUTHREADS;
+        if (threads < MINTHREADS) {
+            threads = MINTHREADS;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    logmsg(ctx, "listening on %s with %d threads", addr, threads);
+
+    server_t *server = calloc(sizeof(server_t), 1);
+    server->ctx = ctx;
+    server->lfd = lfd;
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->cond, NULL);
+    server->epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(server->epfd, EPOLL_CTL_ADD, lfd, &ev);
+    for (int i=0;i<threads;i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker, server)) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(errno));
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+
+    struct epoll_event events[64];
+    time_t lastsweep = time(NULL);
+    for (;;) {
+        int n = epoll_wait(server->epfd, events, sizeof(events) / sizeof(events[0]), 1000);
+        for (int i=0;i<n;i++) {
+            conn_t *conn = events[i].data.ptr;
+            if (!conn) {
+                int fd;
+                while (__atomic_load_n(&server->conns, __ATOMIC_RELAXED) < MAXCONNS && (fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+                    FILE *out = fdopen(fd, "w");
+                    if (!out) {
+                        logmsg(server->ctx, "fdopen: %s", strerror(errno));
+                        close(fd);
+                        continue;
+                    }
+                    __atomic_add_fetch(&server->conns, 1, __ATOMIC_RELAXED);
+                    struct timeval tv = { IOTIMEOUT, 0 };
+                    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    conn = malloc(sizeof(conn_t));
+                    conn->fd = fd;
+                    conn->len = 0;
+                    conn->out = out;
+                    conn->prev = conn->next = NULL;
+                    ev.events = EPOLLIN|EPOLLRDHUP|EPOLLONESHOT;
+                    ev.data.ptr = conn;
+                    epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev);
+                    pthread_mutex_lock(&server->lock);
+                    conn->idle = time(NULL);
+                    conn->next = server->idle;
+                    if (conn->next) {
+                        conn->next->prev = conn;
+                    }
+                    server->idle = conn;
+                    pthread_mutex_unlock(&server->lock);
+                }
+                int full = __atomic_load_n(&server->conns, __ATOMIC_RELAXED) >= MAXCONNS;
+                if (full || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)) {
+                    // EMFILE, ENFILE, ENOBUFS or MAXCONNS
+                    logmsg(server->ctx, "not accepting connections: %s", full ? "too many open" : strerror(errno));
+                    accept_pause(server);
+                }
+            } else {
+                pthread_mutex_lock(&server->lock);
+                conn_unidle(server, conn);
+                pthread_mutex_unlock(&server->lock);
+                // The socket is blocking, but it's readable so one read won't block
+                ssize_t l = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+                if (l <= 0) {
+                    epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                    conn_close(server, conn);
+                    continue;
+                } else if (!conn->len) {
+                    conn->idle = time(NULL);        // the request began
+                }
+                if (header_length(conn->buf, (conn->len += l)) || conn->len == sizeof(conn->buf)) {
+                    pthread_mutex_lock(&server->lock);
+                    if (server->tail) {
+                        server->tail->next = conn;
+                    } else {
+                        server->head = conn;
+                    }
+                    server->tail = conn;
+                    pthread_cond_signal(&server->cond);
+                    pthread_mutex_unlock(&server->lock);
+                } else {
+                    conn_idle(server, conn, 0);
+                }
+            }
+        }
+        time_t now = time(NULL);
+        if (now != lastsweep) {
+            lastsweep = now;
+            log_flush();
+            pthread_mutex_lock(&server->lock);
+            for (conn_t *conn=server->idle, *next;conn;conn=next) {
+                next = conn->next;
+                if (now - conn->idle > (conn->len ? HEADERTIMEOUT : IDLETIMEOUT)) {
+                    conn_unidle(server, conn);
+                    epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                    conn_close(server, conn);
+                }
+            }
+            pthread_mutex_unlock(&server->lock);
+            if (server->paused && now > server->paused && __atomic_load_n(&server->conns, __ATOMIC_RELAXED) < MAXCONNS) {
+                server->paused = 0;
+                ev.events = EPOLLIN;
+                ev.data.ptr = NULL;
+                epoll_ctl(server->epfd, EPOLL_CTL_ADD, lfd, &ev);
+            }
+        }
+    }
+    return 0;
+}
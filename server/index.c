@@ -0,0 +1,455 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#define INDEXMAGIC "FMINDEX1"
+#define INDEXSTABLE 2           // seconds a directory must have been unchanged before its listing is saved
+
+/*
+ * The index keeps the listing of each directory info has been asked for, so
+ * it can be served again without a readdir() and a stat() of every entry.
+ * Each is a file in STATEDIR/index named for a hash of the directory's path:
+ * a header with the directory's device, inode, mtime and ctime, then one
+ * record for each file or subdirectory with its name, mode, owner, size and
+ * times. It's mapped by info and read in place.
+ *
+ * An index is trusted while the directory's mtime and ctime match those it
+ * recorded, as adding, removing or renaming an entry changes them. Changing
+ * a file's content doesn't, so put, mkdir and delete call index_update()
+ * after changing anything to update the record and the times together. A
+ * listing is only saved once the directory has been unchanged for
+ * INDEXSTABLE seconds, so a change made by someone else in the same clock
+ * tick as the listing can't be missed. Anything else is detected by the
+ * times and rebuilt from the directory.
+ *
+ * Records are never changed in place except to mark them deleted; a changed
+ * entry is marked and appended again. So a reader can use its mapping of the
+ * file without holding a lock - it sees each entry either before or after
+ * the change. Writers lock the directory itself with flock(). A rebuild
+ * replaces the file, with a new generation number so cursors into the old
+ * one can be recognised.
+ */
+
+typedef struct indexhdr {
+    char magic[8];
+    uint64_t gen;
+    uint64_t dev, ino;
+    int64_t mtime, mtimens, ctime, ctimens;     // of the directory
+    uint64_t count;             // live records
+    uint64_t deleted;           // records marked deleted
+    uint64_t end;               // offset after the last record
+    uint32_t pathlen;           // the directory's path follows the header
+    uint32_t pad;
+} indexhdr_t;
+
+typedef struct indexrec {
+    uint64_t size;
+    int64_t mtime, ctime;
+    uint32_t mode, uid, gid;
+    uint16_t namelen;           // the name follows, NUL terminated and padded to 8 bytes
+    uint16_t deleted;
+} indexrec_t;
+
+struct dirindex {
+    char *map;
+    size_t len;                 // records end here
+    size_t start;               // and start here
+    uint64_t gen;
+};
+
+#define PAD8(n) (((n) + 8) & ~(size_t)7)       // bytes for a string of n plus its NUL, rounded up
+
+/**
+ * Return the path of the index file for a directory, to be freed, or NULL
+ */
+static char *index_file(context_t *ctx, const char *relpath) {
+    char id[17];
+    statehash(relpath, id);
+    return statepath(ctx, "index", id);
+}
+
+static int index_matches(const indexhdr_t *h, const struct stat *sb) {
+    return h->dev == (uint64_t)sb->st_dev && h->ino == (uint64_t)sb->st_ino
+        && h->mtime == (int64_t)sb->st_mtim.tv_sec && h->mtimens == (int64_t)sb->st_mtim.tv_nsec
+        && h->ctime == (int64_t)sb->st_ctim.tv_sec && h->ctimens == (int64_t)sb->st_ctim.tv_nsec;
+}
+
+static void index_settimes(indexhdr_t *h, const struct stat *sb) {
+    h->dev = sb->st_dev;
+    h->ino = sb->st_ino;
+    h->mtime = sb->st_mtim.tv_sec;
+    h->mtimens = sb->st_mtim.tv_nsec;
+    h->ctime = sb->st_ctim.tv_sec;
+    h->ctimens = sb->st_ctim.tv_nsec;
+}
+
+/**
+ * Read and check the header of an index file. Return zero if it's an index
+ * of relpath, with its path length in range of the file
+ */
+static int index_header(int fd, const char *relpath, indexhdr_t *h) {
+    struct stat sb;
+    char *path;
+    if (fstat(fd, &sb) || pread(fd, h, sizeof(*h), 0) != sizeof(*h) || memcmp(h->magic, INDEXMAGIC, 8)) {
+        return -1;
+    } else if (h->pathlen != strlen(relpath) || h->end > (uint64_t)sb.st_size || h->end < sizeof(*h) + PAD8(h->pathlen)) {
+        return -1;
+    } else if (!(path = malloc(h->pathlen + 1)) || pread(fd, path, h->pathlen + 1, sizeof(*h)) != h->pathlen + 1 || memcmp(path, relpath, h->pathlen + 1)) {
+        free(path);
+        return -1;      // another directory with the same hash
+    }
+    free(path);
+    return 0;
+}
+
+/**
+ * Map the index of a directory if it's valid for the directory's stat sb.
+ * If too much of it is deleted records, treat it as invalid to compact it
+ */
+static dirindex_t *index_map(const char *file, const char *relpath, const struct stat *sb) {
+    indexhdr_t h;
+    dirindex_t *ix = NULL;
+    int fd = open(file, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    } else if (!index_header(fd, relpath, &h) && index_matches(&h, sb) && (h.deleted < 64 || h.deleted < h.count)) {
+        void *map = mmap(NULL, h.end, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            ix = malloc(sizeof(dirindex_t));
+            ix->map = map;
+            ix->len = h.end;
+            ix->start = sizeof(h) + PAD8(h.pathlen);
+            ix->gen = h.gen;
+        }
+    }
+    close(fd);
+    return ix;
+}
+
+static int index_append(FILE *f, const char *name, const struct stat *sb) {
+    indexrec_t r;
+    char pad[8] = { 0 };
+    size_t len = strlen(name);
+    memset(&r, 0, sizeof(r));
+    r.size = sb->st_size;
+    r.mtime = sb->st_mtime;
+    r.ctime = sb->st_ctime;
+    r.mode = sb->st_mode;
+    r.uid = sb->st_uid;
+    r.gid = sb->st_gid;
+    r.namelen = len;
+    return len > UINT16_MAX || fwrite(&r, sizeof(r), 1, f) != 1 || fwrite(name, len, 1, f) != 1 || fwrite(pad, PAD8(len) - len, 1, f) != 1;
+}
+
+/**
+ * Return non-zero if the entry dp of the directory dfd is one we'd list,
+ * with its stat in sb. Like kidstat() in filemanager.c but without the
+ * access check, which is done when the index is read
+ */
+static int index_kid(int dfd, const char *name, int type, struct stat *sb) {
+    if (name[0] == '.' || (type != DT_UNKNOWN && type != DT_REG && type != DT_DIR && type != DT_LNK)) {
+        return 0;
+    }
+    return !fstatat(dfd, name, sb, 0) && (S_ISREG(sb->st_mode) || S_ISDIR(sb->st_mode));
+}
+
+/**
+ * Write a new index for the directory dfd, which has the stat sb, to file.
+ * Called with the directory locked. Return zero if it was saved
+ */
+static int index_build(context_t *ctx, int dfd, const char *relpath, const char *file, const struct stat *sb) {
+    indexhdr_t h;
+    struct stat kid, now;
+    struct dirent *dp;
+    if (sb->st_mtime > time(NULL) - INDEXSTABLE) {
+        return -1;      // still changing, or could be
+    }
+    char *tmp = malloc(strlen(file) + 8);
+    sprintf(tmp, "%s.XXXXXX", file);
+    int fd = mkstemp(tmp);
+    int dirfd2 = openat(dfd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    DIR *dir = dirfd2 < 0 ? NULL : fdopendir(dirfd2);
+    FILE *f = fd < 0 ? NULL : fdopen(fd, "w");
+    int err = !dir || !f;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEXMAGIC, 8);
+    h.pathlen = strlen(relpath);
+    if (!err) {
+        char pad[8] = { 0 };
+        err = fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(relpath, h.pathlen, 1, f) != 1 || fwrite(pad, PAD8(h.pathlen) - h.pathlen, 1, f) != 1;
+    }
+    while (!err && (dp = readdir(dir))) {
+        if (index_kid(dfd, dp->d_name, dp->d_type, &kid)) {
+            err = index_append(f, dp->d_name, &kid);
+            h.count++;
+        }
+    }
+    if (!err) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        h.gen = ((uint64_t)ts.tv_sec << 30) ^ ts.tv_nsec ^ ((uint64_t)getpid() << 48);
+        h.end = ftell(f);
+        index_settimes(&h, sb);
+        err = fseek(f, 0, SEEK_SET) || fwrite(&h, sizeof(h), 1, f) != 1 || fflush(f);
+    }
+    if (!err) {
+        // The directory changing while we read it would make the listing suspect
+        err = fstat(dfd, &now) || !index_matches(&h, &now) || rename(tmp, file);
+    }
+    if (dir) {
+        closedir(dir);
+    } else if (dirfd2 >= 0) {
+        close(dirfd2);
+    }
+    if (f) {
+        fclose(f);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    if (err && fd >= 0) {
+        unlink(tmp);
+    }
+    if (!err) {
+        logmsg(ctx, "index \"%s\": %lu entries", relpath, (unsigned long)h.count);
+    }
+    free(tmp);
+    return err;
+}
+
+/**
+ * Return the index of the open directory dfd, at relpath under the root,
+ * building it if it's missing or out of date. Return NULL if there's no
+ * index to use, and the directory must be read instead
+ */
+dirindex_t *index_open(context_t *ctx, int dfd, const char *relpath) {
+    struct stat sb;
+    dirindex_t *ix = NULL;
+    char *file = index_file(ctx, relpath);
+    if (file && !fstat(dfd, &sb)) {
+        flock(dfd, LOCK_SH);
+        ix = index_map(file, relpath, &sb);
+        if (!ix) {
+            flock(dfd, LOCK_EX);
+            if (!fstat(dfd, &sb) && !(ix = index_map(file, relpath, &sb)) && !index_build(ctx, dfd, relpath, file, &sb)) {
+                ix = index_map(file, relpath, &sb);
+            }
+        }
+        flock(dfd, LOCK_UN);
+    }
+    free(file);
+    return ix;
+}
+
+uint64_t index_gen(dirindex_t *ix) {
+    return ix->gen;
+}
+
+/**
+ * Return a number that changes whenever the index does: updates only ever
+ * append to it, and a rebuild changes the generation
+ */
+uint64_t index_version(dirindex_t *ix) {
+    return ix->gen + ix->len * 0x9e3779b97f4a7c15ULL;
+}
+
+/**
+ * Read the next entry of the index from the offset pos, or from the start
+ * if pos is zero. Set name and sb and return the offset of the entry, or
+ * return 0 if there are no more. *pos is set to the offset of the next
+ */
+size_t index_next(dirindex_t *ix, size_t *pos, const char **name, struct stat *sb) {
+    size_t off = *pos < ix->start ? ix->start : *pos;
+    while (off + sizeof(indexrec_t) <= ix->len) {
+        indexrec_t *r = (indexrec_t *)(ix->map + off);
+        size_t here = off;
+        off += sizeof(indexrec_t) + PAD8(r->namelen);
+        if (off > ix->len) {
+            break;
+        } else if (!r->deleted) {
+            memset(sb, 0, sizeof(*sb));
+            sb->st_mode = r->mode;
+            sb->st_uid = r->uid;
+            sb->st_gid = r->gid;
+            sb->st_size = r->size;
+            sb->st_mtime = r->mtime;
+            sb->st_ctime = r->ctime;
+            *name = (const char *)(r + 1);
+            *pos = off;
+            return here;
+        }
+    }
+    *pos = ix->len;
+    return 0;
+}
+
+/**
+ * Return 1 if pos, from a cursor, is the offset of a record in the index or
+ * of its end. Anything else didn't come from index_next() and mustn't be
+ * read from, so walk the records to check
+ */
+int index_valid(dirindex_t *ix, size_t pos) {
+    size_t off = ix->start;
+    while (off < pos && off + sizeof(indexrec_t) <= ix->len) {
+        off += sizeof(indexrec_t) + PAD8(((indexrec_t *)(ix->map + off))->namelen);
+    }
+    return off == pos && off <= ix->len;
+}
+
+void index_close(dirindex_t *ix) {
+    if (ix) {
+        munmap(ix->map, ix->len);
+        free(ix);
+    }
+}
+
+/**
+ * Stat the directory containing path, to pass to index_update() once path
+ * has been changed. If it can't be, "before" won't match any index
+ */
+void index_before(const char *path, struct stat *before) {
+    char *dir = strdup(path);
+    char *c = strrchr(dir, '/');
+    if (c) {
+        *c = 0;
+    }
+    if (!c || stat(*dir ? dir : "/", before)) {
+        memset(before, 0, sizeof(*before));
+    }
+    free(dir);
+}
+
+/**
+ * Update the index of the directory containing path (a full path under the
+ * root) after path has been created, changed or removed. "before" is the
+ * stat of the directory from index_before() before the change: an index
+ * that didn't match it missed some other change, and is removed instead
+ */
+void index_update(context_t *ctx, const char *path, const struct stat *before) {
+    indexhdr_t h;
+    struct stat sb, kid;
+    const char *rel = path + strlen(ctx->root) + 1;
+    const char *slash = strrchr(rel, '/');
+    const char *name = slash ? slash + 1 : rel;
+    char *parent = strndup(rel, slash ? slash - rel : 0);
+    char *dir = strndup(path, name - 1 - path);
+
+    char *file = index_file(ctx, parent);
+    int dfd = open(*dir ? dir : "/", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    int fd = -1;
+    if (file && dfd >= 0 && !flock(dfd, LOCK_EX) && (fd = open(file, O_RDWR|O_CLOEXEC)) >= 0) {
+        size_t len = strlen(name);
+        int live = index_kid(dfd, name, DT_UNKNOWN, &kid);
+        int ok = !index_header(fd, parent, &h) && index_matches(&h, before);
+        char *map = ok ? mmap(NULL, h.end, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (map != MAP_FAILED) {
+            // Mark the old record deleted
+            for (size_t off=sizeof(h)+PAD8(h.pathlen);off+sizeof(indexrec_t)<=h.end;) {
+                indexrec_t *r = (indexrec_t *)(map + off);
+                if (!r->deleted && r->namelen == len && !memcmp(r + 1, name, len)) {
+                    uint16_t one = 1;
+                    ok = pwrite(fd, &one, sizeof(one), off + offsetof(indexrec_t, deleted)) == sizeof(one);
+                    h.count--;
+                    h.deleted++;
+                    break;
+                }
+                off += sizeof(indexrec_t) + PAD8(r->namelen);
+            }
+            munmap(map, h.end);
+        } else {
+            ok = 0;
+        }
+        if (ok && live) {
+            FILE *f = fdopen(dup(fd), "r+");
+            ok = f && !fseek(f, h.end, SEEK_SET) && !index_append(f, name, &kid) && !fflush(f);
+            if (ok) {
+                h.end = ftell(f);
+                h.count++;
+            }
+            if (f) {
+                fclose(f);
+            }
+        }
+        if (ok && !fstat(dfd, &sb)) {
+            index_settimes(&h, &sb);
+            ok = pwrite(fd, &h, sizeof(h), 0) == sizeof(h);
+        } else {
+            ok = 0;
+        }
+        if (!ok) {
+            unlink(file);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (dfd >= 0) {
+        close(dfd);
+    }
+    free(file);
+    free(parent);
+    free(dir);
+}
+
+/**
+ * Remove the index of a directory that's been removed
+ */
+void index_forget(context_t *ctx, const char *relpath) {
+    char *file = index_file(ctx, relpath);
+    if (file) {
+        unlink(file);
+        free(file);
+    }
+}
+
+/**
+ * Remove the indexes of a directory that's been moved and of everything
+ * under it. Its subdirectories' times don't change when it's moved, so
+ * their indexes would otherwise still be trusted at the old paths if
+ * something else were moved there. They're found by the path in each
+ * index's header, as they're named for a hash of it
+ */
+void index_forget_tree(context_t *ctx, const char *relpath) {
+    indexhdr_t h;
+    struct dirent *e;
+    size_t len = strlen(relpath);
+    char *path = malloc(len + 2);
+    char *file = statepath(ctx, "index", "x");
+    DIR *d = NULL;
+    if (file) {
+        *strrchr(file, '/') = 0;
+        d = opendir(file);
+        free(file);
+    }
+    while (d && path && (e=readdir(d))) {
+        if (strchr(e->d_name, '.')) {
+            continue;       // not an index, or one being written
+        }
+        int fd = openat(dirfd(d), e->d_name, O_RDONLY|O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        // Only the path's first len + 1 bytes are needed to tell if it's under relpath
+        int under = pread(fd, &h, sizeof(h), 0) == sizeof(h) && !memcmp(h.magic, INDEXMAGIC, 8) && h.pathlen >= len
+            && pread(fd, path, len + 1, sizeof(h)) == (ssize_t)len + 1 && !memcmp(path, relpath, len) && (!path[len] || path[len] == '/');
+        close(fd);
+        if (under) {
+            unlinkat(dirfd(d), e->d_name, 0);
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+    free(path);
+}
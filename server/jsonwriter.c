@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * A JSON response that's written as it's generated rather than built as a
+ * jansson tree and dumped to a string, so a listing of a million files takes
+ * no more memory than one of ten.
+ *
+ * Output is collected in the writer's buffer. If the whole response fits,
+ * it's sent with a Content-Length when finished, as before. Otherwise the
+ * headers are sent when the buffer first fills and the buffer is sent each
+ * time it fills after that - as a chunk if the HTTP client accepts chunked
+ * encoding, or as is if we're a CGI (the web server frames it) or the client
+ * is HTTP/1.0 (the connection is closed to end the response).
+ *
+ * If the client accepts a compressed response it's compressed as it's sent,
+ * or all at once if it fits in the buffer and is worth compressing.
+ */
+
+/**
+ * Write part of the response body, as a chunk if we're chunking, and count
+ * it for stats (the body as sent, so compressed, without the chunk framing)
+ */
+static void jw_out(void *arg, const void *data, size_t len) {
+    jsonw_t *w = arg;
+    context_t *ctx = w->ctx;
+    ctx->sent += len;
+    if (len == 0) {
+        return;
+    } else if (ctx->http && ctx->chunked) {
+        fprintf(ctx->out, "%zx\r\n", len);
+        fwrite(data, 1, len, ctx->out);
+        fputs("\r\n", ctx->out);
+    } else {
+        fwrite(data, 1, len, ctx->out);
+    }
+}
+
+static void jw_headers(jsonw_t *w, int encoding) {
+    context_t *ctx = w->ctx;
+    send_status(ctx, w->code);
+    fputs("Content-Type: application/json\r\n", ctx->out);
+    if (encoding) {
+        fprintf(ctx->out, "Content-Encoding: %s\r\n", encoding_name(encoding));
+    }
+    fputs("Vary: Accept-Encoding\r\n", ctx->out);
+    if (w->headers) {
+        fputs(w->headers, ctx->out);
+    }
+}
+
+static void jw_send(jsonw_t *w, int mode) {
+    context_t *ctx = w->ctx;
+    if (!w->sent) {
+        w->sent = 1;
+        if (ctx->http && !ctx->chunked) {
+            ctx->keepalive = 0;
+        }
+        if (w->encoding) {
+            w->enc = encoder_new(w->encoding, 0);
+        }
+        jw_headers(w, w->enc ? w->encoding : ENC_IDENTITY);
+        if (ctx->http && ctx->chunked) {
+            fputs("Transfer-Encoding: chunked\r\n", ctx->out);
+        }
+        fputs("\r\n", ctx->out);
+    }
+    if (w->enc) {
+        encoder_write(w->enc, w->buf, w->len, mode, jw_out, w);
+    } else {
+        jw_out(w, w->buf, w->len);
+    }
+    w->total += w->len;
+    w->len = 0;
+}
+
+static void jw_write(jsonw_t *w, const char *s, size_t len) {
+    while (len) {
+        size_t n = sizeof(w->buf) - w->len;
+        if (n == 0) {
+            jw_send(w, ENC_CONTINUE);
+            n = sizeof(w->buf);
+        }
+        if (n > len) {
+            n = len;
+        }
+        memcpy(w->buf + w->len, s, n);
+        w->len += n;
+        s += n;
+        len -= n;
+    }
+}
+
+static void jw_putc(jsonw_t *w, char c) {
+    if (w->len == sizeof(w->buf)) {
+        jw_send(w, ENC_CONTINUE);
+    }
+    w->buf[w->len++] = c;
+}
+
+/**
+ * Called before each key or value: separate it from the one before
+ */
+static void jw_next(jsonw_t *w) {
+    if (w->comma) {
+        jw_putc(w, ',');
+    }
+    w->comma = 1;
+}
+
+/**
+ * Return the length of the valid UTF-8 sequence at s, or 0 if it's invalid
+ */
+static int utf8len(const unsigned char *s) {
+    int n;
+    unsigned int c = s[0];
+    if (c < 0xC2) {
+        return 0;
+    } else if (c < 0xE0) {
+        n = 2;
+        c &= 0x1F;
+    } else if (c < 0xF0) {
+        n = 3;
+        c &= 0x0F;
+    } else if (c < 0xF5) {
+        n = 4;
+        c &= 0x07;
+    } else {
+        return 0;
+    }
+    for (int i=1;i<n;i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+        c = (c << 6) | (s[i] & 0x3F);
+    }
+    if ((n == 3 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))) || (n == 4 && (c < 0x10000 || c > 0x10FFFF))) {
+        return 0;
+    }
+    return n;
+}
+
+/**
+ * Write s as a quoted string. Filenames needn't be UTF-8, so bytes that
+ * aren't are written as U+FFFD rather than producing invalid JSON
+ */
+static void jw_quote(jsonw_t *w, const char *s) {
+    const unsigned char *p = (const unsigned char *)s, *start = p;
+    jw_putc(w, '"');
+    for (;*p;) {
+        int n;
+        if (*p >= 0x20 && *p < 0x80 && *p != '"' && *p != '\\') {
+            p++;
+            continue;
+        } else if (*p >= 0x80 && (n = utf8len(p))) {
+            p += n;
+            continue;
+        }
+        jw_write(w, (const char *)start, p - start);
+        char tmp[8];
+        switch (*p) {
+            case '"':  jw_write(w, "\\\"", 2); break;
+            case '\\': jw_write(w, "\\\\", 2); break;
+            case '\n': jw_write(w, "\\n", 2); break;
+            case '\r': jw_write(w, "\\r", 2); break;
+            case '\t': jw_write(w, "\\t", 2); break;
+            default:
+                if (*p < 0x20) {
+                    jw_write(w, tmp, sprintf(tmp, "\\u%04x", *p));
+                } else {
+                    jw_write(w, "\\ufffd", 6);
+                }
+        }
+        start = ++p;
+    }
+    jw_write(w, (const char *)start, p - start);
+    jw_putc(w, '"');
+}
+
+void jw_start(jsonw_t *w, context_t *ctx, int code) {
+    w->ctx = ctx;
+    w->code = code;
+    w->sent = 0;
+    w->comma = 0;
+    w->len = 0;
+    w->total = 0;
+    w->headers = NULL;
+    w->encoding = accept_encoding(ctx);
+    w->enc = NULL;
+}
+
+void jw_object(jsonw_t *w) {
+    jw_next(w);
+    jw_putc(w, '{');
+    w->comma = 0;
+}
+
+void jw_object_end(jsonw_t *w) {
+    jw_putc(w, '}');
+    w->comma = 1;
+}
+
+void jw_array(jsonw_t *w) {
+    jw_next(w);
+    jw_putc(w, '[');
+    w->comma = 0;
+}
+
+void jw_array_end(jsonw_t *w) {
+    jw_putc(w, ']');
+    w->comma = 1;
+}
+
+void jw_key(jsonw_t *w, const char *key) {
+    jw_next(w);
+    jw_quote(w, key);
+    jw_putc(w, ':');
+    w->comma = 0;
+}
+
+void jw_string(jsonw_t *w, const char *s) {
+    jw_next(w);
+    jw_quote(w, s);
+}
+
+void jw_integer(jsonw_t *w, long long v) {
+    char tmp[24];
+    jw_next(w);
+    jw_write(w, tmp, sprintf(tmp, "%lld", v));
+}
+
+void jw_boolean(jsonw_t *w, int v) {
+    jw_next(w);
+    jw_write(w, v ? "true" : "false", v ? 4 : 5);
+}
+
+static int jw_dump(const char *buf, size_t len, void *w) {
+    jw_write(w, buf, len);
+    return 0;
+}
+
+/**
+ * Write a value built with jansson
+ */
+void jw_value(jsonw_t *w, json_t *json) {
+    jw_next(w);
+    json_dump_callback(json, jw_dump, w, JSON_COMPACT|JSON_ENCODE_ANY);
+}
+
+/**
+ * Send what's been written so far, headers included, without waiting for
+ * the buffer to fill
+ */
+void jw_flush(jsonw_t *w) {
+    jw_send(w, ENC_FLUSH);
+    fflush(w->ctx->out);
+}
+
+/**
+ * Throw away what's been written, so a different response can be sent.
+ * Return zero if that's too late, because part of it has already gone
+ */
+int jw_discard(jsonw_t *w) {
+    if (w->sent) {
+        return 0;
+    }
+    w->len = 0;
+    w->comma = 0;
+    return 1;
+}
+
+typedef struct membuf {
+    char *s;
+    size_t len, size;
+} membuf_t;
+
+static void mem_out(void *arg, const void *data, size_t len) {
+    membuf_t *m = arg;
+    if (m->len + len > m->size) {
+        m->size = (m->len + len) * 2;
+        m->s = realloc(m->s, m->size);
+    }
+    memcpy(m->s + m->len, data, len);
+    m->len += len;
+}
+
+/**
+ * Finish the response and return the number of bytes of JSON sent
+ */
+size_t jw_end(jsonw_t *w) {
+    context_t *ctx = w->ctx;
+    if (!w->sent) {
+        w->sent = 1;
+        membuf_t packed = { NULL, 0, 0 };
+        encoder_t *e = w->encoding && w->len >= COMPRESSMIN ? encoder_new(w->encoding, 0) : NULL;
+        if (e && encoder_write(e, w->buf, w->len, ENC_END, mem_out, &packed)) {
+            packed.len = 0;
+        }
+        encoder_free(e);
+        if (packed.len) {
+            jw_headers(w, w->encoding);
+            fprintf(ctx->out, "Content-Length: %zu\r\n\r\n", packed.len);
+            fwrite(packed.s, 1, packed.len, ctx->out);
+            ctx->sent += packed.len;
+        } else {
+            jw_headers(w, ENC_IDENTITY);
+            fprintf(ctx->out, "Content-Length: %zu\r\n\r\n", w->len);
+            fwrite(w->buf, 1, w->len, ctx->out);
+            ctx->sent += w->len;
+        }
+        free(packed.s);
+        w->total = w->len;
+        w->len = 0;
+    } else {
+        jw_send(w, ENC_END);
+        if (ctx->http && ctx->chunked) {
+            fputs("0\r\n\r\n", ctx->out);
+        }
+        encoder_free(w->enc);
+        w->enc = NULL;
+    }
+    return w->total;
+}
@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define LOGBUF 65536            // bytes of log lines buffered before they're written
+#define LOGMAX 1024             // longest message logged, longer ones are truncated
+#define LOGLINE (LOGMAX * 2 + 128)  // longest line, with the message escaped
+
+/*
+ * Log lines are "key=value" pairs - time, level, thread and the message,
+ * which is quoted - so they can be parsed as well as read. Rather than
+ * opening the log file for every message, lines are appended to a buffer
+ * shared by all threads and written to a descriptor that's kept open: when
+ * the buffer fills, immediately for errors, once a second from the HTTP
+ * server's event loop and at exit. The file is reopened if it's no longer
+ * at its path, so it can be rotated by renaming it. Messages below the level
+ * set with "--loglevel" are discarded before they're formatted.
+ */
+
+static pthread_mutex_t loglock = PTHREAD_MUTEX_INITIALIZER;
+static char logbuf[LOGBUF];
+static size_t loglen;
+static int logfd = -1;
+static const char *logpath;
+
+static const char *levels[] = { "emerg", "alert", "crit", "error", "warning", "notice", "info", "debug" };
+
+/**
+ * Return the level (a syslog priority) with the specified name, or -1
+ */
+int log_level(const char *name) {
+    for (int i=0;i<sizeof(levels)/sizeof(levels[0]);i++) {
+        if (!strcasecmp(name, levels[i])) {
+            return i;
+        }
+    }
+    return !strcasecmp(name, "err") ? LOG_ERR : !strcasecmp(name, "warn") ? LOG_WARNING : -1;
+}
+
+/**
+ * Write the buffer to the log file, reopening it first if it's been
+ * renamed or removed or the path has changed. Call with loglock held
+ */
+static void log_write(const char *path) {
+    struct stat sb, psb;
+    if (logfd >= 0 && ((path && path != logpath && strcmp(path, logpath)) || fstat(logfd, &sb) || stat(logpath, &psb) || sb.st_ino != psb.st_ino || sb.st_dev != psb.st_dev)) {
+        close(logfd);
+        logfd = -1;
+    }
+    if (logfd < 0 && (path || logpath)) {
+        logpath = path ? path : logpath;
+        logfd = open(logpath, O_CREAT|O_WRONLY|O_APPEND|O_CLOEXEC, 0666);
+    }
+    for (size_t i=0;i<loglen && logfd >= 0;) {
+        ssize_t l = write(logfd, logbuf + i, loglen - i);
+        if (l > 0) {
+            i += l;
+        } else if (l < 0 && errno != EINTR) {
+            break;
+        }
+    }
+    loglen = 0;
+}
+
+/**
+ * Write any buffered log lines to the log file
+ */
+void log_flush(void) {
+    pthread_mutex_lock(&loglock);
+    if (loglen) {
+        log_write(NULL);
+    }
+    pthread_mutex_unlock(&loglock);
+}
+
+static void logv(context_t *ctx, int level, const char *fmt, va_list va) {
+    static int registered;
+    static __thread long tid;
+    char msg[LOGMAX + 1], line[LOGLINE];
+    int len = vsnprintf(msg, sizeof(msg), fmt, va);
+    if (len < 0) {
+        return;
+    } else if (len > LOGMAX) {
+        strcpy(msg + LOGMAX - 3, "...");
+    }
+    if (!strcmp(ctx->log, "syslog")) {
+        syslog(LOG_USER|level, "%s", msg);
+        return;
+    }
+
+    struct timespec ts;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    gmtime_r(&ts.tv_sec, &tm);
+    if (!tid) {
+        tid = syscall(SYS_gettid);
+    }
+    size_t n = strftime(line, 64, "time=%Y-%m-%dT%H:%M:%S", &tm);
+    n += sprintf(line + n, ".%03ldZ level=%s tid=%ld msg=\"", ts.tv_nsec / 1000000, levels[level & 7], tid);
+    for (const unsigned char *c=(unsigned char *)msg;*c;c++) {
+        if (*c == '"' || *c == '\\') {
+            line[n++] = '\\';
+            line[n++] = *c;
+        } else if (*c == '\n') {
+            line[n++] = '\\';
+            line[n++] = 'n';
+        } else if (*c < 0x20) {
+            line[n++] = ' ';
+        } else {
+            line[n++] = *c;
+        }
+    }
+    line[n++] = '"';
+    if (len > LOGMAX) {
+        n += sprintf(line + n, " truncated=%d", len);
+    }
+    line[n++] = '\n';
+
+    pthread_mutex_lock(&loglock);
+    if (!registered) {
+        registered = 1;
+        atexit(log_flush);
+    }
+    if (!logpath) {
+        logpath = ctx->log;
+    }
+    if (loglen + n > LOGBUF) {
+        log_write(ctx->log);
+    }
+    memcpy(logbuf + loglen, line, n);
+    loglen += n;
+    if (level <= LOG_ERR) {
+        log_write(ctx->log);
+    }
+    pthread_mutex_unlock(&loglock);
+}
+
+/**
+ * Log a message at the specified level, a syslog priority
+ */
+void logat(context_t *ctx, int level, char *fmt, ...) {
+    if (ctx->log && level <= ctx->loglevel) {
+        va_list va;
+        va_start(va, fmt);
+        logv(ctx, level, fmt, va);
+        va_end(va);
+    }
+}
+
+/**
+ * Log a message at the info level
+ */
+void logmsg(context_t *ctx, char *fmt, ...) {
+    if (ctx->log && LOG_INFO <= ctx->loglevel) {
+        va_list va;
+        va_start(va, fmt);
+        logv(ctx, LOG_INFO, fmt, va);
+        va_end(va);
+    }
+}
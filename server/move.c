@@ -0,0 +1,468 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#define COPYTHREADS 8           // workers copying a tree
+#define COPYNAME "copy"         // the name of the copy in its temporary directory
+
+/*
+ * Move renames a file or directory with renameat2() and RENAME_NOREPLACE,
+ * so it's atomic, takes the same time however much is moved, and never
+ * replaces anything already at the target. Both paths are under the root,
+ * so normally on the same filesystem.
+ *
+ * Copy builds the copy in a temporary directory in the state directory and
+ * renames it into place the same way, so the target appears whole or not
+ * at all, and a failed copy leaves nothing behind. Files are copied as
+ * reflinks with FICLONE where the filesystem supports them, sharing their
+ * content until one is changed, or otherwise with copy_file_range(), which
+ * copies within the kernel. A directory is copied the way delete removes
+ * one: a pool of workers (pool.c) each take a directory from a queue, copy
+ * its files and queue its subdirectories, which they create first. What's
+ * copied is what info lists: entries not beginning with ".", with symlinks
+ * to files followed and symlinks to directories skipped. Copies keep the
+ * modes, times and hashes of the originals, though directories are left
+ * writable until the copy is in place - a read-only directory couldn't be
+ * filled, renamed or, if the copy fails, removed.
+ */
+
+typedef struct copydir {
+    pooljob_t job;
+    char *from, *to;        // full paths
+    mode_t mode;            // of the original, given to the copy at the end
+    struct timespec times[2];
+    struct copydir *made;   // the directory made before this one
+} copydir_t;
+
+typedef struct copystate {
+    context_t *ctx;
+    pool_t pool;            // whose lock guards everything below
+    int failed;
+    char *error;            // the first failure
+    copydir_t *made;        // the directories made, newest first
+    size_t files, dirs, length, cloned;
+} copystate_t;
+
+/**
+ * Copy len bytes of the file "from" to the empty file "to", as a reflink if
+ * we can. Return 1 if it's a reflink, 0 if the content was copied or -1 on
+ * error. Where copy_file_range() can't be used, as between some
+ * filesystems, the file is read and written
+ */
+int copy_data(int from, int to, size_t len) {
+    if (!ioctl(to, FICLONE, from)) {
+        return 1;
+    }
+    loff_t in = 0, out = 0;
+    while ((size_t)in < len) {
+        ssize_t l = copy_file_range(from, &in, to, &out, len - in, 0);
+        if (l < 0 && errno == EINTR) {
+            continue;
+        } else if (l < 0 && in == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            break;
+        } else if (l <= 0) {
+            return -1;
+        }
+    }
+    char buf[65536];
+    while ((size_t)in < len) {
+        ssize_t l = pread(from, buf, len - in < sizeof(buf) ? len - in : sizeof(buf), in);
+        if (l <= 0) {
+            if (l < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (ssize_t i=0;i<l;) {
+            ssize_t w = pwrite(to, buf + i, l - i, in + i);
+            if (w < 0 && errno != EINTR) {
+                return -1;
+            }
+            i += w > 0 ? w : 0;
+        }
+        in += l;
+    }
+    return 0;
+}
+
+/**
+ * Read the "path" and "to" parameters as full paths, checking them as put
+ * does. Return 0, or send an error and return -1
+ */
+static int move_params(context_t *ctx, const char *cmd, char **from, char **to) {
+    *from = *to = NULL;
+    for (char **q=ctx->query;*q;) {
+        char *qkey = *q++;
+        char *qval = *q++;
+        char **dest = !strcmp(qkey, "path") ? from : !strcmp(qkey, "to") ? to : NULL;
+        if (dest) {
+            const char *name = qval;
+            if (name[0] == '/') {
+                name++;
+            }
+            if (name[0] == 0 || name[0] == '.' || strstr(name, "/.")) {
+                send_msg(ctx, 400, "invalid %s \"%s\"", qkey, name);
+                return -1;
+            }
+            *dest = arena_printf(ctx, "%s/%s", ctx->root, name);
+        }
+    }
+    if (!*from || !*to) {
+        send_msg(ctx, 400, "%s: missing %s", cmd, *from ? "to" : "path");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Rename "from" to "to" unless "to" exists. Return 0 or -1 with errno set
+ */
+static int rename_noreplace(int fromfd, const char *from, int tofd, const char *to) {
+    if (!renameat2(fromfd, from, tofd, to, RENAME_NOREPLACE)) {
+        return 0;
+    } else if (errno != EINVAL && errno != ENOSYS) {
+        return -1;
+    } else if (!faccessat(tofd, to, F_OK, AT_SYMLINK_NOFOLLOW)) {
+        errno = EEXIST;
+        return -1;
+    }
+    // Not supported by this filesystem, so checked and then renamed, which isn't atomic
+    return renameat(fromfd, from, tofd, to);
+}
+
+/**
+ * Move "path" to "to", creating the parents of "to" as needed. Fails with
+ * 409 if "to" exists
+ */
+void move(context_t *ctx) {
+    char *from, *to;
+    struct stat sb, frombefore, tobefore;
+    if (move_params(ctx, "move", &from, &to)) {
+        return;     // error already sent
+    } else if (lstat(from, &sb)) {
+        send_msg(ctx, errno == ENOENT ? 404 : 500, "move stat: %s", strerror(errno));
+        return;
+    }
+    size_t fromlen = strlen(from);
+    const char *fromrel = from + strlen(ctx->root) + 1, *torel = to + strlen(ctx->root) + 1;
+    if (S_ISDIR(sb.st_mode) && !strncmp(to, from, fromlen) && to[fromlen] == '/') {
+        send_msg(ctx, 400, "move: can't move \"%s\" into itself", fromrel);
+        return;
+    }
+    mkparents(to);
+    index_before(from, &frombefore);
+    index_before(to, &tobefore);
+    if (rename_noreplace(AT_FDCWD, from, AT_FDCWD, to)) {
+        int err = errno;
+        logmsg(ctx, "move \"%s\" to \"%s\": %s", fromrel, torel, strerror(err));
+        if (err == EEXIST || err == ENOTEMPTY) {
+            send_msg(ctx, 409, "move: \"%s\" exists", torel);
+        } else if (err == EINVAL) {
+            send_msg(ctx, 400, "move: can't move \"%s\" into itself", fromrel);
+        } else if (err == EXDEV) {
+            send_msg(ctx, 400, "move: \"%s\" is on another filesystem", torel);
+        } else {
+            send_msg(ctx, err == EACCES || err == EPERM ? 403 : 500, "move: %s", strerror(err));
+        }
+        return;
+    }
+    index_update(ctx, from, &frombefore);
+    index_update(ctx, to, &tobefore);
+    compressed_forget(ctx, fromrel);
+    if (S_ISDIR(sb.st_mode)) {
+        index_forget_tree(ctx, fromrel);
+    } else if (S_ISREG(sb.st_mode)) {
+        // The file with this hash is now at "to"
+        xxh64_t state;
+        int fd = open(to, O_RDONLY|O_CLOEXEC);
+        if (fd >= 0) {
+            if (!fstat(fd, &sb) && !hash_get(fd, &sb, &state)) {
+                hash_set(ctx, fd, torel, &state);
+            }
+            close(fd);
+        }
+    }
+    logmsg(ctx, "move \"%s\" to \"%s\"", fromrel, torel);
+    send_msg(ctx, 200, "moved \"%s\" to \"%s\"", fromrel, torel);
+}
+
+/**
+ * Record a failure of op on "dir/name", or "dir" if name is NULL. Called
+ * with the lock held
+ */
+static void copy_fail(copystate_t *st, const char *op, const char *dir, const char *name, int err) {
+    size_t rootlen = strlen(st->ctx->root);
+    const char *rel = strlen(dir) > rootlen ? dir + rootlen + 1 : dir;
+    logmsg(st->ctx, "copy %s \"%s%s%s\": %s", op, rel, name ? "/" : "", name ? name : "", strerror(err));
+    if (!st->error && asprintf(&st->error, "copy %s \"%s%s%s\": %s", op, rel, name ? "/" : "", name ? name : "", strerror(err)) < 0) {
+        st->error = NULL;
+    }
+    st->failed = 1;
+}
+
+/**
+ * Copy the regular file "sname" in the directory sfd, whose stat is sb, to
+ * "dname" in dfd, which mustn't exist. Return 0 or -1 with errno set
+ */
+static int copy_file(copystate_t *st, int sfd, const char *sname, int dfd, const char *dname, const struct stat *sb) {
+    xxh64_t state;
+    int from = openat(sfd, sname, O_RDONLY|O_CLOEXEC);
+    int to = from < 0 ? -1 : openat(dfd, dname, O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC, 0600);
+    int r = to < 0 ? -1 : copy_data(from, to, sb->st_size);
+    int err = errno;
+    if (r >= 0) {
+        struct timespec times[2] = { sb->st_atim, sb->st_mtim };
+        fchmod(to, sb->st_mode & 0777);
+        futimens(to, times);
+        if (!hash_get(from, sb, &state)) {
+            hash_set(st->ctx, to, NULL, &state);
+        }
+        pthread_mutex_lock(&st->pool.lock);
+        st->files++;
+        st->length += sb->st_size;
+        st->cloned += r;
+        pthread_mutex_unlock(&st->pool.lock);
+    }
+    if (from >= 0) {
+        close(from);
+    }
+    if (to >= 0) {
+        close(to);
+    }
+    errno = err;
+    return r < 0 ? -1 : 0;
+}
+
+/**
+ * A directory to copy: "from/name" to "to/name", or "from" to "to" if name
+ * is NULL
+ */
+static copydir_t *copydir_new(const char *from, const char *to, const char *name) {
+    copydir_t *d = malloc(sizeof(copydir_t));
+    d->made = NULL;
+    if (!name) {
+        d->from = strdup(from);
+        d->to = strdup(to);
+    } else if (asprintf(&d->from, "%s/%s", from, name) < 0 || asprintf(&d->to, "%s/%s", to, name) < 0) {
+        abort();
+    }
+    return d;
+}
+
+/**
+ * Record that d has been made, as a copy of the directory whose stat is sb.
+ * Called with the lock held
+ */
+static void copydir_made(copystate_t *st, copydir_t *d, const struct stat *sb) {
+    d->mode = sb->st_mode & 0777;
+    d->times[0] = sb->st_atim;
+    d->times[1] = sb->st_mtim;
+    d->made = st->made;
+    st->made = d;
+    st->dirs++;
+}
+
+/**
+ * Called once d has been copied; only where it went is kept, for copy_modes()
+ */
+static void copydir_done(void *arg, pooljob_t *job) {
+    copydir_t *d = (copydir_t *)job;
+    free(d->from);
+    d->from = NULL;
+}
+
+/**
+ * Give each directory made the mode and times of its original, now the
+ * copy has been renamed to "to", and free them. Each was made after its
+ * parent, so it's changed before its parent is - a parent's mode can't stop
+ * us reaching its kids. The first skip bytes of each path are where the
+ * copy was made. If "to" is NULL the copy failed and they're just freed
+ */
+static void copy_modes(copystate_t *st, const char *to, size_t skip) {
+    while (st->made) {
+        copydir_t *d = st->made;
+        if (to) {
+            char *path;
+            if (asprintf(&path, "%s%s", to, d->to + skip) < 0) {
+                abort();
+            }
+            chmod(path, d->mode);
+            utimensat(AT_FDCWD, path, d->times, 0);
+            free(path);
+        }
+        st->made = d->made;
+        free(d->from);
+        free(d->to);
+        free(d);
+    }
+}
+
+/**
+ * Copy the files in d and queue its subdirectories, which are created
+ * first
+ */
+static void copy_dir(void *arg, pooljob_t *job) {
+    copystate_t *st = arg;
+    copydir_t *d = (copydir_t *)job;
+    struct stat sb, lsb;
+    struct dirent *dp;
+    if (st->failed) {
+        return;
+    }
+    int sfd = open(d->from, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    int dfd = sfd < 0 ? -1 : open(d->to, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    DIR *dir = dfd < 0 ? NULL : fdopendir(sfd);
+    if (!dir) {
+        int err = errno;
+        if (sfd >= 0) {
+            close(sfd);
+        }
+        if (dfd >= 0) {
+            close(dfd);
+        }
+        pthread_mutex_lock(&st->pool.lock);
+        copy_fail(st, "opendir", d->from, NULL, err);
+        pthread_mutex_unlock(&st->pool.lock);
+        return;
+    }
+    while (!st->failed && (dp = readdir(dir))) {
+        const char *name = dp->d_name;
+        if (name[0] == '.' || !kidstat(sfd, dp, &sb)) {
+            continue;       // not listed, so not copied
+        } else if (S_ISDIR(sb.st_mode)) {
+            if (dp->d_type == DT_LNK || (dp->d_type == DT_UNKNOWN && (fstatat(sfd, name, &lsb, AT_SYMLINK_NOFOLLOW) || S_ISLNK(lsb.st_mode)))) {
+                continue;
+            }
+            int r = mkdirat(dfd, name, 0700);
+            int err = errno;
+            pthread_mutex_lock(&st->pool.lock);
+            if (r) {
+                copy_fail(st, "mkdir", d->from, name, err);
+            } else {
+                copydir_t *kid = copydir_new(d->from, d->to, name);
+                copydir_made(st, kid, &sb);
+                pool_add(&st->pool, &kid->job);
+            }
+            pthread_mutex_unlock(&st->pool.lock);
+        } else if (S_ISREG(sb.st_mode) && copy_file(st, sfd, name, dfd, name, &sb)) {
+            int err = errno;
+            pthread_mutex_lock(&st->pool.lock);
+            copy_fail(st, "file", d->from, name, err);
+            pthread_mutex_unlock(&st->pool.lock);
+        }
+    }
+    closedir(dir);
+    close(dfd);
+}
+
+static int copy_remove(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+    if (type == FTW_DP) {
+        rmdir(path);
+    } else {
+        unlink(path);
+    }
+    return 0;
+}
+
+/**
+ * Copy "path" to "to", creating the parents of "to" as needed. A directory
+ * is copied with everything in it. Fails with 409 if "to" exists. The
+ * reply counts the files and directories copied, their length and how many
+ * of the files are reflinks
+ */
+void copy(context_t *ctx) {
+    char *from, *to;
+    struct stat sb, before;
+    jsonw_t w;
+    copystate_t st;
+    int exists = 0;
+    if (move_params(ctx, "copy", &from, &to)) {
+        return;     // error already sent
+    } else if (stat(from, &sb)) {
+        send_msg(ctx, errno == ENOENT ? 404 : 500, "copy stat: %s", strerror(errno));
+        return;
+    } else if (!S_ISREG(sb.st_mode) && !S_ISDIR(sb.st_mode)) {
+        send_msg(ctx, 400, "copy: not a file or directory");
+        return;
+    }
+    size_t fromlen = strlen(from);
+    const char *fromrel = from + strlen(ctx->root) + 1, *torel = to + strlen(ctx->root) + 1;
+    if (!faccessat(AT_FDCWD, to, F_OK, AT_SYMLINK_NOFOLLOW)) {
+        send_msg(ctx, 409, "copy: \"%s\" exists", torel);
+        return;
+    } else if (S_ISDIR(sb.st_mode) && !strncmp(to, from, fromlen) && to[fromlen] == '/') {
+        send_msg(ctx, 400, "copy: can't copy \"%s\" into itself", fromrel);
+        return;
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.ctx = ctx;
+    pool_init(&st.pool, copy_dir, copydir_done, &st);
+    char *tmp = statepath(ctx, "copy", "XXXXXX");
+    int tmpfd = -1;
+    if (!tmp || !mkdtemp(tmp) || (tmpfd = open(tmp, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+        copy_fail(&st, "mkdir", tmp ? tmp : "copy", NULL, errno);
+    } else if (S_ISREG(sb.st_mode)) {
+        if (copy_file(&st, AT_FDCWD, from, tmpfd, COPYNAME, &sb)) {
+            copy_fail(&st, "file", from, NULL, errno);
+        }
+    } else if (mkdirat(tmpfd, COPYNAME, 0700)) {
+        copy_fail(&st, "mkdir", from, NULL, errno);
+    } else {
+        copydir_t *top = copydir_new(from, arena_printf(ctx, "%s/%s", tmp, COPYNAME), NULL);
+        copydir_made(&st, top, &sb);
+        pool_run(&st.pool, &top->job, COPYTHREADS);
+    }
+    if (!st.failed) {
+        mkparents(to);
+        index_before(to, &before);
+        if (rename_noreplace(tmpfd, COPYNAME, AT_FDCWD, to)) {
+            exists = errno == EEXIST || errno == ENOTEMPTY;     // created while we were copying
+            copy_fail(&st, "rename", to, NULL, errno);
+        } else {
+            copy_modes(&st, to, strlen(tmp) + 1 + strlen(COPYNAME));
+            index_update(ctx, to, &before);
+        }
+    }
+    copy_modes(&st, NULL, 0);
+    if (tmpfd >= 0) {
+        close(tmpfd);
+        nftw(tmp, copy_remove, 16, FTW_DEPTH|FTW_PHYS);
+    }
+    free(tmp);
+
+    if (exists) {
+        send_msg(ctx, 409, "copy: \"%s\" exists", torel);
+    } else if (st.failed) {
+        send_msg(ctx, 500, "%s", st.error ? st.error : "copy failed");
+    } else {
+        logmsg(ctx, "copy \"%s\" to \"%s\": %lu files, %lu directories, %lu bytes, %lu reflinks", fromrel, torel, (unsigned long)st.files, (unsigned long)st.dirs, (unsigned long)st.length, (unsigned long)st.cloned);
+        jw_start(&w, ctx, 200);
+        jw_object(&w);
+        jw_key(&w, "ok");
+        jw_boolean(&w, 1);
+        jw_key(&w, "files");
+        jw_integer(&w, st.files);
+        jw_key(&w, "dirs");
+        jw_integer(&w, st.dirs);
+        jw_key(&w, "length");
+        jw_integer(&w, st.length);
+        jw_key(&w, "reflinks");
+        jw_integer(&w, st.cloned);
+        jw_object_end(&w);
+        jw_end(&w);
+    }
+    free(st.error);
+    pool_destroy(&st.pool);
+}
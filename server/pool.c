@@ -0,0 +1,84 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+ * A pool of threads working through a tree of directories, for delete, tree
+ * and copy. Each directory is a job on a queue. A worker takes one, runs it
+ * without the lock - reading the directory, and adding a job for each of its
+ * subdirectories with pool_add() - then finishes it with the lock held. The
+ * work is done when the queue is empty and no job is running, as only a
+ * running job can add more.
+ *
+ * Each job begins with a pooljob_t. The lock is the caller's too, for
+ * anything the jobs share.
+ */
+
+void pool_init(pool_t *pool, void (*run)(void *, pooljob_t *), void (*finish)(void *, pooljob_t *), void *arg) {
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->queue = NULL;
+    pool->active = 0;
+    pool->run = run;
+    pool->finish = finish;
+    pool->arg = arg;
+}
+
+void pool_destroy(pool_t *pool) {
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+}
+
+/**
+ * Queue a job. Call with the lock held
+ */
+void pool_add(pool_t *pool, pooljob_t *job) {
+    job->next = pool->queue;
+    pool->queue = job;
+    pthread_cond_signal(&pool->cond);
+}
+
+static void *pool_worker(void *arg) {
+    pool_t *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->queue && pool->active) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (!pool->queue) {
+            break;
+        }
+        pooljob_t *job = pool->queue;
+        pool->queue = job->next;
+        pool->active++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->run(pool->arg, job);
+        pthread_mutex_lock(&pool->lock);
+        pool->finish(pool->arg, job);
+        if (--pool->active == 0) {
+            pthread_cond_broadcast(&pool->cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+ * Run job and everything it adds with this thread and up to threads - 1
+ * more, returning when it's all done. Call without the lock held
+ */
+void pool_run(pool_t *pool, pooljob_t *job, int threads) {
+    pthread_t tids[threads > 1 ? threads - 1 : 1];
+    int count = 0;
+    pthread_mutex_lock(&pool->lock);
+    pool_add(pool, job);
+    pthread_mutex_unlock(&pool->lock);
+    while (count < threads - 1 && !pthread_create(&tids[count], NULL, pool_worker, pool)) {
+        count++;
+    }
+    pool_worker(pool);
+    while (count > 0) {
+        pthread_join(tids[--count], NULL);
+    }
+}
@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STATSMAGIC 0x464d535441545303ULL   // "FMSTATS" and a version, change it if stats_t changes
+
+/*
+ * Counters for each command - requests by status, and histograms of how
+ * long they took and how many body bytes they sent and received - served
+ * by "stats" in the Prometheus text format. They're kept in a file in the
+ * state directory that's mapped shared and updated with atomic adds, so
+ * every thread of the HTTP server and every CGI process adds to the same
+ * counts at the cost of a few uncontended instructions per request. The
+ * file persists across restarts, which Prometheus is fine with; delete it
+ * to start again.
+ */
+
+static const char *commands[] = { "info", "get", "put", "delete", "mkdir", "move", "copy", "tree", "bulk", "have", "upload", "watch", "stats", "other" };
+static const char *classes[] = { "other", "2xx", "3xx", "4xx", "5xx" };
+static const uint64_t latencies[] = { 1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000 }; // microseconds
+static const uint64_t sizes[] = { 1<<10, 1<<14, 1<<18, 1<<20, 1<<24, 1<<28, 1<<30 };
+
+#define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
+#define NCLASSES (sizeof(classes) / sizeof(classes[0]))
+#define NLATENCIES (sizeof(latencies) / sizeof(latencies[0]))
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+typedef struct cmdstats {
+    uint64_t requests[NCLASSES];    // by status class
+    uint64_t latency[NLATENCIES + 1];   // not cumulative, the last is "+Inf"
+    uint64_t latency_sum;           // microseconds
+    uint64_t bytes[NSIZES + 1];
+    uint64_t bytes_sum;
+} cmdstats_t;
+
+typedef struct stats {
+    uint64_t magic;
+    cmdstats_t cmd[NCOMMANDS];
+} stats_t;
+
+static pthread_mutex_t statslock = PTHREAD_MUTEX_INITIALIZER;
+static stats_t *shared;
+static int mapped;
+
+/**
+ * Return the shared counters, mapping them the first time, or NULL if they
+ * can't be
+ */
+static stats_t *stats_map(context_t *ctx) {
+    pthread_mutex_lock(&statslock);
+    if (!mapped) {
+        mapped = 1;
+        char *path = statepath(ctx, "stats", "counters");
+        int fd = path ? open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600) : -1;
+        struct stat sb;
+        if (fd >= 0 && !fstat(fd, &sb) && (sb.st_size == sizeof(stats_t) || !ftruncate(fd, sizeof(stats_t)))) {
+            void *m = mmap(NULL, sizeof(stats_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+            if (m != MAP_FAILED) {
+                stats_t *stats = m;
+                if (stats->magic != STATSMAGIC) {
+                    memset(stats, 0, sizeof(stats_t));      // new, or an older layout
+                    stats->magic = STATSMAGIC;
+                }
+                __atomic_store_n(&shared, stats, __ATOMIC_RELEASE);
+            }
+        }
+        if (!shared) {
+            logat(ctx, LOG_WARNING, "stats \"%s\": %s", path ? path : "stats", strerror(errno));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(path);
+    }
+    pthread_mutex_unlock(&statslock);
+    return shared;
+}
+
+/**
+ * Count a request to the command at "path" which finished with the status
+ * "code" after "usec" microseconds, having sent and received "bytes"
+ */
+void stats_record(context_t *ctx, const char *path, int code, uint64_t usec, uint64_t bytes) {
+    stats_t *stats = __atomic_load_n(&shared, __ATOMIC_ACQUIRE);
+    stats = stats ? stats : stats_map(ctx);
+    if (stats) {
+        int c = 0, i;
+        while (c < NCOMMANDS - 1 && strcmp(path + 1, commands[c])) {
+            c++;
+        }
+        cmdstats_t *s = stats->cmd + c;
+        __atomic_fetch_add(&s->requests[code >= 200 && code < 600 ? code / 100 - 1 : 0], 1, __ATOMIC_RELAXED);
+        for (i=0;i<NLATENCIES && usec > latencies[i];i++);
+        __atomic_fetch_add(&s->latency[i], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&s->latency_sum, usec, __ATOMIC_RELAXED);
+        for (i=0;i<NSIZES && bytes > sizes[i];i++);
+        __atomic_fetch_add(&s->bytes[i], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&s->bytes_sum, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Send the counters in the Prometheus text format
+ */
+void stats(context_t *ctx) {
+    stats_t *stats = __atomic_load_n(&shared, __ATOMIC_ACQUIRE);
+    stats = stats ? stats : stats_map(ctx);
+    char *buf = NULL;
+    size_t len = 0;
+    if (!stats) {
+        send_msg(ctx, 500, "stats unavailable");
+        return;
+    }
+    FILE *f = open_memstream(&buf, &len);
+    fputs("# HELP filemanager_requests_total Requests by command and status class.\n", f);
+    fputs("# TYPE filemanager_requests_total counter\n", f);
+    for (int c=0;c<NCOMMANDS;c++) {
+        for (int i=0;i<NCLASSES;i++) {
+            fprintf(f, "filemanager_requests_total{command=\"%s\",code=\"%s\"} %llu\n", commands[c], classes[i], (unsigned long long)__atomic_load_n(&stats->cmd[c].requests[i], __ATOMIC_RELAXED));
+        }
+    }
+    fputs("# HELP filemanager_request_duration_seconds Time to handle a request, by command.\n", f);
+    fputs("# TYPE filemanager_request_duration_seconds histogram\n", f);
+    for (int c=0;c<NCOMMANDS;c++) {
+        cmdstats_t *s = stats->cmd + c;
+        uint64_t count = 0;
+        for (int i=0;i<=NLATENCIES;i++) {
+            count += __atomic_load_n(&s->latency[i], __ATOMIC_RELAXED);
+            if (i < NLATENCIES) {
+                fprintf(f, "filemanager_request_duration_seconds_bucket{command=\"%s\",le=\"%g\"} %llu\n", commands[c], latencies[i] / 1e6, (unsigned long long)count);
+            } else {
+                fprintf(f, "filemanager_request_duration_seconds_bucket{command=\"%s\",le=\"+Inf\"} %llu\n", commands[c], (unsigned long long)count);
+            }
+        }
+        fprintf(f, "filemanager_request_duration_seconds_sum{command=\"%s\"} %.6f\n", commands[c], __atomic_load_n(&s->latency_sum, __ATOMIC_RELAXED) / 1e6);
+        fprintf(f, "filemanager_request_duration_seconds_count{command=\"%s\"} %llu\n", commands[c], (unsigned long long)count);
+    }
+    fputs("# HELP filemanager_request_body_bytes Body bytes sent and received for a request, by command.\n", f);
+    fputs("# TYPE filemanager_request_body_bytes histogram\n", f);
+    for (int c=0;c<NCOMMANDS;c++) {
+        cmdstats_t *s = stats->cmd + c;
+        uint64_t count = 0;
+        for (int i=0;i<=NSIZES;i++) {
+            count += __atomic_load_n(&s->bytes[i], __ATOMIC_RELAXED);
+            if (i < NSIZES) {
+                fprintf(f, "filemanager_request_body_bytes_bucket{command=\"%s\",le=\"%llu\"} %llu\n", commands[c], (unsigned long long)sizes[i], (unsigned long long)count);
+            } else {
+                fprintf(f, "filemanager_request_body_bytes_bucket{command=\"%s\",le=\"+Inf\"} %llu\n", commands[c], (unsigned long long)count);
+            }
+        }
+        fprintf(f, "filemanager_request_body_bytes_sum{command=\"%s\"} %llu\n", commands[c], (unsigned long long)__atomic_load_n(&s->bytes_sum, __ATOMIC_RELAXED));
+        fprintf(f, "filemanager_request_body_bytes_count{command=\"%s\"} %llu\n", commands[c], (unsigned long long)count);
+    }
+    fclose(f);
+
+    send_status(ctx, 200);
+    fputs("Content-Type: text/plain; version=0.0.4\r\nCache-Control: no-store\r\n", ctx->out);
+    fprintf(ctx->out, "Content-Length: %zu\r\n\r\n", len);
+    fwrite(buf, 1, len, ctx->out);
+    ctx->sent += len;
+    free(buf);
+    logmsg(ctx, "tx 200 stats: %zu bytes", len);
+}
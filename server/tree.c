@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#define TREETHREADS 8           // workers walking a tree
+#define TREEPATH (PATH_MAX + 2) // longest path in the reply, with its leading "/"
+
+/*
+ * Tree lists everything under a directory in one reply, with the number of
+ * files and directories under each directory and their total size, so the
+ * client needn't call info for every directory and add them up itself.
+ *
+ * The flat listing is walked the same way delete removes a tree: a pool of
+ * workers (pool.c) each take a directory from a queue, list its files and
+ * queue its subdirectories. A directory is written when the last of its
+ * subdirectories has been, as its totals are known then, so every entry
+ * comes after everything under it. Only the directories waiting on the
+ * queue or on their subdirectories are held in memory.
+ *
+ * The nested listing has each directory's kids inside it, so it must be
+ * written in order. It's walked depth first by one thread, with one open
+ * directory for each level.
+ *
+ * Entries are listed as info lists them: regular files and directories we
+ * can read, not beginning with ".", with symlinks followed. A symlink to a
+ * directory is not, as it may lead back up the tree.
+ */
+
+typedef struct treedir {
+    pooljob_t job;
+    struct treedir *parent;
+    int pending;            // subdirectories not yet written, plus one until it's been read
+    int depth;              // 0 for the requested path
+    struct stat sb;
+    uint64_t files, dirs, length, used;
+    char path[];            // relative to the root
+} treedir_t;
+
+typedef struct treestate {
+    context_t *ctx;
+    jsonw_t *w;
+    int rootfd;
+    int maxdepth;
+    pool_t pool;            // whose lock guards everything below, and writing to w
+    size_t entries;
+} treestate_t;
+
+/**
+ * Stat the entry dp of the open directory dfd into sb and return non-zero
+ * if it should be listed
+ */
+static int tree_stat(int dfd, struct dirent *dp, struct stat *sb) {
+    struct stat lsb;
+    if (dp->d_name[0] == '.' || !kidstat(dfd, dp, sb)) {
+        return 0;
+    } else if (S_ISDIR(sb->st_mode) && dp->d_type != DT_DIR) {
+        return dp->d_type == DT_UNKNOWN && !fstatat(dfd, dp->d_name, &lsb, AT_SYMLINK_NOFOLLOW) && S_ISDIR(lsb.st_mode);
+    }
+    return 1;
+}
+
+/**
+ * Write a file or directory entry, keyed by "path" or "name"
+ */
+static void tree_write(jsonw_t *w, const char *key, const char *value, struct stat *sb) {
+    stat_write(w, key, value, sb, !canaccess(sb, W_OK));
+    if (!S_ISDIR(sb->st_mode)) {
+        jw_object_end(w);
+    }
+}
+
+/**
+ * Write the totals for a directory and close its entry
+ */
+static void tree_totals(jsonw_t *w, uint64_t files, uint64_t dirs, uint64_t length, uint64_t used) {
+    jw_key(w, "files");
+    jw_integer(w, files);
+    jw_key(w, "dirs");
+    jw_integer(w, dirs);
+    jw_key(w, "length");
+    jw_integer(w, length);
+    jw_key(w, "used");
+    jw_integer(w, used);
+    jw_object_end(w);
+}
+
+/**
+ * Return the path of "name" in d for the reply, in buf which is TREEPATH
+ * bytes - anything longer couldn't have been opened
+ */
+static char *tree_path(treedir_t *d, const char *name, char *buf) {
+    snprintf(buf, TREEPATH, "/%s%s%s", d->path, *d->path && *name ? "/" : "", name);
+    return buf;
+}
+
+static treedir_t *treedir_new(treedir_t *parent, const char *name, struct stat *sb) {
+    size_t len = parent ? strlen(parent->path) + 1 : 0;
+    treedir_t *d = calloc(1, sizeof(treedir_t) + len + strlen(name) + 1);
+    d->parent = parent;
+    d->pending = 1;
+    d->depth = parent ? parent->depth + 1 : 0;
+    d->sb = *sb;
+    if (parent && *parent->path) {
+        sprintf(d->path, "%s/%s", parent->path, name);
+    } else {
+        strcpy(d->path, name);
+    }
+    return d;
+}
+
+/**
+ * Mark d as read, or one of its subdirectories as written, and write it
+ * and then its parents if that was the last thing they were waiting on,
+ * adding their totals to their parents'. Called with the lock held
+ */
+static void tree_finish(void *arg, pooljob_t *job) {
+    treestate_t *st = arg;
+    treedir_t *d = (treedir_t *)job;
+    while (d && --d->pending == 0) {
+        treedir_t *parent = d->parent;
+        if (d->depth <= st->maxdepth) {
+            char path[TREEPATH];
+            tree_write(st->w, "path", tree_path(d, "", path), &d->sb);
+            tree_totals(st->w, d->files, d->dirs, d->length, d->used);
+            st->entries++;
+        }
+        if (parent) {
+            parent->files += d->files;
+            parent->dirs += d->dirs + 1;
+            parent->length += d->length;
+            parent->used += d->used;
+        }
+        free(d);
+        d = parent;
+    }
+}
+
+/**
+ * Write the files in d and queue its subdirectories
+ */
+static void tree_dir(void *arg, pooljob_t *job) {
+    treestate_t *st = arg;
+    treedir_t *d = (treedir_t *)job;
+    struct stat sb;
+    struct dirent *dp;
+    uint64_t files = 0, length = 0, used = 0;
+    int list = d->depth < st->maxdepth;
+    int fd = openat(st->rootfd, *d->path ? d->path : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) {
+        // Listed as empty rather than failing the whole tree
+        logmsg(st->ctx, "tree opendir \"%s\": %s", d->path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    while ((dp = readdir(dir))) {
+        if (!tree_stat(dirfd(dir), dp, &sb)) {
+            continue;
+        } else if (S_ISDIR(sb.st_mode)) {
+            treedir_t *kid = treedir_new(d, dp->d_name, &sb);
+            pthread_mutex_lock(&st->pool.lock);
+            d->pending++;
+            pool_add(&st->pool, &kid->job);
+            pthread_mutex_unlock(&st->pool.lock);
+        } else {
+            files++;
+            length += sb.st_size;
+            used += (uint64_t)sb.st_blocks * 512;
+            if (list) {
+                char path[TREEPATH];
+                tree_path(d, dp->d_name, path);
+                pthread_mutex_lock(&st->pool.lock);
+                tree_write(st->w, "path", path, &sb);
+                st->entries++;
+                pthread_mutex_unlock(&st->pool.lock);
+            }
+        }
+    }
+    closedir(dir);
+    pthread_mutex_lock(&st->pool.lock);
+    d->files += files;
+    d->length += length;
+    d->used += used;
+    pthread_mutex_unlock(&st->pool.lock);
+}
+
+/**
+ * Write the flat listing of the directory "name" with a pool of workers
+ */
+static void tree_flat(treestate_t *st, const char *name, struct stat *sb) {
+    pool_run(&st->pool, &treedir_new(NULL, name, sb)->job, TREETHREADS);
+}
+
+typedef struct treelevel {
+    DIR *dir;
+    struct stat sb;
+    uint64_t files, dirs, length, used;
+} treelevel_t;
+
+/**
+ * Write the nested listing of the directory "name", depth first. Each
+ * directory's kids are listed, then its totals once they're known
+ */
+static void tree_nested(treestate_t *st, const char *name, struct stat *sb) {
+    jsonw_t *w = st->w;
+    treelevel_t *stack = malloc(16 * sizeof(treelevel_t));
+    size_t depth = 0, size = 16;
+    struct stat ksb;
+    struct dirent *dp;
+
+    memset(stack, 0, sizeof(treelevel_t));
+    stack[0].sb = *sb;
+    tree_write(w, "path", arena_printf(st->ctx, "/%s", name), sb);
+    int fd = openat(st->rootfd, *name ? name : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd < 0 || !(stack[0].dir = fdopendir(fd))) {
+        logmsg(st->ctx, "tree opendir \"%s\": %s", name, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (st->maxdepth > 0) {
+        jw_key(w, "kids");
+        jw_array(w);
+    }
+    st->entries++;
+    for (;;) {
+        treelevel_t *top = &stack[depth];
+        if (top->dir && (dp = readdir(top->dir))) {
+            if (!tree_stat(dirfd(top->dir), dp, &ksb)) {
+                continue;
+            } else if (!S_ISDIR(ksb.st_mode)) {
+                top->files++;
+                top->length += ksb.st_size;
+                top->used += (uint64_t)ksb.st_blocks * 512;
+                if ((int)depth < st->maxdepth) {
+                    tree_write(w, "name", dp->d_name, &ksb);
+                    st->entries++;
+                }
+                continue;
+            }
+            if (depth + 1 == size) {
+                size *= 2;
+                stack = realloc(stack, size * sizeof(treelevel_t));
+                top = &stack[depth];
+            }
+            treelevel_t *kid = &stack[++depth];
+            memset(kid, 0, sizeof(treelevel_t));
+            kid->sb = ksb;
+            if ((int)depth <= st->maxdepth) {
+                tree_write(w, "name", dp->d_name, &ksb);
+                st->entries++;
+                if ((int)depth < st->maxdepth) {
+                    jw_key(w, "kids");
+                    jw_array(w);
+                }
+            }
+            if ((fd = openat(dirfd(top->dir), dp->d_name, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0 || !(kid->dir = fdopendir(fd))) {
+                logmsg(st->ctx, "tree opendir \"%s\": %s", dp->d_name, strerror(errno));
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+            continue;
+        }
+        // This directory is done: close its kids, write its totals and add them to its parent's
+        if (top->dir) {
+            closedir(top->dir);
+        }
+        if ((int)depth < st->maxdepth) {
+            jw_array_end(w);
+        }
+        if ((int)depth <= st->maxdepth) {
+            tree_totals(w, top->files, top->dirs, top->length, top->used);
+        }
+        if (depth == 0) {
+            break;
+        }
+        treelevel_t *parent = &stack[--depth];
+        parent->files += top->files;
+        parent->dirs += top->dirs + 1;
+        parent->length += top->length;
+        parent->used += top->used;
+    }
+    free(stack);
+}
+
+/**
+ * List everything under "path" (the root if missing) with the totals for
+ * each directory. The listing is flat, each directory after its contents,
+ * unless "nested=1". With "depth" only entries that many levels down are
+ * listed, though the totals still count everything
+ */
+void tree(context_t *ctx) {
+    struct stat sb;
+    const char *name = "";
+    int nested = 0, maxdepth = INT_MAX;
+    for (char **q=ctx->query;*q;) {
+        char *qkey = *q++;
+        char *qval = *q++;
+        if (!strcmp(qkey, "path")) {
+            name = qval + (*qval == '/');
+            for (char *c=qval+strlen(qval);c>name && c[-1]=='/';) {
+                *--c = 0;
+            }
+        } else if (!strcmp(qkey, "nested")) {
+            nested = !strcmp(qval, "1") || !strcmp(qval, "true");
+        } else if (!strcmp(qkey, "depth")) {
+            char *c;
+            long v = strtol(qval, &c, 10);
+            if (*c || !*qval || v < 0) {
+                send_msg(ctx, 400, "invalid depth \"%s\"", qval);
+                return;
+            }
+            maxdepth = v < INT_MAX ? v : INT_MAX;
+        }
+    }
+    if (name[0] == '.' || strstr(name, "/.")) {
+        send_msg(ctx, 400, "invalid path \"%s\"", name);
+        return;
+    }
+    int rootfd = open(*ctx->root ? ctx->root : "/", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (rootfd < 0) {
+        logmsg(ctx, "tree open \"%s\": %s", ctx->root, strerror(errno));
+        send_msg(ctx, 500, "tree: %s", strerror(errno));
+        return;
+    } else if (fstatat(rootfd, *name ? name : ".", &sb, 0)) {
+        send_msg(ctx, errno == ENOENT ? 404 : 500, "tree stat \"%s\": %s", name, strerror(errno));
+        close(rootfd);
+        return;
+    } else if (!S_ISDIR(sb.st_mode) && !S_ISREG(sb.st_mode)) {
+        send_msg(ctx, 403, "not a file or directory");
+        close(rootfd);
+        return;
+    }
+
+    jsonw_t w;
+    treestate_t st;
+    memset(&st, 0, sizeof(st));
+    st.ctx = ctx;
+    st.w = &w;
+    st.rootfd = rootfd;
+    st.maxdepth = maxdepth;
+    pool_init(&st.pool, tree_dir, tree_finish, &st);
+    jw_start(&w, ctx, 200);
+    jw_object(&w);
+    jw_key(&w, "paths");
+    jw_array(&w);
+    if (!S_ISDIR(sb.st_mode)) {
+        tree_write(&w, "path", arena_printf(ctx, "/%s", name), &sb);
+        st.entries++;
+    } else if (nested) {
+        tree_nested(&st, name, &sb);
+    } else {
+        tree_flat(&st, name, &sb);
+    }
+    jw_array_end(&w);
+    jw_key(&w, "ok");
+    jw_boolean(&w, 1);
+    jw_object_end(&w);
+    logmsg(ctx, "tx 200 tree: %lu entries in %lu bytes", (unsigned long)st.entries, (unsigned long)jw_end(&w));
+    pool_destroy(&st.pool);
+    close(rootfd);
+}
@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+
+/*
+ * Upload sessions let a file be sent as chunks in any order, several at once.
+ * A chunk with a "len" parameter declares the total length of the file. The
+ * file is assembled in STATEDIR/upload, preallocated to that length, and the
+ * byte ranges received so far are recorded in a ".ranges" file next to it,
+ * which is also the lock for the session. When every byte has arrived the
+ * file is renamed into place.
+ *
+ * The ranges file is text: the first line is "<length> <path>", then one
+ * "<start> <end>" line for each range received, sorted and merged.
+ *
+ * A session the client gives up on can be cancelled; one that's had no
+ * chunk for UPLOADEXPIRY is removed when the next session starts.
+ */
+
+#define UPLOADEXPIRY 86400      // seconds after its last chunk an unfinished session is removed
+
+typedef struct session {
+    size_t length;
+    char *path;
+    size_t count;
+    size_t *ranges;     // [start,end) pairs
+} session_t;
+
+/**
+ * Open and lock the ranges file, creating it if create is set. Return the
+ * descriptor or -1. As a completed session unlinks its ranges file, check
+ * we didn't lock one that was unlinked while we waited
+ */
+static int session_lock(const char *path, int create) {
+    for (;;) {
+        struct stat sb;
+        int fd = open(path, create ? O_CREAT|O_RDWR : O_RDWR, 0600);
+        if (fd < 0) {
+            return -1;
+        } else if (flock(fd, LOCK_EX) || fstat(fd, &sb)) {
+            close(fd);
+            return -1;
+        } else if (sb.st_nlink > 0) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+static void session_free(session_t *s) {
+    free(s->path);
+    free(s->ranges);
+    memset(s, 0, sizeof(*s));
+}
+
+/**
+ * Read the session from the locked ranges file. Return 0 on success or
+ * -1 if it's empty or invalid
+ */
+static int session_load(int fd, session_t *s) {
+    struct stat sb;
+    session_free(s);
+    if (fstat(fd, &sb) || sb.st_size == 0) {
+        return -1;
+    }
+    char *buf = malloc(sb.st_size + 1);
+    if (pread(fd, buf, sb.st_size, 0) != sb.st_size) {
+        free(buf);
+        return -1;
+    }
+    buf[sb.st_size] = 0;
+    char *c = buf, *e = strchr(buf, '\n');
+    if (!e) {
+        free(buf);
+        return -1;
+    }
+    *e = 0;
+    s->length = strtoull(c, &c, 10);
+    s->path = strdup(*c == ' ' ? c + 1 : "");
+    s->ranges = malloc(sizeof(size_t) * 2 * (sb.st_size / 4 + 1));
+    for (c=e+1;*c;) {
+        size_t start = strtoull(c, &c, 10);
+        size_t end = strtoull(c, &c, 10);
+        if (*c++ != '\n') {
+            break;
+        }
+        s->ranges[s->count * 2] = start;
+        s->ranges[s->count * 2 + 1] = end;
+        s->count++;
+    }
+    free(buf);
+    return 0;
+}
+
+static int session_save(int fd, session_t *s) {
+    size_t len = strlen(s->path) + 24 + s->count * 42;
+    char *buf = malloc(len), *c = buf;
+    c += sprintf(c, "%lu %s\n", (unsigned long)s->length, s->path);
+    for (size_t i=0;i<s->count;i++) {
+        c += sprintf(c, "%lu %lu\n", (unsigned long)s->ranges[i * 2], (unsigned long)s->ranges[i * 2 + 1]);
+    }
+    int ok = pwrite(fd, buf, c - buf, 0) == c - buf && !ftruncate(fd, c - buf);
+    free(buf);
+    return ok ? 0 : -1;
+}
+
+/**
+ * Add [start,end) to the ranges, merging with any it overlaps or touches
+ */
+static void session_add(session_t *s, size_t start, size_t end) {
+    size_t *r = s->ranges;
+    size_t i = 0, j;
+    if (start >= end) {
+        return;
+    }
+    while (i < s->count && r[i * 2 + 1] < start) {
+        i++;
+    }
+    for (j=i;j<s->count && r[j * 2] <= end;j++) {
+        start = r[j * 2] < start ? r[j * 2] : start;
+        end = r[j * 2 + 1] > end ? r[j * 2 + 1] : end;
+    }
+    // ranges i..j-1 are replaced by [start,end)
+    if (i == j) {
+        s->ranges = r = realloc(r, sizeof(size_t) * 2 * (s->count + 1));
+        memmove(r + (i + 1) * 2, r + i * 2, sizeof(size_t) * 2 * (s->count - i));
+        s->count++;
+    } else if (j > i + 1) {
+        memmove(r + (i + 1) * 2, r + j * 2, sizeof(size_t) * 2 * (s->count - j));
+        s->count -= j - i - 1;
+    }
+    r[i * 2] = start;
+    r[i * 2 + 1] = end;
+}
+
+static size_t session_received(session_t *s) {
+    size_t n = 0;
+    for (size_t i=0;i<s->count;i++) {
+        n += s->ranges[i * 2 + 1] - s->ranges[i * 2];
+    }
+    return n;
+}
+
+/**
+ * Remove the sessions in the directory dir that haven't had a chunk for
+ * UPLOADEXPIRY seconds, and any data file left without its ranges file.
+ * A session that's locked is in use, so is left alone
+ */
+static void session_expire(context_t *ctx, const char *dir) {
+    struct dirent *e;
+    struct stat sb;
+    char name[NAME_MAX + 8];
+    time_t now = time(NULL);
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    int dfd = dirfd(d);
+    while ((e=readdir(d))) {
+        char *dot = strchr(e->d_name, '.');
+        if (e->d_name[0] == '.' || fstatat(dfd, e->d_name, &sb, AT_SYMLINK_NOFOLLOW) || now - sb.st_mtime < UPLOADEXPIRY) {
+            continue;
+        } else if (!dot) {
+            snprintf(name, sizeof(name), "%s.ranges", e->d_name);
+            if (faccessat(dfd, name, F_OK, 0) && errno == ENOENT) {
+                unlinkat(dfd, e->d_name, 0);
+            }
+        } else if (!strcmp(dot, ".ranges")) {
+            int rfd = openat(dfd, e->d_name, O_RDWR|O_CLOEXEC);
+            if (rfd >= 0 && !flock(rfd, LOCK_EX|LOCK_NB) && !fstat(rfd, &sb) && sb.st_nlink > 0 && now - sb.st_mtime >= UPLOADEXPIRY) {
+                snprintf(name, sizeof(name), "%.*s", (int)(dot - e->d_name), e->d_name);
+                unlinkat(dfd, name, 0);
+                unlinkat(dfd, e->d_name, 0);
+                logmsg(ctx, "put session %s: expired", name);
+            }
+            if (rfd >= 0) {
+                close(rfd);
+            }
+        }
+    }
+    closedir(d);
+}
+
+/**
+ * With the ranges file locked, open the data file for the session for
+ * "name", starting a new session if there isn't one or it's for a file
+ * of a different length. Return the descriptor, or send an error and
+ * return -1
+ */
+static int session_open(context_t *ctx, int rfd, session_t *s, char *path, const char *name, char *dpath, size_t length) {
+    struct stat sb;
+    int dfd = -1;
+    if (!session_load(rfd, s) && s->length == length && !strcmp(s->path, name) && (dfd=open(dpath, O_RDWR)) >= 0) {
+        return dfd;
+    }
+    session_free(s);
+    s->length = length;
+    s->path = strdup(name);
+    unlink(dpath);
+    char *dir = strdup(dpath);
+    *strrchr(dir, '/') = 0;
+    session_expire(ctx, dir);
+    free(dir);
+    if (!stat(path, &sb) && !S_ISREG(sb.st_mode)) {
+        send_msg(ctx, 403, "not a file");
+    } else if (!stat(path, &sb) && access(path, W_OK)) {
+        send_msg(ctx, 403, "not writable: %s", strerror(errno));
+    } else if ((dfd=open(dpath, O_CREAT|O_EXCL|O_RDWR, 0666)) < 0) {
+        logmsg(ctx, "put session open \"%s\": %s", dpath, strerror(errno));
+        send_msg(ctx, 500, "put session open: %s", strerror(errno));
+    } else if (length && fallocate(dfd, 0, 0, length) && ftruncate(dfd, length)) {
+        logmsg(ctx, "put session allocate \"%s\": %s", dpath, strerror(errno));
+        send_msg(ctx, 507, "put session allocate: %s", strerror(errno));
+    } else if (session_save(rfd, s)) {
+        logmsg(ctx, "put session save \"%s\": %s", dpath, strerror(errno));
+        send_msg(ctx, 500, "put session save: %s", strerror(errno));
+    } else {
+        logmsg(ctx, "put session \"%s\": started for %lu bytes", name, (unsigned long)length);
+        return dfd;
+    }
+    if (dfd >= 0) {
+        close(dfd);
+        unlink(dpath);
+    }
+    return -1;
+}
+
+static void send_remaining(context_t *ctx, size_t count, size_t remaining) {
+    jsonw_t w;
+    jw_start(&w, ctx, 200);
+    jw_object(&w);
+    jw_key(&w, "ok");
+    jw_boolean(&w, 1);
+    jw_key(&w, "msg");
+    jw_string(&w, arena_printf(ctx, "wrote %lu bytes", (unsigned long)count));
+    jw_key(&w, "remaining");
+    jw_integer(&w, remaining);
+    jw_object_end(&w);
+    logmsg(ctx, "tx 200 %lu bytes", (unsigned long)jw_end(&w));
+}
+
+/**
+ * Write one chunk of an upload session. "path" is the full path of the
+ * target and "name" its path relative to the root. off is the offset of
+ * this chunk and length the total length of the file. The reply includes
+ * the number of bytes still to be received; when that's zero the file
+ * is in place
+ */
+void put_session(context_t *ctx, char *path, const char *name, size_t off, size_t length) {
+    char id[17], ids[24];
+    session_t s;
+    struct stat sb;
+    memset(&s, 0, sizeof(s));
+    statehash(name, id);
+    sprintf(ids, "%s.ranges", id);
+    char *rpath = statepath(ctx, "upload", ids);
+    char *dpath = statepath(ctx, "upload", id);
+    int rfd = -1, dfd = -1, err;
+    size_t count;
+    const char *how;
+
+    if (off == SIZE_MAX) {
+        off = 0;
+    }
+    if (off > length || (ctx->inlen != SIZE_MAX && ctx->inlen > length - off)) {
+        send_msg(ctx, 400, "chunk at %lu exceeds length %lu", (unsigned long)off, (unsigned long)length);
+    } else if (!rpath || !dpath || (rfd=session_lock(rpath, 1)) < 0) {
+        logmsg(ctx, "put session \"%s\": %s", name, strerror(errno));
+        send_msg(ctx, 500, "put session: %s", strerror(errno));
+    } else if ((dfd=session_open(ctx, rfd, &s, path, name, dpath, length)) < 0) {
+        // error already sent
+    } else if (fstat(dfd, &sb) || flock(rfd, LOCK_UN)) {
+        send_msg(ctx, 500, "put session: %s", strerror(errno));
+    } else if ((err=copyin(ctx, dfd, off, length - off, &count, &how))) {
+        logmsg(ctx, "put session write \"%s\": %s", dpath, strerror(err));
+        send_msg(ctx, 500, "put session write: %s", strerror(err));
+    } else if (ctx->inlen != SIZE_MAX && ctx->inlen > 0) {
+        send_msg(ctx, 400, "incomplete chunk, received %lu bytes", (unsigned long)count);
+    } else {
+        // The data is written without the lock, so chunks can be written in parallel
+        ino_t ino = sb.st_ino;
+        logmsg(ctx, "put session \"%s\": wrote %lu bytes at %lu with %s", name, (unsigned long)count, (unsigned long)off, how);
+        flock(rfd, LOCK_EX);
+        if ((fstat(rfd, &sb) || sb.st_nlink == 0) && !stat(path, &sb) && sb.st_ino == ino) {
+            send_remaining(ctx, count, 0);      // another chunk completed the session, ours was a repeat
+        } else if (fstat(rfd, &sb) || sb.st_nlink == 0) {
+            send_msg(ctx, 409, "upload cancelled");
+        } else if (session_load(rfd, &s) || stat(dpath, &sb) || sb.st_ino != ino) {
+            send_msg(ctx, 409, "upload restarted by another request");
+        } else {
+            session_add(&s, off, off + count);
+            size_t remaining = length - session_received(&s);
+            if (remaining) {
+                if (session_save(rfd, &s)) {
+                    send_msg(ctx, 500, "put session save: %s", strerror(errno));
+                } else {
+                    send_remaining(ctx, count, remaining);
+                }
+            } else {
+                struct stat before;
+                mkparents(path);
+                index_before(path, &before);
+                if (!stat(path, &sb) && access(path, W_OK)) {
+                    send_msg(ctx, 403, "not writable: %s", strerror(errno));
+                } else if (rename(dpath, path)) {
+                    logmsg(ctx, "put session rename \"%s\" to \"%s\": %s", dpath, path, strerror(errno));
+                    send_msg(ctx, 500, "put session rename: %s", strerror(errno));
+                } else {
+                    unlink(rpath);
+                    index_update(ctx, path, &before);
+                    logmsg(ctx, "put session \"%s\": complete", name);
+                    send_remaining(ctx, count, 0);
+                }
+            }
+        }
+    }
+    if (dfd >= 0) {
+        close(dfd);
+    }
+    if (rfd >= 0) {
+        close(rfd);
+    }
+    session_free(&s);
+    free(rpath);
+    free(dpath);
+}
+
+/**
+ * Report on the upload session for a path: the total length, the number of
+ * bytes received and the [offset,length] of every range still missing.
+ * With "cancel=1", which must be POSTed, remove the session instead
+ */
+void upload(context_t *ctx, int post) {
+    const char *name = NULL;
+    int cancel = 0;
+    for (char **q=ctx->query;*q;) {
+        char *qkey = *q++;
+        char *qval = *q++;
+        if (!strcmp(qkey, "cancel")) {
+            cancel = !strcmp(qval, "1") || !strcmp(qval, "true");
+        } else if (!strcmp(qkey, "path") && !name) {
+            name = qval;
+            if (*name == '/') {
+                name++;
+            }
+            if (name[0] == 0 || name[0] == '.' || strstr(name, "/.")) {
+                send_msg(ctx, 400, "invalid path \"%s\"", name);
+                return;
+            }
+        }
+    }
+    if (!name) {
+        send_msg(ctx, 400, "missing path");
+        return;
+    } else if (cancel && !post) {
+        send_msg(ctx, 405, "cancel must be POSTed");
+        return;
+    }
+    char id[17], ids[24];
+    session_t s;
+    memset(&s, 0, sizeof(s));
+    statehash(name, id);
+    sprintf(ids, "%s.ranges", id);
+    char *rpath = statepath(ctx, "upload", ids);
+    int rfd = rpath ? session_lock(rpath, 0) : -1;
+    if (rfd < 0 || session_load(rfd, &s) || strcmp(s.path, name)) {
+        send_msg(ctx, 404, "no upload in progress for \"%s\"", name);
+    } else if (cancel) {
+        // Chunks still being written see the ranges file has gone and fail
+        char *dpath = statepath(ctx, "upload", id);
+        if (dpath) {
+            unlink(dpath);
+        }
+        unlink(rpath);
+        free(dpath);
+        logmsg(ctx, "put session \"%s\": cancelled", name);
+        send_msg(ctx, 200, "cancelled upload of \"%s\"", name);
+    } else {
+        jsonw_t w;
+        jw_start(&w, ctx, 200);
+        jw_object(&w);
+        jw_key(&w, "ok");
+        jw_boolean(&w, 1);
+        jw_key(&w, "path");
+        jw_string(&w, arena_printf(ctx, "/%s", name));
+        jw_key(&w, "length");
+        jw_integer(&w, s.length);
+        jw_key(&w, "received");
+        jw_integer(&w, session_received(&s));
+        jw_key(&w, "missing");
+        jw_array(&w);
+        size_t pos = 0;
+        for (size_t i=0;i<=s.count;i++) {
+            size_t next = i < s.count ? s.ranges[i * 2] : s.length;
+            if (next > pos) {
+                jw_array(&w);
+                jw_integer(&w, pos);
+                jw_integer(&w, next - pos);
+                jw_array_end(&w);
+            }
+            if (i < s.count) {
+                pos = s.ranges[i * 2 + 1];
+            }
+        }
+        jw_array_end(&w);
+        jw_object_end(&w);
+        logmsg(ctx, "tx 200 upload: %lu bytes", (unsigned long)jw_end(&w));
+    }
+    if (rfd >= 0) {
+        close(rfd);
+    }
+    session_free(&s);
+    free(rpath);
+}
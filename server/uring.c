@@ -0,0 +1,388 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URINGDEPTH 32           // submission queue entries
+#define URINGBUFS 16            // registered buffers, used as two sets of half this
+#define URINGBUFSIZE (256<<10)  // size of each buffer
+#define URINGTIMEOUT 60         // seconds to wait on a stalled transfer, as the HTTP server does
+
+/*
+ * With "--io uring" get and put move file data with io_uring rather than
+ * sendfile()/splice(). Each thread has its own ring, made the first time
+ * it's used, with URINGBUFS buffers registered with the kernel so they
+ * aren't mapped for each operation. The buffers are used as two sets: while
+ * one set is written to the destination the other is filled from the
+ * source, so reading the next part of a file overlaps with sending the
+ * last, and each set's reads and writes are submitted with one system call.
+ *
+ * File reads and writes give their offset, so their order doesn't matter;
+ * reads and writes on the connection must be in order, so they're linked
+ * one after another. A short read or write on the connection breaks the
+ * link and cancels the rest, which are then submitted again. Sockets use
+ * send() and recv() with MSG_WAITALL, which the kernel retries until the
+ * buffer is done, so that's rare.
+ *
+ * The ring is made with raw system calls rather than liburing, to add no
+ * dependency. If it can't be made, or the kernel is too old to wait with a
+ * timeout, the transfer falls back to the usual path.
+ */
+
+typedef struct uring {
+    int fd;
+    int fixed;                  // the buffers are registered
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqmap, *cqmap;
+    size_t sqmaplen, cqmaplen, sqeslen;
+    unsigned pending;           // entries queued but not submitted
+    char *bufs;
+} uring_t;
+
+static __thread uring_t *thread_ring;   // kept for the life of the thread
+static __thread int thread_noring;      // don't try again
+
+static void uring_free(uring_t *r) {
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    if (r->sqes) {
+        munmap(r->sqes, r->sqeslen);
+    }
+    if (r->cqmap && r->cqmap != r->sqmap) {
+        munmap(r->cqmap, r->cqmaplen);
+    }
+    if (r->sqmap) {
+        munmap(r->sqmap, r->sqmaplen);
+    }
+    if (r->bufs) {
+        munmap(r->bufs, (size_t)URINGBUFS * URINGBUFSIZE);
+    }
+    free(r);
+}
+
+/**
+ * Return this thread's ring, making it if need be, or NULL if we can't
+ */
+static uring_t *uring_get(context_t *ctx) {
+    struct io_uring_params p;
+    if (thread_ring || thread_noring) {
+        return thread_ring;
+    }
+    uring_t *r = calloc(1, sizeof(uring_t));
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, URINGDEPTH, &p);
+    if (r->fd < 0 || !(p.features & IORING_FEAT_EXT_ARG)) {
+        logmsg(ctx, "io_uring setup: %s", r->fd < 0 ? strerror(errno) : "kernel too old");
+        thread_noring = 1;
+        uring_free(r);
+        return NULL;
+    }
+    r->sqmaplen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqmaplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sqmaplen = r->cqmaplen = r->sqmaplen > r->cqmaplen ? r->sqmaplen : r->cqmaplen;
+    }
+    r->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqmap = mmap(NULL, r->sqmaplen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cqmap = p.features & IORING_FEAT_SINGLE_MMAP ? r->sqmap : mmap(NULL, r->cqmaplen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqeslen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    r->bufs = mmap(NULL, (size_t)URINGBUFS * URINGBUFSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (r->sqmap == MAP_FAILED || r->cqmap == MAP_FAILED || r->sqes == MAP_FAILED || r->bufs == MAP_FAILED) {
+        logmsg(ctx, "io_uring mmap: %s", strerror(errno));
+        r->sqmap = r->sqmap == MAP_FAILED ? NULL : r->sqmap;
+        r->cqmap = r->cqmap == MAP_FAILED ? NULL : r->cqmap;
+        r->sqes = r->sqes == MAP_FAILED ? NULL : r->sqes;
+        r->bufs = r->bufs == MAP_FAILED ? NULL : r->bufs;
+        thread_noring = 1;
+        uring_free(r);
+        return NULL;
+    }
+    r->sqhead = (unsigned *)((char *)r->sqmap + p.sq_off.head);
+    r->sqtail = (unsigned *)((char *)r->sqmap + p.sq_off.tail);
+    r->sqmask = (unsigned *)((char *)r->sqmap + p.sq_off.ring_mask);
+    r->sqarray = (unsigned *)((char *)r->sqmap + p.sq_off.array);
+    r->cqhead = (unsigned *)((char *)r->cqmap + p.cq_off.head);
+    r->cqtail = (unsigned *)((char *)r->cqmap + p.cq_off.tail);
+    r->cqmask = (unsigned *)((char *)r->cqmap + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cqmap + p.cq_off.cqes);
+
+    // Registering pins the buffers, which is limited by RLIMIT_MEMLOCK: without it they're just slower
+    struct iovec iov[URINGBUFS];
+    for (int i=0;i<URINGBUFS;i++) {
+        iov[i].iov_base = r->bufs + (size_t)i * URINGBUFSIZE;
+        iov[i].iov_len = URINGBUFSIZE;
+    }
+    r->fixed = !syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, URINGBUFS);
+    if (!r->fixed) {
+        logmsg(ctx, "io_uring register buffers: %s", strerror(errno));
+    }
+    return thread_ring = r;
+}
+
+/**
+ * Queue a read or write of len bytes between buffer i and fd, at offset
+ * off or -1 for a stream, which is a socket if sock is set. If link is set
+ * the next entry won't start until this one is complete
+ */
+static void uring_queue(uring_t *r, int write, int fd, int sock, int i, size_t len, off_t off, int link) {
+    unsigned tail = *r->sqtail;
+    unsigned idx = tail & *r->sqmask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)(r->bufs + (size_t)i * URINGBUFSIZE);
+    sqe->len = len;
+    sqe->off = off;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    sqe->user_data = i;
+    if (sock) {
+        sqe->off = 0;       // shared with fields send() and recv() use
+        sqe->opcode = write ? IORING_OP_SEND : IORING_OP_RECV;
+        sqe->msg_flags = MSG_WAITALL | (write ? MSG_NOSIGNAL : 0);
+    } else if (r->fixed) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = i;
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    r->sqarray[idx] = idx;
+    __atomic_store_n(r->sqtail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+}
+
+/**
+ * Submit the queued entries and wait for "count" completions, setting
+ * res[i] to the result for buffer i. Return 0, or an errno value
+ */
+static int uring_wait(uring_t *r, int count, int *res) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    struct timespec now, end;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uintptr_t)&ts;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += URINGTIMEOUT;
+    while (count) {
+        unsigned head = *r->cqhead;
+        unsigned tail = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE);
+        for (;head!=tail && count;head++,count--) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cqmask];
+            res[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+        if (count) {
+            // The timeout is for the whole wait, not each call
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long ns = (end.tv_sec - now.tv_sec) * 1000000000LL + end.tv_nsec - now.tv_nsec;
+            if (ns <= 0) {
+                return ETIMEDOUT;
+            }
+            ts.tv_sec = ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+            int n = syscall(__NR_io_uring_enter, r->fd, r->pending, count, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+            if (n >= 0) {
+                r->pending -= n;
+            } else if (errno == ETIME) {
+                return ETIMEDOUT;
+            } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                return errno;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Abandon this thread's ring after an error, with transfers still queued
+ * on it; closing it cancels them. The next transfer makes a new one
+ */
+static void uring_abandon(void) {
+    uring_free(thread_ring);
+    thread_ring = NULL;
+}
+
+/**
+ * Write the buffers first to last-1 of set s, holding len[i] bytes each, to
+ * the stream fd in order, while reading the next set with "reads" entries
+ * already queued. Return 0 or an errno value
+ */
+static int uring_stream_write(uring_t *r, int fd, int sock, int first, int last, size_t *len, int reads, int *res) {
+    size_t done[URINGBUFS] = { 0 };
+    int err = 0;
+    while (!err && (first < last || reads)) {
+        for (int i=first;i<last;i++) {
+            uring_queue(r, 1, fd, sock, i, len[i] - done[i], -1, i + 1 < last);
+            // A partial send is sent on from where it stopped
+            if (done[i]) {
+                r->sqes[(*r->sqtail - 1) & *r->sqmask].addr += done[i];
+            }
+        }
+        if ((err=uring_wait(r, last - first + reads, res))) {
+            break;
+        }
+        reads = 0;
+        for (int i=first;i<last && !err;i++) {
+            if (res[i] > 0) {
+                done[i] += res[i];
+            } else if (res[i] != -ECANCELED && res[i] != -EAGAIN && res[i] != -EINTR) {
+                err = res[i] ? -res[i] : EIO;
+            }
+            if (done[i] < len[i]) {
+                break;
+            }
+            first++;
+        }
+    }
+    return err;
+}
+
+/**
+ * Send len bytes from offset off of the file fd to the response with
+ * io_uring, adding the bytes sent to *sent. Return 0 if that was tried,
+ * even if it failed part way, or -1 if io_uring isn't available
+ */
+int uring_copyout(context_t *ctx, int fd, off_t off, size_t len, size_t *sent) {
+    struct stat sb;
+    size_t buflen[URINGBUFS];
+    int res[URINGBUFS];
+    uring_t *r = uring_get(ctx);
+    if (!r) {
+        return -1;
+    }
+    int sock = !fstat(ctx->outfd, &sb) && S_ISSOCK(sb.st_mode);
+    int half = URINGBUFS / 2, set = 0, err = 0, reads = 0;
+    size_t queued = 0;      // bytes that have been queued to read
+    fflush(ctx->out);
+
+    // Read the first set, then write each set as the next is read
+    for (int i=0;i<half && queued<len;i++,reads++) {
+        buflen[i] = len - queued < URINGBUFSIZE ? len - queued : URINGBUFSIZE;
+        uring_queue(r, 0, fd, 0, i, buflen[i], off + queued, 0);
+        queued += buflen[i];
+    }
+    err = uring_wait(r, reads, res);
+    while (!err && reads) {
+        int first = set * half, last = first + reads;
+        for (int i=first;i<last && !err;i++) {
+            if (res[i] != (int)buflen[i]) {
+                err = res[i] < 0 ? -res[i] : EIO;   // the file was truncated
+            }
+        }
+        if (err) {
+            break;
+        }
+        set = !set;
+        reads = 0;
+        for (int i=set*half;i<set*half+half && queued<len;i++,reads++) {
+            buflen[i] = len - queued < URINGBUFSIZE ? len - queued : URINGBUFSIZE;
+            uring_queue(r, 0, fd, 0, i, buflen[i], off + queued, 0);
+            queued += buflen[i];
+        }
+        if (!(err=uring_stream_write(r, ctx->outfd, sock, first, last, buflen, reads, res))) {
+            for (int i=first;i<last;i++) {
+                *sent += buflen[i];
+            }
+        }
+    }
+    if (err) {
+        logmsg(ctx, "io_uring send: %s", strerror(err));
+        uring_abandon();
+    }
+    return 0;
+}
+
+/**
+ * Write up to max bytes of the request body to the file fd at offset off
+ * with io_uring, adding the bytes written to *count. The body must have a
+ * known length and none of it buffered. Return 0 or an errno value, or -1
+ * if io_uring isn't available
+ */
+int uring_copyin(context_t *ctx, int fd, off_t off, size_t max, size_t *count) {
+    struct stat sb;
+    size_t buflen[URINGBUFS];
+    int res[URINGBUFS];
+    uring_t *r = uring_get(ctx);
+    if (!r) {
+        return -1;
+    }
+    int sock = !fstat(ctx->infd, &sb) && S_ISSOCK(sb.st_mode);
+    int half = URINGBUFS / 2, set = 0, err = 0, writes = 0, eof = 0;
+    if (max > ctx->inlen) {
+        max = ctx->inlen;
+    }
+
+    // Receive a set, then write each set to the file as the next is received
+    while (!err && !eof && (max || writes)) {
+        int first = set * half, reads = 0;
+        size_t asked = 0;
+        for (int i=first;i<first+half && asked<max;i++,reads++) {
+            buflen[i] = max - asked < URINGBUFSIZE ? max - asked : URINGBUFSIZE;
+            uring_queue(r, 0, ctx->infd, sock, i, buflen[i], -1, i + 1 < first + half && asked + buflen[i] < max);
+            asked += buflen[i];
+        }
+        if ((err=uring_wait(r, reads + writes, res))) {
+            break;
+        }
+        for (int i=!set*half;i<!set*half+writes && !err;i++) {
+            if (res[i] != (int)buflen[i]) {
+                err = res[i] < 0 ? -res[i] : EIO;
+            } else {
+                *count += buflen[i];
+            }
+        }
+        // A short receive breaks the link, so the rest are cancelled and received next time
+        writes = 0;
+        for (int i=first;i<first+reads && !err;i++) {
+            size_t want = buflen[i];
+            if (res[i] == 0) {
+                eof = 1;
+                break;
+            } else if (res[i] < 0 && res[i] != -ECANCELED && res[i] != -EINTR && res[i] != -EAGAIN) {
+                err = -res[i];
+            } else if (res[i] > 0) {
+                buflen[i] = res[i];
+                uring_queue(r, 1, fd, 0, i, buflen[i], off, 0);
+                off += res[i];
+                max -= res[i];
+                if (ctx->inlen != SIZE_MAX) {
+                    ctx->inlen -= res[i];
+                }
+                writes++;
+            }
+            if (res[i] != (int)want) {
+                break;
+            }
+        }
+        set = !set;
+    }
+    if (!err && writes && !(err=uring_wait(r, writes, res))) {
+        for (int i=!set*half;i<!set*half+writes && !err;i++) {
+            if (res[i] != (int)buflen[i]) {
+                err = res[i] < 0 ? -res[i] : EIO;
+            } else {
+                *count += buflen[i];
+            }
+        }
+    }
+    if (err) {
+        logmsg(ctx, "io_uring receive: %s", strerror(err));
+        uring_abandon();
+    }
+    return err;
+}
@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+#include "filemanager.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define WATCHMAX 1024           // most clients watching at once
+#define WATCHBEAT 25            // seconds between comments sent to keep a quiet stream open through proxies
+#define WATCHEVENTS (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_CLOSE_WRITE|IN_ATTRIB|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR)
+
+/*
+ * Watch streams the changes to a directory as Server-Sent Events, so a
+ * client can keep its listing current without asking for it again. It needs
+ * the HTTP server: a CGI process can't outlive its request.
+ *
+ * The response headers are sent by the worker thread that handles the
+ * request, which then hands a duplicate of the socket to a single watch
+ * thread and returns. The worker's copy is closed as any other finished
+ * response's would be, ending nothing while the duplicate is open, and the
+ * worker is free for other requests. The watch thread has one inotify
+ * descriptor with a watch for each directory being watched, shared by every
+ * client watching it, and an epoll loop on that and the clients' sockets,
+ * to see them go.
+ *
+ * Each event names a path, which the client can look up with info: "change"
+ * for one created, written, moved in or with its permissions changed, and
+ * "delete" for one removed or moved out. Dotfiles aren't reported. If the
+ * directory itself goes, or inotify drops events, the client is sent
+ * "reset" and the stream is closed; it should list the directory again.
+ * Sockets are written without blocking, so a client that can't keep up is
+ * closed too. Each stream starts with "ready" once the watch is in place.
+ */
+
+typedef struct watch watch_t;
+
+typedef struct watcher {
+    struct watcher *next;
+    int fd;
+    watch_t *watch;
+} watcher_t;
+
+struct watch {
+    watch_t *next;
+    int wd;
+    char *path;             // the directory as the client sees it, ending in "/"
+    watcher_t *watchers;
+};
+
+static pthread_mutex_t watchlock = PTHREAD_MUTEX_INITIALIZER;
+static int started, ifd = -1, epfd = -1, count;
+static watch_t *watches;
+static context_t watchctx;  // for logging from the watch thread
+
+/**
+ * Close a watcher, and the watch if no-one else is watching. Called with the
+ * lock held
+ */
+static void watcher_close(watcher_t *w) {
+    watch_t *watch = w->watch;
+    for (watcher_t **p=&watch->watchers;*p;p=&(*p)->next) {
+        if (*p == w) {
+            *p = w->next;
+            break;
+        }
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, NULL);
+    close(w->fd);
+    free(w);
+    count--;
+    if (!watch->watchers) {
+        for (watch_t **p=&watches;*p;p=&(*p)->next) {
+            if (*p == watch) {
+                *p = watch->next;
+                break;
+            }
+        }
+        inotify_rm_watch(ifd, watch->wd);
+        logmsg(&watchctx, "watch \"%s\": done", watch->path);
+        free(watch->path);
+        free(watch);
+    }
+}
+
+/**
+ * Send msg to everyone watching "watch", closing those who can't take it.
+ * Called with the lock held
+ */
+static void watch_send(watch_t *watch, const char *msg, size_t len) {
+    for (watcher_t *w=watch->watchers, *next;w;w=next) {
+        next = w->next;
+        if (send(w->fd, msg, len, MSG_NOSIGNAL|MSG_DONTWAIT) != (ssize_t)len) {
+            watcher_close(w);       // if it's the last, that frees watch, but then next is NULL
+        }
+    }
+}
+
+/**
+ * Send "reset" to everyone watching "watch" and close it
+ */
+static void watch_reset(watch_t *watch) {
+    static const char msg[] = "event: reset\ndata: {}\n\n";
+    while (watch->watchers) {
+        watcher_t *w = watch->watchers;
+        send(w->fd, msg, sizeof(msg) - 1, MSG_NOSIGNAL|MSG_DONTWAIT);
+        if (!w->next) {
+            watcher_close(w);   // frees watch
+            return;
+        }
+        watcher_close(w);
+    }
+}
+
+/**
+ * Format an event for "name" in the directory "dir" into buf, escaping the
+ * path as a JSON string. Return its length, or 0 if it doesn't fit
+ */
+static size_t watch_event(char *buf, size_t size, const char *type, const char *dir, const char *name) {
+    size_t len = snprintf(buf, size, "event: %s\ndata: {\"path\":\"", type);
+    for (int i=0;i<2;i++) {
+        for (const unsigned char *c=(const unsigned char *)(i ? name : dir);*c && len + 8 < size;c++) {
+            if (*c == '"' || *c == '\\') {
+                buf[len++] = '\\';
+                buf[len++] = *c;
+            } else if (*c < 0x20) {
+                len += snprintf(buf + len, size - len, "\\u%04x", *c);
+            } else {
+                buf[len++] = *c;
+            }
+        }
+    }
+    if (len + 8 >= size) {
+        return 0;
+    }
+    memcpy(buf + len, "\"}\n\n", 4);
+    return len + 4;
+}
+
+/**
+ * Pass on what inotify has read into buf
+ */
+static void watch_events(char *buf, ssize_t len) {
+    char msg[PATH_MAX * 2 + 64], last[sizeof(msg)];
+    size_t lastlen = 0;
+    int lastwd = -1;
+    for (char *p=buf;p<buf+len;) {
+        struct inotify_event *ev = (struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + ev->len;
+        if (ev->mask & IN_Q_OVERFLOW) {
+            logmsg(&watchctx, "watch: events overflowed");
+            while (watches) {
+                watch_reset(watches);
+            }
+            continue;
+        }
+        watch_t *watch = watches;
+        while (watch && watch->wd != ev->wd) {
+            watch = watch->next;
+        }
+        if (!watch) {
+            continue;       // one we've closed
+        } else if (ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED|IN_UNMOUNT)) {
+            logmsg(&watchctx, "watch \"%s\": gone", watch->path);
+            watch_reset(watch);
+            continue;
+        } else if (!ev->len || ev->name[0] == '.') {
+            continue;
+        }
+        const char *type = ev->mask & (IN_DELETE|IN_MOVED_FROM) ? "delete" : "change";
+        size_t l = watch_event(msg, sizeof(msg), type, watch->path, ev->name);
+        // A file that's created and written comes as several events in a row; one will do
+        if (l && (ev->wd != lastwd || l != lastlen || memcmp(msg, last, l))) {
+            watch_send(watch, msg, l);
+            memcpy(last, msg, l);
+            lastlen = l;
+            lastwd = ev->wd;
+        }
+    }
+}
+
+static void *watch_thread(void *arg) {
+    struct epoll_event events[64];
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    time_t beat = time(NULL);
+    for (;;) {
+        int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), WATCHBEAT * 1000);
+        pthread_mutex_lock(&watchlock);
+        for (int i=0;i<n;i++) {
+            watcher_t *w = events[i].data.ptr;
+            if (!w) {
+                ssize_t len = read(ifd, buf, sizeof(buf));
+                if (len > 0) {
+                    watch_events(buf, len);
+                }
+                continue;
+            }
+            // It may have been closed by the inotify events above, so it's only still open if it's in a watch
+            watcher_t *x = NULL;
+            for (watch_t *watch=watches;watch && x != w;watch=watch->next) {
+                for (x=watch->watchers;x && x != w;x=x->next);
+            }
+            // Clients send nothing on an event stream, so anything readable is the end of it
+            char tmp[256];
+            ssize_t l = x ? recv(w->fd, tmp, sizeof(tmp), MSG_DONTWAIT) : 1;
+            if (x && (l == 0 || (l < 0 && errno != EAGAIN && errno != EINTR) || (events[i].events & (EPOLLRDHUP|EPOLLHUP|EPOLLERR)))) {
+                watcher_close(w);
+            }
+        }
+        time_t now = time(NULL);
+        if (now - beat >= WATCHBEAT) {
+            beat = now;
+            for (watch_t *watch=watches, *next;watch;watch=next) {
+                next = watch->next;
+                watch_send(watch, ":\n\n", 3);
+            }
+        }
+        pthread_mutex_unlock(&watchlock);
+    }
+    return NULL;
+}
+
+/**
+ * Start the watch thread if it's not running. Called with the lock held.
+ * Return 0 or -1 with errno set
+ */
+static int watch_start(context_t *ctx) {
+    pthread_t thread;
+    struct epoll_event ev;
+    if (started) {
+        return 0;
+    } else if ((ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0) {
+        return -1;
+    } else if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        close(ifd);
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, ifd, &ev);
+    watchctx = *ctx;
+    watchctx.arena = NULL;
+    if (pthread_create(&thread, NULL, watch_thread, NULL)) {
+        close(ifd);
+        close(epfd);
+        return -1;
+    }
+    pthread_detach(thread);
+    started = 1;
+    return 0;
+}
+
+/**
+ * Stream the changes to the directory "path" as Server-Sent Events
+ */
+void watch(context_t *ctx) {
+    struct stat sb;
+    struct epoll_event ev;
+    const char *name = "";
+    for (char **q=ctx->query;*q;) {
+        char *qkey = *q++;
+        char *qval = *q++;
+        if (!strcmp(qkey, "path")) {
+            name = qval[0] == '/' ? qval + 1 : qval;
+        }
+    }
+    size_t namelen = strlen(name);
+    while (namelen > 0 && name[namelen - 1] == '/') {
+        namelen--;
+    }
+    name = arena_strndup(ctx, name, namelen);
+    char *path = arena_printf(ctx, "%s/%s", ctx->root, name);
+    if (name[0] == '.' || strstr(name, "/.")) {
+        send_msg(ctx, 400, "invalid path \"%s\"", name);
+        return;
+    } else if (!ctx->http) {
+        send_msg(ctx, 501, "watch needs the HTTP server");
+        return;
+    } else if (stat(path, &sb)) {
+        send_msg(ctx, 404, "watch stat \"%s\": %s", name, strerror(errno));
+        return;
+    } else if (!S_ISDIR(sb.st_mode)) {
+        send_msg(ctx, 400, "not a directory");
+        return;
+    }
+
+    pthread_mutex_lock(&watchlock);
+    watch_t *watch = NULL;
+    int wd = -1, fd = -1;
+    if (count >= WATCHMAX) {
+        pthread_mutex_unlock(&watchlock);
+        send_msg(ctx, 503, "too many watching");
+        return;
+    } else if (watch_start(ctx) || (wd = inotify_add_watch(ifd, path, WATCHEVENTS)) < 0) {
+        int err = errno;
+        pthread_mutex_unlock(&watchlock);
+        logmsg(ctx, "watch \"%s\": %s", path, strerror(err));
+        send_msg(ctx, err == ENOSPC ? 503 : 500, "watch: %s", strerror(err));
+        return;
+    }
+    // The same directory has the same watch, however many are watching it
+    for (watch = watches;watch && watch->wd != wd;watch = watch->next);
+    if (!watch) {
+        watch = calloc(1, sizeof(watch_t));
+        watch->wd = wd;
+        if (asprintf(&watch->path, "/%s%s", name, *name ? "/" : "") < 0) {
+            abort();
+        }
+        watch->next = watches;
+        watches = watch;
+    }
+
+    ctx->keepalive = 0;     // the stream ends when the connection does
+    send_status(ctx, 200);
+    fputs("Content-Type: text/event-stream\r\n", ctx->out);
+    fputs("Cache-Control: no-store\r\n", ctx->out);
+    fputs("X-Accel-Buffering: no\r\n", ctx->out);   // so a proxy in front doesn't hold events back
+    fputs("\r\n", ctx->out);
+    int len = fprintf(ctx->out, "event: ready\ndata: {}\n\n");
+    ctx->sent += len > 0 ? len : 0;
+    if (fflush(ctx->out) || (fd = fcntl(ctx->outfd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        logmsg(ctx, "watch \"%s\": %s", path, strerror(errno));
+    } else {
+        // The socket is shared with the worker's copy, which has nothing left to send
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        watcher_t *w = calloc(1, sizeof(watcher_t));
+        w->fd = fd;
+        w->watch = watch;
+        w->next = watch->watchers;
+        watch->watchers = w;
+        count++;
+        ev.events = EPOLLIN|EPOLLRDHUP;
+        ev.data.ptr = w;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        logmsg(ctx, "watch \"%s\": %d watching", watch->path, count);
+    }
+    if (!watch->watchers) {
+        // Never used, as the client had gone
+        watches = watch->next;
+        inotify_rm_watch(ifd, watch->wd);
+        free(watch->path);
+        free(watch);
+    }
+    pthread_mutex_unlock(&watchlock);
+}